@@ -97,6 +97,11 @@ typedef struct {
   pthread_mutex_t reads_lock;
   unsigned long number_of_pending_reads;
 
+  /* The buffers in which the threads compress and uncompress pages,
+     see `io_compress_page'. */
+  word_t *write_buffer;
+  word_t *read_buffer;
+
 #ifdef FILE_LOAD_BALANCING
   long load;
   long load_history[FILE_LOAD_HISTORY_SIZE];
@@ -181,6 +186,13 @@ void prepare_file (unsigned long file_number)
 
   f->number = file_number;
 
+  f->write_buffer = malloc(PAGE_SIZE);
+  f->read_buffer = malloc(PAGE_SIZE);
+  if (f->write_buffer == NULL || f->read_buffer == NULL) {
+    perror("prepare_file/malloc");
+    exit(1);
+  }
+
   pthread_cond_init(&f->write_is_waiting, NULL);
   pthread_cond_init(&f->write_is_finished, NULL);
   f->head_of_pending_writes = NULL;
@@ -384,6 +396,8 @@ void *writer_thread (void *arg)
 {
   file_t *f;
   aio_t *aio;
+  ptr_t data;
+  unsigned long number_of_bytes;
 #ifdef FILE_LOAD_BALANCING
   long start_usec, start_sec, usec_taken;
   struct timeval tv;
@@ -433,13 +447,25 @@ void *writer_thread (void *arg)
     start_usec = tv.tv_usec;
 #endif
     
+    /* Compress the page here rather than in the thread that
+       requested the write. */
+    data = aio->data;
+    number_of_bytes = 0;
+    if (compressed_pages)
+      number_of_bytes =
+	io_compress_page(aio->data, aio->number_of_bytes, f->write_buffer);
+    if (number_of_bytes == 0)
+      number_of_bytes = aio->number_of_bytes;
+    else
+      data = f->write_buffer;
+
     if (lseek(f->fd, disk_skip_nbytes + aio->page_number * PAGE_SIZE,
 	      SEEK_SET) == -1) {
       perror("writer_thread/lseek");
       exit(1);
     }
-    if (write(f->fd, (void *) aio->data, aio->number_of_bytes)
-	!= (signed long) aio->number_of_bytes) {
+    if (write(f->fd, (void *) data, number_of_bytes)
+	!= (signed long) number_of_bytes) {
       perror("writer_thread/write");
       exit(1);
     }
@@ -544,6 +570,7 @@ void *reader_thread (void *arg)
       perror("reader_thread/read");
       exit(1);
     }
+    io_uncompress_page(aio->data, f->read_buffer);
 
     if (pthread_mutex_lock(&free_aios_lock)) {
       perror("reader_thread/pthread_mutex_lock");
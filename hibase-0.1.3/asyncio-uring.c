@@ -0,0 +1,359 @@
+/* This file is part of the Shades main memory database system.
+ *
+ * Copyright (c) 1996 Nokia Telecommunications
+ * All Rights Reserved.
+ *
+ * Authors: Kenneth Oksanen <cessu@iki.fi>
+ *          Antti-Pekka Liedes <apl@cs.hut.fi>
+ */
+
+/* Asynchronous supplementary IO routines using Linux io_uring.
+ */
+
+static char *rev_id = "$Id$";
+static char *rev_host = SHADES_REV_HOST;
+static char *rev_date = SHADES_REV_DATE;
+static char *rev_by = SHADES_REV_BY;
+static char *rev_cc = SHADES_REV_CC;
+
+
+/* `MAP_POPULATE' and `syscall' are not declared in strict ISO C mode,
+   e.g. with `--enable-warnings'. */
+#define _DEFAULT_SOURCE 1
+
+#include "includes.h"
+#include "params.h"
+#include "io.h"
+#include "cookies.h"
+#include "bitops.h"
+#include "root.h"
+
+
+/* The ring is set up and driven with the raw system calls, so that
+   liburing is not needed.  IORING_OP_READ and IORING_OP_WRITE require
+   Linux 5.6 or newer. */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* If `O_DSYNC' is given, use it in file modes.  Otherwise, use
+   `O_SYNC'.  If even it isn't given, use `fsync'-calls. */
+#ifdef O_DSYNC
+#define O_SYNC_FLAG  O_DSYNC
+#else
+#ifdef O_SYNC
+#define O_SYNC_FLAG  O_SYNC
+#else
+#define USE_FSYNC  1
+#define O_SYNC_FLAG  0
+#endif
+#endif
+
+
+/* The number of submission queue entries.  At most this many reads
+   and writes are outstanding at any time.  Writes are queued without
+   entering the kernel, so a commit group of at most this many pages
+   is written with a single system call. */
+#define URING_ENTRIES  256
+
+
+/* The file descriptor of the ring, or -1 if io_uring is not
+   available, in which case the IO system falls back to synchronous
+   IO. */
+static int ring_fd = -1;
+
+/* The submission and completion rings shared with the kernel. */
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+
+/* The number of entries placed in the submission ring but not yet
+   passed to the kernel, and the number of entries passed to the
+   kernel whose completions have not yet been reaped. */
+static unsigned number_of_unsubmitted = 0;
+static unsigned number_of_in_flight = 0;
+
+static unsigned long number_of_pending_writes = 0;
+static unsigned long number_of_pending_reads = 0;
+
+/* Each file is associated with a filedescriptor, the descriptors
+   are recorded into this table. */
+static int *filedesc = NULL;
+
+/* The number of writes outstanding on each file. */
+static long *file_load = NULL;
+
+/* Number of files in use. */
+static unsigned long number_of_files = 0;
+
+
+/* The `user_data' of an entry tells the file, the direction and the
+   expected length of the transfer. */
+#define MAKE_USER_DATA(file_number, is_read, number_of_bytes)	\
+  (((__u64) (number_of_bytes) << 32)				\
+   | ((__u64) (file_number) << 1) | (is_read))
+#define USER_DATA_IS_READ(x)  ((x) & 1)
+#define USER_DATA_FILE_NUMBER(x)  ((unsigned long) ((x) & 0xFFFFFFFF) >> 1)
+#define USER_DATA_NUMBER_OF_BYTES(x)  ((long) ((x) >> 32))
+
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+  int n;
+
+  do
+    n = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		flags, NULL, 0);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    perror("asyncio/io_uring_enter");
+    exit(1);
+  }
+  return n;
+}
+
+
+/* Pass the queued entries to the kernel, wait until at least
+   `min_complete' of the outstanding ones have completed, and reap
+   all completions. */
+static void uring_submit_and_wait(unsigned min_complete)
+{
+  unsigned head, tail;
+  struct io_uring_cqe *cqe;
+  __u64 x;
+  int n;
+
+  n = uring_enter(number_of_unsubmitted, min_complete,
+		  min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+  number_of_unsubmitted -= n;
+  number_of_in_flight += n;
+
+  head = *cq_head;
+  tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    cqe = &cqes[head & *cq_mask];
+    x = cqe->user_data;
+    if (cqe->res != USER_DATA_NUMBER_OF_BYTES(x)) {
+      if (cqe->res < 0)
+	fprintf(stderr, "asyncio: %s failed: %s\n",
+		USER_DATA_IS_READ(x) ? "read" : "write",
+		strerror(-cqe->res));
+      else
+	fprintf(stderr, "asyncio: Short %s of %d bytes.\n",
+		USER_DATA_IS_READ(x) ? "read" : "write", cqe->res);
+      exit(1);
+    }
+    if (USER_DATA_IS_READ(x))
+      number_of_pending_reads--;
+    else {
+      number_of_pending_writes--;
+      file_load[USER_DATA_FILE_NUMBER(x)]--;
+    }
+    number_of_in_flight--;
+    head++;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Queue a read or write of a page.  The entry is passed to the
+   kernel only when the ring fills or the caller drains. */
+static void uring_queue(int opcode, unsigned long file_number,
+			unsigned long page_number,
+			ptr_t ptr, unsigned long number_of_bytes)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  /* The completion ring is twice the size of the submission ring, so
+     keeping the number of outstanding entries below `sq_entries'
+     guarantees that neither overflows. */
+  if (number_of_unsubmitted + number_of_in_flight == sq_entries)
+    uring_submit_and_wait(1);
+
+  tail = *sq_tail;
+  index = tail & *sq_mask;
+  sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = filedesc[file_number];
+  sqe->off = disk_skip_nbytes + page_number * PAGE_SIZE;
+  sqe->addr = (__u64) (ptr_as_scalar_t) ptr;
+  sqe->len = number_of_bytes;
+  sqe->user_data = MAKE_USER_DATA(file_number, opcode == IORING_OP_READ,
+				  number_of_bytes);
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  number_of_unsubmitted++;
+}
+
+
+/* Set up the ring.  Leaves `ring_fd' to -1 if the kernel does not
+   support io_uring or does not let us use it. */
+static void uring_init(void)
+{
+  struct io_uring_params p;
+  char *sq_ring, *cq_ring;
+  unsigned long sq_ring_size, cq_ring_size;
+
+  memset(&p, 0, sizeof(p));
+  ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring_fd == -1) {
+    if (be_verbose)
+      perror("asyncio_init/io_uring_setup");
+    return;
+  }
+  sq_entries = p.sq_entries;
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_ring_size > sq_ring_size)
+    sq_ring_size = cq_ring_size;
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    perror("asyncio_init/mmap");
+    exit(1);
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring = sq_ring;
+  else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      perror("asyncio_init/mmap");
+      exit(1);
+    }
+  }
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    perror("asyncio_init/mmap");
+    exit(1);
+  }
+
+  sq_head = (unsigned *) (sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *) (sq_ring + p.sq_off.tail);
+  sq_mask = (unsigned *) (sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq_ring + p.sq_off.array);
+  cq_head = (unsigned *) (cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *) (cq_ring + p.cq_off.tail);
+  cq_mask = (unsigned *) (cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+}
+
+
+/* Initialize the asynchronous IO subsystem, should always be called from
+   `io_init' and from nowhere else. */
+void asyncio_init (unsigned long num_of_files)
+{
+  number_of_files = num_of_files;
+  filedesc = (int *) malloc(num_of_files * sizeof(int));
+  file_load = (long *) calloc(num_of_files, sizeof(long));
+  if (filedesc == NULL || file_load == NULL) {
+    fprintf(stderr, "Failed to allocate filedescriptor table for Async IO.\n");
+    exit(1);
+  }
+  uring_init();
+  if (ring_fd == -1 && be_verbose)
+    fprintf(stderr, "asyncio_init: io_uring is not available, "
+	    "using synchronous IO.\n");
+}
+
+/* These two are called when files are created and opened, respectively.
+   Here we duplicate the given descriptors into our own fd table, as
+   the other asynchronous IO variants do. */
+void asyncio_create_file (unsigned long file_number, int fd)
+{
+  filedesc[file_number] = dup(fd);
+  if (filedesc[file_number] == -1) {
+    perror("asyncio_create_file/dup");
+    exit(1);
+  }
+}
+
+void asyncio_open_file (unsigned long file_number, int fd)
+{
+  filedesc[file_number] = dup(fd);
+  if (filedesc[file_number] == -1) {
+    perror("asyncio_open_file/dup");
+    exit(1);
+  }
+}
+
+/* This is called whenever a database file is closed. */
+void asyncio_close_file (unsigned long file_number, int fd)
+{
+  if (ring_fd != -1 && number_of_unsubmitted + number_of_in_flight > 0)
+    uring_submit_and_wait(number_of_unsubmitted + number_of_in_flight);
+  close(filedesc[file_number]);
+}
+
+/* Queue a write of the page.  Returns -1 if io_uring is not available
+   (the caller should use synchronous write in this case), 0 on
+   success. */
+int asyncio_write_page(unsigned long file_number, unsigned long page_number,
+		       ptr_t ptr, unsigned long number_of_bytes)
+{
+  if (ring_fd == -1)
+    return -1;
+  uring_queue(IORING_OP_WRITE, file_number, page_number,
+	      ptr, number_of_bytes);
+  number_of_pending_writes++;
+  file_load[file_number]++;
+  return 0;
+}
+
+int asyncio_read_page(unsigned long file_number, unsigned long page_number,
+		      ptr_t ptr, unsigned long number_of_bytes)
+{
+  if (ring_fd == -1)
+    return -1;
+  uring_queue(IORING_OP_READ, file_number, page_number,
+	      ptr, number_of_bytes);
+  number_of_pending_reads++;
+  return 0;
+}
+
+/* Submit all queued writes with one system call and wait until they
+   are on the disk.  Since the files are opened with `O_SYNC_FLAG', a
+   completed write is stable, and `io_write_root' can write the root
+   block right after this returns. */
+void asyncio_drain_pending_writes (void)
+{
+#ifdef USE_FSYNC
+  unsigned long i;
+#endif
+
+  while (number_of_pending_writes > 0)
+    uring_submit_and_wait(number_of_pending_writes);
+
+#ifdef USE_FSYNC
+  for (i = 0; i < number_of_files; i++) {
+    fsync(filedesc[i]);
+  }
+#endif
+}
+
+/* Drains all pending reads, suspends the process until all asynchronous
+   reads are in the memory. */
+void asyncio_drain_pending_reads (void)
+{
+  while (number_of_pending_reads > 0)
+    uring_submit_and_wait(number_of_pending_reads);
+}
+
+
+/* The load of a file is the number of its outstanding writes. */
+long asyncio_get_file_load(unsigned long file_number)
+{
+  return file_load[file_number];
+}
+
+void asyncio_reduce_file_load (unsigned long file_number)
+{
+}
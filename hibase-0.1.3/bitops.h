@@ -104,5 +104,25 @@ word_t swap_bytes(word_t x);
 #define SWAP_BYTES(x)  swap_bytes(x)
 #endif
 
+/* Continue the CRC32C checksum `crc' over the `n' words at `p'.  Pass
+   0 as `crc' to start a new checksum.  Each word is taken in
+   little-endian byte order, so a checksum does not depend on the byte
+   order of the host that computed it.  On x86 processors with SSE4.2
+   the checksum is computed with the `crc32' instruction. */
+word_t crc32c(word_t crc, const word_t *p, unsigned long n);
+
+#if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))	\
+  && (defined(__i386__) || defined(__x86_64__))
+#define CRC32C_HW  1
+#endif
+
+/* Prefer the macro if in a tight loop.  Newer GCCs compile it to a
+   single instruction on most processors. */
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+#define LOWEST_BIT(x)  __builtin_ctzl((unsigned long) (x))
+#else
+#define LOWEST_BIT(x)  lowest_bit(x)
+#endif
+
 
 #endif /* INCL_BITOPS_H */
@@ -43,10 +43,15 @@ typedef enum {
 
 /* Declare the services of `cells.c'. */
 
-/* The uppermost 8 bits of each cell are reserved for the type tag. */
+/* The uppermost 8 bits of each cell are reserved for the type tag.
+   `CELL_HEADER' gives the first word of a cell of the given type with
+   all other bits cleared. */
 #define CELL_TYPE_BITS  8
-#define CELL_TYPE_MASK  0xFF000000
-#define CELL_TYPE(p)  ((cell_type_t) (p[0] >> (32 - CELL_TYPE_BITS)))
+#define CELL_TYPE_SHIFT  (WORD_BITS - CELL_TYPE_BITS)
+#define CELL_TYPE_MASK  \
+  ((word_t) ((1 << CELL_TYPE_BITS) - 1) << CELL_TYPE_SHIFT)
+#define CELL_TYPE(p)  ((cell_type_t) (p[0] >> CELL_TYPE_SHIFT))
+#define CELL_HEADER(type)  ((word_t) (type) << CELL_TYPE_SHIFT)
 
 /* Translation table from C identifiers for cell types to
    corresponding strings.  E.g. `cell_type_name[CELL_list]' evaluates
@@ -20,9 +20,25 @@
 /* The first word of each page should contain this. */
 #define PAGE_MAGIC_COOKIE  (0x4A6E3A61L)
 
+/* The first word of a compressed page on disk, see `io.c'. */
+#define COMPRESSED_PAGE_COOKIE  (0xC0DE3A61L)
+
+/* The first word of the first compressed page of a run on disk, see
+   `io.c'. */
+#define COMPRESSED_RUN_COOKIE  (0xC0DE5A61L)
+
 /* The first word of an unused page on disk should contain this. */
 #define UNUSED_PAGE_COOKIE  (0xDEAD1541L)
 
+/* The first word of each slot in the root index, see `io.c'. */
+#define ROOT_INDEX_COOKIE  (0x1DE83A61L)
+
+/* The first word of each record in the delta log, see `shades.c'. */
+#define DELTA_LOG_COOKIE  (0xDE17A3A6L)
+
+/* The first word of an online backup, see `io.c'. */
+#define BACKUP_MAGIC_COOKIE  (0xBAC4A3A6L)
+
 /* Denotes the tail of the list containing the remembered set. */
 #define REM_SET_TAIL_COOKIE  ((rem_set_t *) (ptr_as_scalar_t) 0xF5E35E7FL)
 
@@ -107,6 +107,19 @@ typedef signed short signed_word_t;
 #endif
 #endif
 
+/* The number of bits in `word_t'.  Code that depends on the width of
+   the word should use this instead of a literal 32.  The cell layout
+   in `cells.h' and `shades.c' does, but e.g. the tries, dynamic
+   hashing, shtrings, OIDs and the disk page numbers in `io.c' still
+   assume 32-bit words, as does `word_t' above.  Until they don't,
+   building with e.g. `-DWORD_BITS=64' fails here. */
+#ifndef WORD_BITS
+#define WORD_BITS  32
+#endif
+#if WORD_BITS != 32
+#error Only 32-bit words are supported, see WORD_BITS in includes.h.
+#endif
+
 typedef word_t *ptr_t;
 
 /* Define `ptr_as_scalar' be the an unsigned integer type of equal size
@@ -126,4 +139,14 @@ typedef unsigned short ptr_as_scalar_t;
 #endif
 
 
+/* Hint the processor to fetch the cache line containing the given
+   address.  Newer GCCs compile it to a prefetch instruction where one
+   exists, otherwise it does nothing. */
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 1)
+#define PREFETCH(addr)  __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)  ((void) 0)
+#endif
+
+
 #endif /* INCL_INCLUDES */
@@ -618,7 +618,7 @@ INSN(t_branch_if_not_ntuple,
        if (accu == NULL_WORD 
 	   || !TAGGED_IS_PTR(accu)
 	   || WORD_TO_PTR(accu)[0] !=
-	        ((CELL_tuple << (32 - CELL_TYPE_BITS)) | pc[1]))
+	        (CELL_HEADER(CELL_tuple) | pc[1]))
 	 pc = program_start + pc[2];
        else
 	 pc += 3;
@@ -20,6 +20,7 @@
 #include "shtring.h"
 #include "list.h"
 #include "net.h"
+#include "replica.h"
 #include "triev2.h"
 
 static char *rev_id = "$Id: interp.c,v 1.59 1998/03/30 18:43:52 cessu Exp $";
@@ -416,6 +417,7 @@ run_cont:
   bcode = CONT_BCODE(cont);
   assert(CELL_TYPE(bcode) == CELL_bcode);
   if (!is_in_first_generation(cont)
+      || cont >= first_generation_logged_ptr
       || BCODE_CONT_IS_REUSABLE(bcode)
       || !can_allocate(BCODE_MAX_ALLOCATION(bcode))) {
     while (!can_allocate(BCODE_NUMBER_OF_WORDS_IN_CONT(bcode)
@@ -579,6 +581,10 @@ die_cont:
     }
     net_return = net_get_wakeup();
     thread_id = net_return.thread_id;
+    if (thread_id == REPLICA_THREAD_ID) {
+      replica_wakeup(&net_return);
+      continue;
+    }
 #ifdef INTERP_INSN_TRACE
     fprintf(stderr, "WAKEUP thread %d\n", thread_id);
 #endif
@@ -600,6 +606,14 @@ die_cont:
   if (flushed_batch_during_wakeups)
     goto die_cont;
 
+  /* Close the commit batch early if the commit scheduler so wishes.
+     All threads are in the root block here. */
+  if (commit_is_due()) {
+    commit_batch();
+    flush_bcode_cache();
+    flush_global_cache();
+  }
+
   /* Pick a thread and start running it. */
   priority = NUMBER_OF_CONTEXT_PRIORITIES;
   do {
@@ -626,9 +640,18 @@ die_cont:
   /* We come here if we have no runnable threads.  Usually this
      shouldn't happen in the eventual system since we will always have
      idler-threads, if nothing else. */
-  if (GET_ROOT_PTR(blocked_threads) != NULL_PTR)
-    /* We have blocked threads.  Try to wake them up. */
+  if (GET_ROOT_PTR(blocked_threads) != NULL_PTR) {
+    /* We have blocked threads.  Until they wake up, spend the time
+       in mature garbage collection, one step at a time so that the
+       next wakeups are polled for without waiting in between. */
+    if (idle_gc_step()) {
+      flush_bcode_cache();
+      flush_global_cache();
+      is_idle = 0;
+    }
+    /* Try to wake them up. */
     goto die_cont;
+  }
 
   /* We come here only if there were no threads at all.  This is
      unlikely to ever happen in the final systems, but during testing
@@ -17,6 +17,10 @@ static char *rev_by = SHADES_REV_BY;
 static char *rev_cc = SHADES_REV_CC;
 
 
+/* `ftruncate', `pread', `pwritev' and `posix_fadvise' are not declared
+   in strict ISO C mode, e.g. with `--enable-warnings'. */
+#define _DEFAULT_SOURCE 1
+
 #include "includes.h"
 #include "params.h"
 #include "io.h"
@@ -27,6 +31,23 @@ static char *rev_cc = SHADES_REV_CC;
 #ifdef ASYNC_IO
 #include "asyncio.h"
 #endif
+#include <sys/uio.h>
+
+#if defined(HAVE_POSIX_FADVISE) && !defined(POSIX_FADV_WILLNEED)
+/* The read-ahead needs the advice, which some systems with
+   `posix_fadvise' lack. */
+#undef HAVE_POSIX_FADVISE
+#endif
+
+#ifdef PIPELINED_COMMIT
+#ifndef HAVE_PWRITEV
+/* The commit thread writes while other threads seek, so it needs
+   positioned writes. */
+#undef PIPELINED_COMMIT
+#else
+#include <pthread.h>
+#endif
+#endif
 
 /* If `O_DSYNC' is given, use it in file modes.  Otherwise, use
    `O_SYNC'.  If even it isn't given, use `fsync'-calls. */
@@ -66,6 +87,10 @@ static char *rev_cc = SHADES_REV_CC;
    for block special devices, e.g. raw disks. */
 #define WRITE_BOUNDARY  DISK_BLOCK_SIZE
 
+/* At most this many disk pages are written with one system call by
+   `io_write_pages'. */
+#define MAX_RUN_LENGTH  64
+
 /* Number of words in a disk block. */
 #define WORDS_PER_DISK_BLOCK  (DISK_BLOCK_SIZE / sizeof(word_t))
 
@@ -89,10 +114,11 @@ static char *rev_cc = SHADES_REV_CC;
    disk pages.  If OPTIMIZED_ROOT_LOCATION is #defined, page status
    "root" indicates that this page contains the latest root block.
    This type of page status shouldn't be of any concern outside of
-   IO subsystem. */
+   IO subsystem.  Neither should "pinned", the status of a page freed
+   while the running backup has yet to copy it. */
 
 typedef enum {
-  ALLOCATED, ROOT, FREE, UNKNOWN
+  ALLOCATED, ROOT, FREE, UNKNOWN, PINNED
 } disk_page_status_t;
 
 
@@ -117,6 +143,25 @@ typedef struct {
   /* Array that stores information known about the allocation status
      of disk pages.  Indexed with the disk page number. */
   disk_page_status_t *status;
+  /* Bitmap of the "free" disk pages, and a summary bitmap with a bit
+     set for each nonzero word of `free_map'.  These let
+     `find_free_page' skip allocated stretches a word or a summary
+     word at a time instead of checking `status' page by page. */
+  word_t *free_map;
+  word_t *free_summary;
+  /* Bitmaps of the pages the running backup has yet to copy, of the
+     pages copied by some backup and not freed since, likewise of the
+     pages the running copy to a standby has yet to copy and of those
+     it has copied, and of the pages shipped to the standbys. */
+  word_t *backup_map;
+  word_t *backed_up_map;
+  word_t *copy_map;
+  word_t *copied_map;
+  word_t *shipped_map;
+  /* The number of `WRITE_BOUNDARY' blocks that each compressed disk
+     page takes, or zero if not known, so that it can be read without
+     the rest of the disk page.  Only a hint, see `read_disk_page'. */
+  unsigned short *compressed_nblocks;
   unsigned long cursor;
 } file_t;
 
@@ -137,8 +182,233 @@ static long unsigned number_of_free_disk_pages = 0;
 /* Position of the previous root block among the disk pages. */
 static long prev_root_file = -1;
 static long prev_root_page = -1;
+
+/* The root index.
+
+   The page after the last data page of each file holds a ring of
+   `ROOT_INDEX_SLOTS' slots, each telling the time stamp and the page
+   of a root block recently written to that file.  A slot is a disk
+   block of its own so that writing it is atomic.  `io_write_root'
+   fills the slot of a new root before writing the root itself, so the
+   newest slot points to either the newest root or, if the system
+   crashed in between, to a root that never made it to the disk.
+   `io_read_root' therefore tries the slots from the newest down until
+   one leads to an intact root block of the same time stamp, which
+   takes one read per file and usually one more for the root.  The
+   binary search over the files is needed only if the index is
+   corrupt. */
+#define ROOT_INDEX_SLOTS  (PAGE_SIZE / DISK_BLOCK_SIZE)
+
+/* The words in a slot. */
+#define SLOT_COOKIE		0
+#define SLOT_TIME_STAMP_HI	1
+#define SLOT_TIME_STAMP_LO	2
+#define SLOT_PAGE		3
+#define SLOT_CHECKSUM		4
+
+#define ROOT_INDEX_OFFSET(f)  \
+  (disk_skip_nbytes + (f)->number_of_pages * PAGE_SIZE)
+#endif
+
+
+#ifdef PIPELINED_COMMIT
+/* Pipelined commit.
+
+   Between `io_begin_commit' and `io_write_root' the synchronous
+   writes of the commit group are not done but queued, together with
+   the root block and, if `USE_FSYNC', the `fsync'-calls between them.
+   `io_write_root' then hands the queue to the commit thread and
+   returns at once, so that the next commit group can be run while
+   the disk writes of this one are in progress.  The pages in the
+   queue must not change and the disk pages referred to by the
+   previous root block must not be freed until `io_wait_for_commit'
+   has returned. */
+
+typedef struct {
+  file_t *f;
+  off_t offset;
+  /* Zero for an `fsync' of `f'. */
+  int n;
+  /* Non-zero if `iov' are pages to compress, see `write_pages_now'. */
+  int is_compressed;
+  struct iovec iov[MAX_RUN_LENGTH];
+} commit_write_t;
+
+static commit_write_t *commit_write = NULL;
+static unsigned long number_of_commit_writes = 0;
+static unsigned long max_number_of_commit_writes = 0;
+
+/* Copies of the root block and the root index slot, which may change
+   before they are written. */
+#define MAX_NUMBER_OF_COMMIT_BLOCKS  2
+static word_t commit_block[MAX_NUMBER_OF_COMMIT_BLOCKS][WORDS_PER_DISK_BLOCK];
+static int number_of_commit_blocks = 0;
+
+/* Non-zero from `io_begin_commit' to `io_write_root'. */
+static int is_queueing_writes = 0;
+/* Non-zero from `io_write_root' to `io_wait_for_commit'. */
+static int commit_is_pending = 0;
+
+static int commit_thread_is_started = 0;
+static pthread_t commit_thread;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+/* Set when the queue is handed to the commit thread, cleared by the
+   commit thread when it has written the queue. */
+static int commit_is_being_written = 0;
+
+/* The buffer in which the commit thread compresses pages. */
+static word_t *commit_compress_buffer = NULL;
+
+#ifdef OPTIMIZED_ROOT_LOCATION
+/* The position of the root block that becomes obsolete when the
+   pending commit is on disk. */
+static long obsolete_root_file = -1;
+static long obsolete_root_page = -1;
+#endif
+
+#define IS_QUEUEING_WRITES  is_queueing_writes
+#else
+#define IS_QUEUEING_WRITES  0
+#endif /* PIPELINED_COMMIT */
+
+/* The buffers in which pages are compressed for writing and
+   uncompressed after reading by the calling thread. */
+static word_t *compress_buffer = NULL;
+static word_t *uncompress_buffer = NULL;
+
+/* The disk pages gathered by `io_read_page_ahead'. */
+static disk_page_number_t *read_ahead = NULL;
+static unsigned long number_of_read_aheads = 0;
+static unsigned long max_number_of_read_aheads = 0;
+
+#ifdef ASYNC_IO
+/* The pages whose reads `io_read_page_start' has started since the
+   last `io_read_page_wait', to be uncompressed there. */
+static ptr_t *started_read = NULL;
+static unsigned long number_of_started_reads = 0;
+static unsigned long max_number_of_started_reads = 0;
 #endif
 
+/* The running backup, see `io_start_backup'. */
+static int backup_fd = -1;
+static unsigned long backup_file_cursor = 0;
+static unsigned long backup_page_cursor = 0;
+static unsigned long number_of_backup_pages_left = 0;
+static word_t *backup_buffer = NULL;
+/* The time stamp of the root block of the previous backup. */
+static int backup_was_taken = 0;
+static word_t backup_time_stamp_hi = 0;
+static word_t backup_time_stamp_lo = 0;
+
+/* The running copy to a standby, see `io_start_standby_copy', and
+   the time stamp of the root block of its previous round. */
+static int copy_is_running = 0;
+static unsigned long copy_file_cursor = 0;
+static unsigned long copy_page_cursor = 0;
+static unsigned long number_of_copy_pages_left = 0;
+static word_t copy_time_stamp_hi = 0;
+static word_t copy_time_stamp_lo = 0;
+
+/* The time stamp of the root block last shipped, see
+   `io_ship_commit'. */
+static word_t ship_time_stamp_hi = 0;
+static word_t ship_time_stamp_lo = 0;
+
+/* The disk pages allocated since the previous `io_ship_commit', if
+   `unshipped_pages_are_listed'.  Otherwise, as before the first call
+   or when more pages were allocated than there are in the files,
+   `io_ship_commit' scans the files for them. */
+static disk_page_number_t *unshipped_page = NULL;
+static unsigned long number_of_unshipped_pages = 0;
+static unsigned long max_number_of_unshipped_pages = 0;
+static int unshipped_pages_are_listed = 0;
+
+
+/* Maintenance of the free page bitmaps.  These must be called
+   whenever `status' changes to or from FREE. */
+
+static void mark_page_free(file_t *f, unsigned long page_number)
+{
+  unsigned long i = page_number / WORD_BITS;
+
+  f->free_map[i] |= (word_t) 1 << (page_number % WORD_BITS);
+  f->free_summary[i / WORD_BITS] |= (word_t) 1 << (i % WORD_BITS);
+  /* The page may be written again, so the next incremental backup,
+     copy and commit shipped must copy it if it is allocated. */
+  f->backed_up_map[i] &= ~((word_t) 1 << (page_number % WORD_BITS));
+  f->copied_map[i] &= ~((word_t) 1 << (page_number % WORD_BITS));
+  f->shipped_map[i] &= ~((word_t) 1 << (page_number % WORD_BITS));
+}
+
+/* Note that page `page_number' of file `file_number' was allocated,
+   so that `io_ship_commit' need not scan the files for it. */
+static void note_unshipped_page(unsigned long file_number,
+				unsigned long page_number)
+{
+  if (!unshipped_pages_are_listed)
+    return;
+  if (number_of_unshipped_pages == max_number_of_unshipped_pages) {
+    unshipped_pages_are_listed = 0;
+    return;
+  }
+  unshipped_page[number_of_unshipped_pages++] =
+    MAKE_DISK_PAGE_NUMBER(file_number, page_number);
+}
+
+static void mark_page_not_free(file_t *f, unsigned long page_number)
+{
+  unsigned long i = page_number / WORD_BITS;
+
+  f->free_map[i] &= ~((word_t) 1 << (page_number % WORD_BITS));
+  if (f->free_map[i] == 0)
+    f->free_summary[i / WORD_BITS] &= ~((word_t) 1 << (i % WORD_BITS));
+}
+
+
+/* Return the index of the first nonzero word of `f->free_map' at or
+   after index `i', or -1 if there is none. */
+static long find_free_map_word(file_t *f, unsigned long i)
+{
+  unsigned long j, number_of_summary_words;
+  word_t w;
+
+  number_of_summary_words =
+    (f->number_of_pages + WORD_BITS * WORD_BITS - 1) / (WORD_BITS * WORD_BITS);
+  j = i / WORD_BITS;
+  if (j >= number_of_summary_words)
+    return -1;
+  w = f->free_summary[j] & (~(word_t) 0 << (i % WORD_BITS));
+  while (w == 0) {
+    if (++j == number_of_summary_words)
+      return -1;
+    w = f->free_summary[j];
+  }
+  return j * WORD_BITS + LOWEST_BIT(w);
+}
+
+
+/* Return the first free page at or after `page_number' in the file,
+   wrapping around at the end of the file, or -1 if the file has no
+   free pages. */
+static long find_free_page(file_t *f, unsigned long page_number)
+{
+  unsigned long i = page_number / WORD_BITS;
+  long j;
+  word_t w;
+
+  w = f->free_map[i] & (~(word_t) 0 << (page_number % WORD_BITS));
+  if (w != 0)
+    return i * WORD_BITS + LOWEST_BIT(w);
+  j = find_free_map_word(f, i + 1);
+  if (j == -1)
+    j = find_free_map_word(f, 0);
+  if (j == -1)
+    return -1;
+  return j * WORD_BITS + LOWEST_BIT(f->free_map[j]);
+}
+
 
 /* Initialize the IO subsystem, create file structures. */
 int io_init(void)
@@ -205,22 +475,94 @@ int io_init(void)
     if (i == FIXED_ROOT_DISK)
       file[i].number_of_pages = (size / PAGE_SIZE) - 1;
     else
-#endif
       file[i].number_of_pages = size / PAGE_SIZE;
+#else
+    /* Leave the last page of each file for the root index. */
+    file[i].number_of_pages = (size / PAGE_SIZE) - 1;
+#endif
     file[i].number_of_free_pages = file[i].number_of_pages;
     q = strtok(NULL, sep);
     /* Initialize other fields of this file. */
     file[i].status =
       malloc(file[i].number_of_pages * sizeof(disk_page_status_t));
-    if (file[i].status == NULL) {
+    file[i].free_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].free_summary =
+      calloc((file[i].number_of_pages + WORD_BITS * WORD_BITS - 1)
+	     / (WORD_BITS * WORD_BITS),
+	     sizeof(word_t));
+    file[i].backup_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].backed_up_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].copy_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].copied_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].shipped_map =
+      calloc((file[i].number_of_pages + WORD_BITS - 1) / WORD_BITS,
+	     sizeof(word_t));
+    file[i].compressed_nblocks =
+      calloc(file[i].number_of_pages, sizeof(unsigned short));
+    if (file[i].status == NULL
+	|| file[i].free_map == NULL || file[i].free_summary == NULL
+	|| file[i].backup_map == NULL || file[i].backed_up_map == NULL
+	|| file[i].copy_map == NULL || file[i].copied_map == NULL
+	|| file[i].shipped_map == NULL
+	|| file[i].compressed_nblocks == NULL) {
       perror("io_init/malloc");
       exit(1);
     }
     file[i].cursor = 0;
     file[i].fd = -1;
+    max_number_of_unshipped_pages += file[i].number_of_pages;
   }
   file_cursor = 0;
 
+#if defined(POSIX_IO) || defined(URING_IO)
+  /* These write the pages handed to them as such. */
+  if (compressed_pages) {
+    fprintf(stderr,
+	    "io_init: `compressed_pages' is not supported with POSIX or "
+	    "io_uring asynchronous IO.\n"
+	    "  Configure with `--enable-pthread-io' or without asynchronous "
+	    "IO to use it.\n");
+    exit(1);
+  }
+#endif
+
+  /* A run is compressed in one go, see `write_pages_now'. */
+  compress_buffer = malloc(compressed_pages
+			   ? MAX_RUN_LENGTH * PAGE_SIZE : PAGE_SIZE);
+  uncompress_buffer = malloc(PAGE_SIZE);
+  backup_buffer = malloc(PAGE_SIZE);
+  if (compress_buffer == NULL || uncompress_buffer == NULL
+      || backup_buffer == NULL) {
+    perror("io_init/malloc");
+    exit(1);
+  }
+  if (replication_port != 0) {
+    unshipped_page =
+      malloc(max_number_of_unshipped_pages * sizeof(disk_page_number_t));
+    if (unshipped_page == NULL) {
+      perror("io_init/malloc");
+      exit(1);
+    }
+  }
+#ifdef PIPELINED_COMMIT
+  commit_compress_buffer = malloc(compressed_pages
+				  ? MAX_RUN_LENGTH * PAGE_SIZE : PAGE_SIZE);
+  if (commit_compress_buffer == NULL) {
+    perror("io_init/malloc");
+    exit(1);
+  }
+#endif
+
 #ifdef ASYNC_IO
   asyncio_init(number_of_files);
 #endif
@@ -233,6 +575,56 @@ int io_init(void)
 }
 
 
+/* Extend a regular database file to its full size.  Otherwise reading
+   the last page of the file fails if it was written only partially,
+   as pages are written only up to the words in use. */
+static void extend_file(file_t *f)
+{
+  struct stat st;
+  off_t size = disk_skip_nbytes + f->number_of_pages * PAGE_SIZE;
+
+  if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < size
+      && ftruncate(f->fd, size) == -1)
+    perror("extend_file/ftruncate");
+}
+
+
+#ifdef OPTIMIZED_ROOT_LOCATION
+/* Wipe out possible old magic cookies on disk because the new root
+   allocation on disk depends on them to be correct. */
+static void wipe_file(file_t *f)
+{
+  unsigned long i;
+  /* Write this to the beginning of each page on disk. */
+  word_t wipe[WORDS_PER_DISK_BLOCK];
+
+  wipe[0] = UNUSED_PAGE_COOKIE;
+  for (i = 0; i < f->number_of_pages; i++) {
+    if (lseek(f->fd, disk_skip_nbytes + i * PAGE_SIZE, SEEK_SET) == -1) {
+      perror("wipe_file/seek");
+      exit(1);
+    }
+    if (write(f->fd, (void *) wipe, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
+      perror("wipe_file/write");
+      exit(1);
+    }
+  }
+  /* Clear the root index as well. */
+  for (i = 0; i < ROOT_INDEX_SLOTS; i++) {
+    if (lseek(f->fd, ROOT_INDEX_OFFSET(f) + i * DISK_BLOCK_SIZE, SEEK_SET)
+	== -1) {
+      perror("wipe_file/seek");
+      exit(1);
+    }
+    if (write(f->fd, (void *) wipe, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
+      perror("wipe_file/write");
+      exit(1);
+    }
+  }
+}
+#endif
+
+
 /* Create files that will host the database, but contains no used
    pages. */
 void io_create_file(void)
@@ -241,17 +633,14 @@ void io_create_file(void)
   int fd;
 
 #ifdef OPTIMIZED_ROOT_LOCATION
-  /* Write this to the beginning of each page on disk. */
-  word_t wipe[WORDS_PER_DISK_BLOCK];
-  wipe[0] = UNUSED_PAGE_COOKIE;
   if (be_verbose)
     fprintf(stderr, "[Clearing disk files...");
 #endif
 
   for (j = 0; j < number_of_files; j++) {
-    /* Open the file for each file.  This is write-only, we do
-       not recover from these files. */
-    fd = file[j].fd = open(file[j].filename, O_CREAT | O_WRONLY | O_SYNC_FLAG);
+    /* Open the file for each file.  Online backups read from
+       it. */
+    fd = file[j].fd = open(file[j].filename, O_CREAT | O_RDWR | O_SYNC_FLAG);
     if (fd == -1) {
       perror("io_create_file/open");
     }
@@ -259,30 +648,19 @@ void io_create_file(void)
       perror("io_create_file/fchmod");
     if (disk_file_group >= 0 && fchown(fd, -1, disk_file_group) == -1)
       perror("io_create_file/fchown");
+    extend_file(&file[j]);
 
     /* Free all pages and initialize some internal data fields. */
-    for (i = 0; i < file[j].number_of_pages; i++)
+    for (i = 0; i < file[j].number_of_pages; i++) {
       file[j].status[i] = FREE;
+      mark_page_free(&file[j], i);
+    }
     file[j].cursor = 0;
     file[j].number_of_free_pages = file[j].number_of_pages;
     number_of_free_disk_pages += file[j].number_of_pages;
 
 #ifdef OPTIMIZED_ROOT_LOCATION
-    /* Wipe out possible old magic cookies on disk because the new
-       root allocation on disk depends on them to be correct. */
-    for (i = 0; i < file[j].number_of_pages; i++) {
-      if (lseek(file[j].fd,
-		disk_skip_nbytes + i * PAGE_SIZE,
-		SEEK_SET) == -1) {
-	perror("io_create_file/seek");
-	exit(1);
-      }
-      if (write(file[j].fd, (void *) wipe, DISK_BLOCK_SIZE)
-	  != DISK_BLOCK_SIZE) {
-	perror("io_create_file/write");
-	exit(1);
-      }
-    }
+    wipe_file(&file[j]);
 #endif
 
 #ifdef ASYNC_IO
@@ -291,6 +669,7 @@ void io_create_file(void)
   }
 
   file_cursor = 0;
+  backup_was_taken = 0;
 
 #ifdef OPTIMIZED_ROOT_LOCATION
   if (be_verbose)
@@ -309,8 +688,10 @@ void io_open_file(void)
   int fd;
 
   for (j = 0; j < number_of_files; j++) {
-    for (i = 0; i < file[j].number_of_pages; i++)
+    for (i = 0; i < file[j].number_of_pages; i++) {
       file[j].status[i] = UNKNOWN;
+      mark_page_not_free(&file[j], i);
+    }
     file[j].number_of_free_pages = 0;
 
     /* Open file for each file for recovery. */
@@ -323,6 +704,7 @@ void io_open_file(void)
       perror("io_open_file/fchmod");
     if (disk_file_group >= 0 && fchown(fd, -1, disk_file_group) == -1)
       perror("io_open_file/fchown");
+    extend_file(&file[j]);
 
     file[j].cursor = 0;
 
@@ -332,6 +714,8 @@ void io_open_file(void)
   }
 
   file_cursor = 0;
+  /* No page is known to be in the previous backups. */
+  backup_was_taken = 0;
 
 #ifdef OPTIMIZED_ROOT_LOCATION
   prev_root_file = -1;
@@ -346,6 +730,7 @@ void io_close_file(void)
 {
   unsigned long i;
 
+  io_wait_for_commit();
   for (i = 0; i < number_of_files; i++) {
     if (close(file[i].fd)) {
       perror("io_close_file/close");
@@ -360,6 +745,676 @@ void io_close_file(void)
 }
 
 
+#ifdef OPTIMIZED_ROOT_LOCATION
+/* Free the disk page of an obsolete root block, if any. */
+static void free_root_page(long file_number, long page_number)
+{
+  if (file_number == -1 || page_number == -1)
+    return;
+  assert(file[file_number].status[page_number] == ROOT);
+  file[file_number].status[page_number] = FREE;
+  mark_page_free(&file[file_number], page_number);
+  file[file_number].number_of_free_pages++;
+  number_of_free_disk_pages++;
+}
+#endif
+
+
+/* The page codec.
+
+   A compressed page on disk starts with `COMPRESSED_PAGE_HEADER_WORDS'
+   words: the `COMPRESSED_PAGE_COOKIE', the number of words in the
+   page, and the number of bytes of code that follow.  The words of
+   the page after its magic cookie are coded in groups of four.  Each
+   group starts with three bytes holding a six bit code for each word,
+   and is followed by the bytes of the words.  A code tells which of
+   the `CODEC_TABLE_SIZE' most recently coded words the word is
+   closest to, and whether the two differ in none, the lowest one, the
+   lowest two, or any of the four bytes.  Only the differing bytes
+   follow, lowest first, in the XOR of the two words.  Mostly the
+   words of a page are headers, small integers and pointers to nearby
+   cells, so they differ from some recent word only in a byte or two.
+   Since the bytes are given in a fixed order, the code is the same
+   regardless of the byte order of the machine.
+
+   The first page of a run written by `write_pages_now' instead starts
+   with `COMPRESSED_RUN_HEADER_WORDS' words: the
+   `COMPRESSED_RUN_COOKIE', the same two words, the number of pages in
+   the run, and for each of them two bytes, lowest first, telling how
+   many `WRITE_BOUNDARY' blocks of its disk page it takes, or zero if
+   it is not compressed.
+
+   The coding of the page is verified by its checksum after it has
+   been uncompressed, so the decoder merely refuses to run past the
+   page or the code. */
+
+#define COMPRESSED_PAGE_HEADER_WORDS  3
+#define COMPRESSED_RUN_HEADER_WORDS  \
+  (4 + (2 * MAX_RUN_LENGTH + sizeof(word_t) - 1) / sizeof(word_t))
+#define CODEC_TABLE_SIZE  16
+
+/* The number of bytes following for each two bit difference code. */
+static const int codec_nbytes[4] = { 0, 1, 2, 4 };
+
+
+/* Remember the word just coded as the most recent one.  `code' is the
+   six bit code of the word. */
+#define CODEC_UPDATE_TABLE(table, code, w)				\
+  do {									\
+    int _k = (code) >> 2;						\
+    if (((code) & 3) != 0)						\
+      _k = CODEC_TABLE_SIZE - 1;					\
+    memmove((table) + 1, (table), _k * sizeof(word_t));		\
+    (table)[0] = (w);							\
+  } while (0)
+
+
+/* Compress as `io_compress_page', but leave room for `header_words'
+   words of header. */
+static unsigned long compress_page(ptr_t ptr,
+				   unsigned long number_of_bytes,
+				   ptr_t buffer,
+				   unsigned long header_words)
+{
+  word_t table[CODEC_TABLE_SIZE], w, x;
+  unsigned char *code_start, *p, *end, *codes_p;
+  unsigned long i, j, n, codes, nbytes;
+  int k, best_k, best_code;
+
+  assert(ptr[0] == PAGE_MAGIC_COOKIE);
+  assert(number_of_bytes <= PAGE_SIZE);
+  if (number_of_bytes <= WRITE_BOUNDARY)
+    return 0;
+  n = number_of_bytes / sizeof(word_t);
+  memset(table, 0, sizeof(table));
+  code_start = p = (unsigned char *) (buffer + header_words);
+  /* Give up when the compressed page would not be written in fewer
+     blocks than the page itself.  A group takes at most 19 bytes. */
+  end = (unsigned char *) buffer + number_of_bytes
+    - number_of_bytes % WRITE_BOUNDARY - 19;
+  for (i = 1; i < n; i += 4) {
+    if (p > end)
+      return 0;
+    codes_p = p;
+    p += 3;
+    codes = 0;
+    for (j = 0; j < 4; j++) {
+      w = i + j < n ? ptr[i + j] : 0;
+      /* The smallest XOR has the fewest differing bytes. */
+      x = w ^ table[0];
+      best_k = 0;
+      for (k = 1; k < CODEC_TABLE_SIZE; k++)
+	if ((w ^ table[k]) < x) {
+	  x = w ^ table[k];
+	  best_k = k;
+	}
+      best_code = best_k << 2
+	| (x == 0 ? 0 : x <= 0xFF ? 1 : x <= 0xFFFF ? 2 : 3);
+      switch (best_code & 3) {
+      case 3:
+	p[3] = (unsigned char) (x >> 24);
+	p[2] = (unsigned char) (x >> 16);
+	/* FALLTHROUGH */
+      case 2:
+	p[1] = (unsigned char) (x >> 8);
+	/* FALLTHROUGH */
+      case 1:
+	p[0] = (unsigned char) x;
+      }
+      p += codec_nbytes[best_code & 3];
+      codes |= (unsigned long) best_code << (6 * j);
+      CODEC_UPDATE_TABLE(table, best_code, w);
+    }
+    codes_p[0] = (unsigned char) codes;
+    codes_p[1] = (unsigned char) (codes >> 8);
+    codes_p[2] = (unsigned char) (codes >> 16);
+  }
+  buffer[0] = COMPRESSED_PAGE_COOKIE;
+  buffer[1] = n;
+  buffer[2] = p - code_start;
+  nbytes = header_words * sizeof(word_t) + (p - code_start);
+  if (nbytes % WRITE_BOUNDARY != 0)
+    nbytes += WRITE_BOUNDARY - nbytes % WRITE_BOUNDARY;
+  if (nbytes >= number_of_bytes)
+    return 0;
+  return nbytes;
+}
+
+
+unsigned long io_compress_page(ptr_t ptr,
+			       unsigned long number_of_bytes,
+			       ptr_t buffer)
+{
+  return compress_page(ptr, number_of_bytes, buffer,
+		       COMPRESSED_PAGE_HEADER_WORDS);
+}
+
+
+/* Return the number of bytes of the page of `number_of_bytes' that
+   were written to its disk page, judging from the first disk block
+   of it just read to `ptr'. */
+static unsigned long stored_page_nbytes(ptr_t ptr,
+					unsigned long number_of_bytes)
+{
+  word_t cookie = ptr[0], code_nbytes = ptr[2];
+  unsigned long nbytes;
+
+  if (cookie == SWAP_BYTES(COMPRESSED_PAGE_COOKIE)
+      || cookie == SWAP_BYTES(COMPRESSED_RUN_COOKIE)) {
+    cookie = SWAP_BYTES(cookie);
+    code_nbytes = SWAP_BYTES(code_nbytes);
+  }
+  if (cookie == COMPRESSED_PAGE_COOKIE)
+    nbytes = COMPRESSED_PAGE_HEADER_WORDS * sizeof(word_t);
+  else if (cookie == COMPRESSED_RUN_COOKIE)
+    nbytes = COMPRESSED_RUN_HEADER_WORDS * sizeof(word_t);
+  else
+    return number_of_bytes;
+  if (code_nbytes >= PAGE_SIZE)
+    return number_of_bytes;
+  nbytes += code_nbytes;
+  if (nbytes % WRITE_BOUNDARY != 0)
+    nbytes += WRITE_BOUNDARY - nbytes % WRITE_BOUNDARY;
+  return nbytes < number_of_bytes ? nbytes : number_of_bytes;
+}
+
+
+/* If the disk page `page_number' of `f' just read to `ptr' is the
+   first page of a compressed run, note how many blocks the other
+   pages of the run take, unless that is already known. */
+static void note_compressed_run(file_t *f,
+				unsigned long page_number,
+				ptr_t ptr)
+{
+  unsigned char *table = (unsigned char *) (ptr + 4);
+  unsigned long i, n;
+
+  if (ptr[0] == COMPRESSED_RUN_COOKIE)
+    n = ptr[3];
+  else if (ptr[0] == SWAP_BYTES(COMPRESSED_RUN_COOKIE))
+    n = SWAP_BYTES(ptr[3]);
+  else
+    return;
+  if (n > MAX_RUN_LENGTH)
+    return;
+  for (i = 1; i < n && page_number + i < f->number_of_pages; i++)
+    if (f->compressed_nblocks[page_number + i] == 0
+	&& (table[2 * i] | table[2 * i + 1] << 8) * WRITE_BOUNDARY
+	   < PAGE_SIZE)
+      f->compressed_nblocks[page_number + i] =
+	table[2 * i] | table[2 * i + 1] << 8;
+}
+
+
+void io_uncompress_page(ptr_t ptr, ptr_t buffer)
+{
+  word_t table[CODEC_TABLE_SIZE], w, x;
+  unsigned char *p, *end;
+  unsigned long i, j, n, codes, nbytes, header_words;
+  int code;
+
+  if (ptr[0] == SWAP_BYTES(COMPRESSED_PAGE_COOKIE)
+      || ptr[0] == SWAP_BYTES(COMPRESSED_RUN_COOKIE)) {
+    ptr[0] = SWAP_BYTES(ptr[0]);
+    ptr[1] = SWAP_BYTES(ptr[1]);
+    ptr[2] = SWAP_BYTES(ptr[2]);
+  }
+  if (ptr[0] == COMPRESSED_PAGE_COOKIE)
+    header_words = COMPRESSED_PAGE_HEADER_WORDS;
+  else if (ptr[0] == COMPRESSED_RUN_COOKIE)
+    header_words = COMPRESSED_RUN_HEADER_WORDS;
+  else
+    return;
+  n = ptr[1];
+  nbytes = ptr[2];
+  if (n == 0 || n > PAGE_SIZE / sizeof(word_t)
+      || nbytes > PAGE_SIZE - header_words * sizeof(word_t))
+    goto corrupt;
+  memcpy(buffer, ptr + header_words, nbytes);
+  p = (unsigned char *) buffer;
+  end = p + nbytes;
+  memset(table, 0, sizeof(table));
+  for (i = 1; i < n; i += 4) {
+    if (p + 3 > end)
+      goto corrupt;
+    codes = p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16;
+    p += 3;
+    for (j = 0; j < 4; j++, codes >>= 6) {
+      code = codes & 63;
+      if (p + codec_nbytes[code & 3] > end)
+	goto corrupt;
+      switch (code & 3) {
+      case 0:
+	x = 0;
+	break;
+      case 1:
+	x = p[0];
+	break;
+      case 2:
+	x = p[0] | (word_t) p[1] << 8;
+	break;
+      default:
+	x = p[0] | (word_t) p[1] << 8 | (word_t) p[2] << 16
+	  | (word_t) p[3] << 24;
+	break;
+      }
+      p += codec_nbytes[code & 3];
+      w = table[code >> 2] ^ x;
+      CODEC_UPDATE_TABLE(table, code, w);
+      if (i + j < n)
+	ptr[i + j] = w;
+    }
+  }
+  ptr[0] = PAGE_MAGIC_COOKIE;
+  return;
+
+ corrupt:
+  /* Let the caller find the page corrupt. */
+  ptr[0] = UNUSED_PAGE_COOKIE;
+}
+
+
+/* Write the `n' memory areas of `iov' at `offset' of file `f' with a
+   single system call. */
+static void write_now(file_t *f, off_t offset, struct iovec *iov, int n)
+{
+  unsigned long i, total_nbytes = 0;
+
+  for (i = 0; i < (unsigned long) n; i++)
+    total_nbytes += iov[i].iov_len;
+#ifdef HAVE_PWRITEV
+  if (pwritev(f->fd, iov, n, offset) != (signed long) total_nbytes) {
+    perror("write_now/pwritev");
+    exit(1);
+  }
+#else
+  if (lseek(f->fd, offset, SEEK_SET) == -1) {
+    perror("write_now/lseek");
+    exit(1);
+  }
+  if (writev(f->fd, iov, n) != (signed long) total_nbytes) {
+    perror("write_now/writev");
+    exit(1);
+  }
+#endif
+}
+
+
+#ifdef PIPELINED_COMMIT
+/* Add a write to the queue of the commit group. */
+static void queue_commit_write(file_t *f, off_t offset,
+			       struct iovec *iov, int n, int is_compressed)
+{
+  commit_write_t *w;
+
+  assert(n >= 0 && n <= MAX_RUN_LENGTH);
+  if (number_of_commit_writes == max_number_of_commit_writes) {
+      max_number_of_commit_writes = 2 * max_number_of_commit_writes + 64;
+    commit_write = realloc(commit_write,
+			   max_number_of_commit_writes
+			   * sizeof(commit_write_t));
+    if (commit_write == NULL) {
+      fprintf(stderr, "queue_commit_write: `realloc' failed.\n");
+      exit(1);
+    }
+  }
+  w = &commit_write[number_of_commit_writes++];
+  w->f = f;
+  w->offset = offset;
+  w->n = n;
+  w->is_compressed = is_compressed;
+  memcpy(w->iov, iov, n * sizeof(struct iovec));
+}
+#endif
+
+
+/* Write as `write_now', or queue the write if a pipelined commit is
+   being gathered. */
+static void write_at(file_t *f, off_t offset, struct iovec *iov, int n)
+{
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes) {
+    queue_commit_write(f, offset, iov, n, 0);
+    return;
+  }
+#endif
+  write_now(f, offset, iov, n);
+}
+
+
+/* Write the `n' pages of `iov' compressed to the consecutive disk
+   pages starting at `offset' of file `f' with a single system call.
+   The pages are compressed in `buffer' of `MAX_RUN_LENGTH' pages.
+   Each page stays at the start of its own disk page, so that it can
+   be read, backed up and freed on its own, and the rest of the disk
+   page is filled from the page itself.  The first page of the run
+   tells in its header how much of their disk pages the others take,
+   so that they are read without the rest, see `read_disk_page'. */
+static void write_pages_now(file_t *f, off_t offset,
+			    struct iovec *iov, int n, ptr_t buffer)
+{
+  struct iovec compressed_iov[2 * MAX_RUN_LENGTH];
+  unsigned long nbytes[MAX_RUN_LENGTH], nblocks, page_number, header_words;
+  unsigned char *table;
+  char *compressed[MAX_RUN_LENGTH], *p;
+  int i, m;
+
+  assert(n > 0 && n <= MAX_RUN_LENGTH);
+  page_number = (offset - disk_skip_nbytes) / PAGE_SIZE;
+  /* The first page goes to the start of `buffer' behind its header,
+     so it is compressed last. */
+  p = (char *) buffer + PAGE_SIZE;
+  for (i = 1; i < n; i++) {
+    nbytes[i] = compress_page((ptr_t) iov[i].iov_base, iov[i].iov_len,
+			      (ptr_t) p, COMPRESSED_PAGE_HEADER_WORDS);
+    compressed[i] = p;
+    p += nbytes[i];
+  }
+  header_words =
+    n > 1 ? COMPRESSED_RUN_HEADER_WORDS : COMPRESSED_PAGE_HEADER_WORDS;
+  nbytes[0] = compress_page((ptr_t) iov[0].iov_base, iov[0].iov_len,
+			    buffer, header_words);
+  compressed[0] = (char *) buffer;
+  if (n > 1 && nbytes[0] != 0) {
+    buffer[0] = COMPRESSED_RUN_COOKIE;
+    buffer[3] = n;
+    table = (unsigned char *) (buffer + 4);
+    for (i = 0; i < n; i++) {
+      nblocks = nbytes[i] / WRITE_BOUNDARY;
+      table[2 * i] = (unsigned char) nblocks;
+      table[2 * i + 1] = (unsigned char) (nblocks >> 8);
+    }
+  }
+
+  for (i = 0, m = 0; i < n; i++) {
+    f->compressed_nblocks[page_number + i] = nbytes[i] / WRITE_BOUNDARY;
+    if (nbytes[i] == 0) {
+      /* The page did not compress.  Only the last one of the run may
+	 be written short. */
+      compressed_iov[m].iov_base = iov[i].iov_base;
+      compressed_iov[m++].iov_len = i == n - 1 ? iov[i].iov_len : PAGE_SIZE;
+      continue;
+    }
+    compressed_iov[m].iov_base = (void *) compressed[i];
+    compressed_iov[m++].iov_len = nbytes[i];
+    if (i < n - 1) {
+      compressed_iov[m].iov_base = (char *) iov[i].iov_base + nbytes[i];
+      compressed_iov[m++].iov_len = PAGE_SIZE - nbytes[i];
+    }
+  }
+  write_now(f, offset, compressed_iov, m);
+}
+
+
+/* Write the `n' pages of `iov' to the consecutive disk pages starting
+   at `offset' of file `f'.  If `compressed_pages' is set, the pages
+   are written as in `write_pages_now', otherwise as in `write_at'. */
+static void write_pages_at(file_t *f, off_t offset, struct iovec *iov, int n)
+{
+  if (!compressed_pages) {
+    write_at(f, offset, iov, n);
+    return;
+  }
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes) {
+    /* Let the commit thread compress them. */
+    queue_commit_write(f, offset, iov, n, 1);
+    return;
+  }
+#endif
+  write_pages_now(f, offset, iov, n, compress_buffer);
+}
+
+
+/* Write the disk block `block' at `offset' of file `f'. */
+static void write_block(file_t *f, off_t offset, ptr_t block)
+{
+  struct iovec iov;
+
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes) {
+    assert(number_of_commit_blocks < MAX_NUMBER_OF_COMMIT_BLOCKS);
+    memcpy(commit_block[number_of_commit_blocks], block, DISK_BLOCK_SIZE);
+    block = commit_block[number_of_commit_blocks++];
+  }
+#endif
+  iov.iov_base = (void *) block;
+  iov.iov_len = DISK_BLOCK_SIZE;
+  write_at(f, offset, &iov, 1);
+}
+
+
+#ifdef USE_FSYNC
+static void sync_now(file_t *f)
+{
+  if (fsync(f->fd) == -1) {
+    perror("sync_now/fsync");
+    exit(1);
+  }
+}
+
+
+/* `fsync' file `f', or queue the `fsync' as in `write_at'. */
+static void sync_file(file_t *f)
+{
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes) {
+    queue_commit_write(f, 0, NULL, 0, 0);
+    return;
+  }
+#endif
+  sync_now(f);
+}
+#endif
+
+
+#ifdef PIPELINED_COMMIT
+static void *commit_thread_main(void *arg)
+{
+  unsigned long i;
+
+  while (1) {
+    if (pthread_mutex_lock(&commit_lock)) {
+      perror("commit_thread_main/pthread_mutex_lock");
+      exit(1);
+    }
+    while (!commit_is_being_written)
+      if (pthread_cond_wait(&commit_wakeup, &commit_lock)) {
+	perror("commit_thread_main/pthread_cond_wait");
+	exit(1);
+      }
+    if (pthread_mutex_unlock(&commit_lock)) {
+      perror("commit_thread_main/pthread_mutex_unlock");
+      exit(1);
+    }
+
+    for (i = 0; i < number_of_commit_writes; i++)
+#ifdef USE_FSYNC
+      if (commit_write[i].n == 0)
+	sync_now(commit_write[i].f);
+      else
+#endif
+      if (commit_write[i].is_compressed)
+	write_pages_now(commit_write[i].f, commit_write[i].offset,
+			commit_write[i].iov, commit_write[i].n,
+			commit_compress_buffer);
+      else
+	write_now(commit_write[i].f, commit_write[i].offset,
+		  commit_write[i].iov, commit_write[i].n);
+
+    if (pthread_mutex_lock(&commit_lock)) {
+      perror("commit_thread_main/pthread_mutex_lock");
+      exit(1);
+    }
+    commit_is_being_written = 0;
+    if (pthread_cond_signal(&commit_done)) {
+      perror("commit_thread_main/pthread_cond_signal");
+      exit(1);
+    }
+    if (pthread_mutex_unlock(&commit_lock)) {
+      perror("commit_thread_main/pthread_mutex_unlock");
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+
+/* Hand the queued writes to the commit thread. */
+static void start_commit(void)
+{
+  assert(is_queueing_writes && !commit_is_pending);
+  is_queueing_writes = 0;
+  commit_is_pending = 1;
+  if (pthread_mutex_lock(&commit_lock)) {
+    perror("start_commit/pthread_mutex_lock");
+    exit(1);
+  }
+  commit_is_being_written = 1;
+  if (pthread_cond_signal(&commit_wakeup)) {
+    perror("start_commit/pthread_cond_signal");
+    exit(1);
+  }
+  if (pthread_mutex_unlock(&commit_lock)) {
+    perror("start_commit/pthread_mutex_unlock");
+    exit(1);
+  }
+}
+#endif /* PIPELINED_COMMIT */
+
+
+/* Start queueing the writes of a commit group if `pipelined_commit'
+   is set.  The previous commit group is first waited to complete. */
+void io_begin_commit(void)
+{
+#ifdef PIPELINED_COMMIT
+  if (!pipelined_commit)
+    return;
+  io_wait_for_commit();
+  if (!commit_thread_is_started) {
+    if (pthread_create(&commit_thread, NULL, commit_thread_main, NULL) != 0) {
+      perror("io_begin_commit/pthread_create");
+      exit(1);
+    }
+    commit_thread_is_started = 1;
+    /* Make sure the last commit group is on disk at exit. */
+    atexit(io_wait_for_commit);
+  }
+  number_of_commit_writes = 0;
+  number_of_commit_blocks = 0;
+  is_queueing_writes = 1;
+#endif
+}
+
+
+/* Wait until the commit group handed to the commit thread is on
+   disk, and then free the previous root block. */
+void io_wait_for_commit(void)
+{
+#ifdef PIPELINED_COMMIT
+  if (!commit_is_pending
+      /* E.g. `exit' in the commit thread calls this via `atexit'. */
+      || pthread_equal(pthread_self(), commit_thread))
+    return;
+  if (pthread_mutex_lock(&commit_lock)) {
+    perror("io_wait_for_commit/pthread_mutex_lock");
+    exit(1);
+  }
+  while (commit_is_being_written)
+    if (pthread_cond_wait(&commit_done, &commit_lock)) {
+      perror("io_wait_for_commit/pthread_cond_wait");
+      exit(1);
+    }
+  if (pthread_mutex_unlock(&commit_lock)) {
+    perror("io_wait_for_commit/pthread_mutex_unlock");
+    exit(1);
+  }
+  commit_is_pending = 0;
+#ifdef OPTIMIZED_ROOT_LOCATION
+  free_root_page(obsolete_root_file, obsolete_root_page);
+#endif
+#endif
+}
+
+
+/* The file descriptor of the delta log, or -1. */
+static int delta_log_fd = -1;
+
+
+int io_open_delta_log(int is_created)
+{
+  if (delta_log_filename == NULL || delta_log_filename[0] == '\0')
+    return 0;
+  delta_log_fd = open(delta_log_filename,
+		      /* A missing log on recovery is an empty one. */
+		      is_created
+		      ? O_CREAT | O_TRUNC | O_RDWR | O_SYNC_FLAG
+		      : O_CREAT | O_RDWR | O_SYNC_FLAG,
+		      disk_file_permissions >= 0 ? disk_file_permissions : 0666);
+  if (delta_log_fd == -1) {
+    perror("io_open_delta_log/open");
+    exit(1);
+  }
+  return 1;
+}
+
+
+void io_seek_delta_log(unsigned long offset)
+{
+  assert(delta_log_fd != -1);
+  if (lseek(delta_log_fd, offset, SEEK_SET) == -1) {
+    perror("io_seek_delta_log/lseek");
+    exit(1);
+  }
+}
+
+
+void io_write_delta_log(ptr_t *ptrs, unsigned long *number_of_bytes, int n)
+{
+  struct iovec iov[4];
+  unsigned long total_nbytes = 0;
+  int i;
+
+  assert(delta_log_fd != -1);
+  assert(n <= 4);
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = (void *) ptrs[i];
+    iov[i].iov_len = number_of_bytes[i];
+    total_nbytes += number_of_bytes[i];
+  }
+  if (writev(delta_log_fd, iov, n) != (signed long) total_nbytes) {
+    perror("io_write_delta_log/writev");
+    exit(1);
+  }
+#ifdef USE_FSYNC
+  if (fsync(delta_log_fd) == -1) {
+    perror("io_write_delta_log/fsync");
+    exit(1);
+  }
+#endif
+}
+
+
+unsigned long io_read_delta_log(ptr_t ptr, unsigned long number_of_bytes)
+{
+  long n;
+  unsigned long nbytes = 0;
+
+  assert(delta_log_fd != -1);
+  while (nbytes < number_of_bytes) {
+    n = read(delta_log_fd, (char *) ptr + nbytes, number_of_bytes - nbytes);
+    if (n == -1) {
+      perror("io_read_delta_log/read");
+      exit(1);
+    }
+    if (n == 0)
+      break;
+    nbytes += n;
+  }
+  return nbytes;
+}
+
+
 /* Write to disk the given memory area, at most PAGE_SIZE in size.
    The corresponding disk page to which the memory page is written is
    selected here.  Writing starts an asynchronous aiowrite process and
@@ -372,9 +1427,10 @@ void io_close_file(void)
 
 disk_page_number_t io_write_page(ptr_t ptr, unsigned long number_of_bytes)
 {
-  long files_left, pages_left;
+  long files_left, page_number;
   disk_page_number_t dpn;
   file_t *f;
+  struct iovec iov;
 #ifdef DISK_LOAD_BALANCING
   long load, lowest_load = 0;
   unsigned long fastest_file, free_page;
@@ -415,22 +1471,19 @@ disk_page_number_t io_write_page(ptr_t ptr, unsigned long number_of_bytes)
   file_cursor = fastest_file;
   f = &file[file_cursor];
   /*  fprintf(stderr, "Selected file: %d\n", file_cursor); */
-  for (pages_left = f->number_of_pages; pages_left > 0; pages_left--) {
-    if (f->status[f->cursor] == FREE) {
-      break;
-    }
-    f->cursor = (f->cursor + 1) % f->number_of_pages;
-  }
+  page_number = find_free_page(f, f->cursor);
+  assert(page_number != -1);
+  f->cursor = page_number;
   /*  fprintf(stderr, "Selected page: %d\n", f->cursor); */
 #else
   /* Round robin to search for the disk and page to write to. */
   for (files_left = number_of_files; files_left > 0; files_left--) {
     f = &file[file_cursor];
     if (f->number_of_free_pages > 1) {
-      for (pages_left = f->number_of_pages; pages_left > 0; pages_left--) {
-	if (f->status[f->cursor] == FREE)
-	  goto found_disk_page;
-	f->cursor = (f->cursor + 1) % f->number_of_pages;
+      page_number = find_free_page(f, f->cursor);
+      if (page_number != -1) {
+	f->cursor = page_number;
+	goto found_disk_page;
       }
     }
     file_cursor = (file_cursor + 1) % number_of_files;
@@ -441,13 +1494,19 @@ disk_page_number_t io_write_page(ptr_t ptr, unsigned long number_of_bytes)
 
 found_disk_page:
 #endif
+  assert(f->status[f->cursor] == FREE);
   f->status[f->cursor] = ALLOCATED;
+  f->compressed_nblocks[f->cursor] = 0;
+  mark_page_not_free(f, f->cursor);
   f->number_of_free_pages--;
   number_of_free_disk_pages--;
+  note_unshipped_page(file_cursor, f->cursor);
 
 #ifdef ASYNC_IO
 
-  if (asyncio_write_page(file_cursor, f->cursor, ptr, number_of_bytes) == 0) {
+  if (!IS_QUEUEING_WRITES
+      && asyncio_write_page(file_cursor, f->cursor,
+			    ptr, number_of_bytes) == 0) {
     goto return_from_write_page;
   }
 
@@ -457,38 +1516,315 @@ found_disk_page:
 #endif /* ASYNC_IO */
 
   /* Plain write() the data to the disk and return when it's there. */
-  if (lseek(f->fd, disk_skip_nbytes + f->cursor * PAGE_SIZE, SEEK_SET) == -1) {
-    perror("io_write_page/lseek");
-    exit(1);
+  iov.iov_base = (void *) ptr;
+  iov.iov_len = number_of_bytes;
+  write_pages_at(f, disk_skip_nbytes + f->cursor * PAGE_SIZE, &iov, 1);
+
+return_from_write_page:
+  /* Increase file_cursor by one to point to the next file
+     so that the next write will go to it (if there's room). */
+  dpn = MAKE_DISK_PAGE_NUMBER(file_cursor, f->cursor);
+  file_cursor = (file_cursor + 1) % number_of_files;
+  f->cursor = (f->cursor + 1) % f->number_of_pages;
+  return dpn;
+}
+
+
+/* Write the `n' pages in `ptrs' to the contiguous free disk pages of
+   file `file_number' starting from `page_number', and store their disk
+   page numbers in `disk_pages'.  Each page but the last is written in
+   full so that the pages stay at their places in the sequential
+   write, and compressed pages are filled up as in `write_pages_now'. */
+static void write_run(unsigned long file_number,
+		      unsigned long page_number,
+		      ptr_t *ptrs,
+		      unsigned long *number_of_bytes,
+		      unsigned long n,
+		      disk_page_number_t *disk_pages)
+{
+  file_t *f = &file[file_number];
+  struct iovec iov[MAX_RUN_LENGTH];
+  unsigned long i, first, nbytes;
+#ifdef ASYNC_IO
+  unsigned long total_nbytes;
+#endif
+
+  assert(n > 0 && n <= MAX_RUN_LENGTH);
+  assert(page_number + n <= f->number_of_pages);
+  for (i = 0; i < n; i++) {
+    assert(ptrs[i][0] == PAGE_MAGIC_COOKIE);
+    assert(number_of_bytes[i] <= PAGE_SIZE);
+    assert(f->status[page_number + i] == FREE);
+    f->status[page_number + i] = ALLOCATED;
+    f->compressed_nblocks[page_number + i] = 0;
+    mark_page_not_free(f, page_number + i);
+    note_unshipped_page(file_number, page_number + i);
+    disk_pages[i] = MAKE_DISK_PAGE_NUMBER(file_number, page_number + i);
   }
-  if (write(f->fd, (void *) ptr, number_of_bytes)
-      != (signed long) number_of_bytes) {
-    perror("io_write_page/write");
-    exit(1);
+  f->number_of_free_pages -= n;
+  number_of_free_disk_pages -= n;
+  f->cursor = (page_number + n) % f->number_of_pages;
+
+  /* Make sure the last write ends at WRITE_BOUNDARY. */
+  nbytes = number_of_bytes[n - 1];
+  if (nbytes % WRITE_BOUNDARY != 0)
+    nbytes += WRITE_BOUNDARY - nbytes % WRITE_BOUNDARY;
+
+  i = 0;
+#ifdef ASYNC_IO
+  /* The asynchronous writes need not be of full pages. */
+  for (; i < n - 1 && !IS_QUEUEING_WRITES; i++) {
+    total_nbytes = number_of_bytes[i];
+    if (total_nbytes % WRITE_BOUNDARY != 0)
+      total_nbytes += WRITE_BOUNDARY - total_nbytes % WRITE_BOUNDARY;
+    if (asyncio_write_page(file_number, page_number + i,
+			   ptrs[i], total_nbytes) != 0)
+      break;
+  }
+  if (i == n - 1
+      && !IS_QUEUEING_WRITES
+      && asyncio_write_page(file_number, page_number + i,
+			    ptrs[i], nbytes) == 0)
+    return;
+  /* If `asyncio_write_page' failed, write the rest of the run
+     synchronously. */
+#endif
+
+  first = i;
+  for (; i < n; i++) {
+    iov[i].iov_base = (void *) ptrs[i];
+    iov[i].iov_len = i == n - 1 ? nbytes : PAGE_SIZE;
+    if (compressed_pages && i < n - 1) {
+      /* Compress only the words in use. */
+      iov[i].iov_len = number_of_bytes[i];
+      if (iov[i].iov_len % WRITE_BOUNDARY != 0)
+	iov[i].iov_len += WRITE_BOUNDARY - iov[i].iov_len % WRITE_BOUNDARY;
+    }
+  }
+  write_pages_at(f, disk_skip_nbytes + (page_number + first) * PAGE_SIZE,
+		 iov + first, n - first);
+}
+
+
+/* Write the given `n' pages of a generation.  Each database file in
+   turn gets an equal share of the pages, as far as it has room.  The
+   share is placed in runs of contiguous free disk pages, each of
+   which is written with one system call. */
+void io_write_pages(ptr_t *ptrs,
+		    unsigned long *number_of_bytes,
+		    unsigned long n,
+		    disk_page_number_t *disk_pages)
+{
+  unsigned long i, share, left_in_share, run_length, files_left;
+  long page_number;
+  file_t *f;
+
+#ifdef DISK_LOAD_BALANCING
+  /* Let `io_write_page' choose the file of each page by its load. */
+  for (i = 0; i < n; i++)
+    disk_pages[i] = io_write_page(ptrs[i], number_of_bytes[i]);
+#else
+  share = (n + number_of_files - 1) / number_of_files;
+  i = 0;
+  while (i < n) {
+    /* Skip the files that have no room.  As in `io_write_page', one
+       page is left free for the root block. */
+    for (files_left = number_of_files; files_left > 0; files_left--) {
+      f = &file[file_cursor];
+      if (f->number_of_free_pages > 1)
+	break;
+      file_cursor = (file_cursor + 1) % number_of_files;
+    }
+    if (files_left == 0) {
+      fprintf(stderr, "io_write_pages: Disk backupfile full.\n");
+      exit(1);
+    }
+    left_in_share = share < n - i ? share : n - i;
+    while (left_in_share > 0 && f->number_of_free_pages > 1) {
+      page_number = find_free_page(f, f->cursor);
+      assert(page_number != -1);
+      run_length = 1;
+      while (run_length < left_in_share
+	     && run_length < MAX_RUN_LENGTH
+	     && run_length < f->number_of_free_pages - 1
+	     && page_number + run_length < f->number_of_pages
+	     && f->status[page_number + run_length] == FREE)
+	run_length++;
+      write_run(file_cursor, page_number,
+		ptrs + i, number_of_bytes + i, run_length, disk_pages + i);
+      i += run_length;
+      left_in_share -= run_length;
+    }
+    file_cursor = (file_cursor + 1) % number_of_files;
+  }
+#endif
+}
+
+
+/* Normally `io_write_page' may assume the data behind the `ptr' given
+   to it does not change.  Calling this function allows the callee to
+   change any written page again. */
+void io_allow_page_changes(void)
+{
+  io_wait_for_commit();
+  /* We either have to ensure the pages are already on disk, or we
+     have to make a temporary private copy of those pages that are not
+     on disk.  The former is simpler, so we use it here now. */
+#ifdef ASYNC_IO
+  asyncio_drain_pending_writes();
+#endif
+}
+
+
+/* Compute the checksum of the root block, skipping the checksum word
+   itself. */
+static word_t root_checksum(void)
+{
+  return crc32c(crc32c(0, root, ROOT_IX_checksum),
+		root + ROOT_IX_checksum + 1,
+		NUMBER_OF_ROOT_BLOCK_ITEMS - ROOT_IX_checksum - 1);
+}
+
+
+/* Return non-zero if the block in `root' is a whole root block.  A
+   root block in the other byte order is swapped first.  A torn or
+   otherwise corrupt root has a bad checksum. */
+static int root_is_intact(void)
+{
+  unsigned long i;
+
+  if (root[0] == SWAP_BYTES(ROOT_MAGIC_COOKIE))
+    for (i = 0; i * sizeof(word_t) < DISK_BLOCK_SIZE; i++)
+      root[i] = SWAP_BYTES(root[i]);
+  return root[0] == ROOT_MAGIC_COOKIE
+    && GET_ROOT_WORD(checksum) == root_checksum();
+}
+
+
+#ifdef OPTIMIZED_ROOT_LOCATION
+
+static word_t root_index_slot_checksum(ptr_t slot)
+{
+  return crc32c(0, slot, SLOT_CHECKSUM);
+}
+
+
+/* Record in the root index of file `f' that the root block with the
+   current time stamp is written to page `page_number' of the file. */
+static void write_root_index_slot(file_t *f, unsigned long page_number)
+{
+  word_t slot[WORDS_PER_DISK_BLOCK];
+
+  memset(slot, 0, sizeof(slot));
+  slot[SLOT_COOKIE] = ROOT_INDEX_COOKIE;
+  slot[SLOT_TIME_STAMP_HI] = GET_ROOT_WORD(time_stamp_hi);
+  slot[SLOT_TIME_STAMP_LO] = GET_ROOT_WORD(time_stamp_lo);
+  slot[SLOT_PAGE] = page_number;
+  slot[SLOT_CHECKSUM] = root_index_slot_checksum(slot);
+  write_block(f,
+	      ROOT_INDEX_OFFSET(f)
+	      + (GET_ROOT_WORD(time_stamp_lo) % ROOT_INDEX_SLOTS)
+	        * DISK_BLOCK_SIZE,
+	      slot);
+}
+
+
+/* Find the newest root block with the root index.  If found, return
+   1 and leave the root block in `root', otherwise return 0.  Also set
+   the cursor of each file to the newest root in it. */
+static int find_root_by_index(unsigned long *root_file,
+			      unsigned long *root_page)
+{
+  unsigned long i, j, k, newest_file = 0;
+  word_t *index, *slot, *newest;
+  ssize_t n;
+
+  index = malloc(number_of_files * PAGE_SIZE);
+  if (index == NULL)
+    return 0;
+
+  /* Read the indices and drop the invalid slots. */
+  for (i = 0; i < number_of_files; i++) {
+    slot = index + i * (PAGE_SIZE / sizeof(word_t));
+    if (lseek(file[i].fd, ROOT_INDEX_OFFSET(&file[i]), SEEK_SET) == -1
+	|| (n = read(file[i].fd, (void *) slot, PAGE_SIZE)) == -1)
+      n = 0;
+    /* The file may lack the index if the database has never used
+       it. */
+    memset((char *) slot + n, 0, PAGE_SIZE - n);
+    newest = NULL;
+    for (j = 0; j < ROOT_INDEX_SLOTS; j++, slot += WORDS_PER_DISK_BLOCK) {
+      if (slot[SLOT_COOKIE] == SWAP_BYTES(ROOT_INDEX_COOKIE))
+	for (k = 0; k <= SLOT_CHECKSUM; k++)
+	  slot[k] = SWAP_BYTES(slot[k]);
+      if (slot[SLOT_COOKIE] != ROOT_INDEX_COOKIE
+	  || slot[SLOT_CHECKSUM] != root_index_slot_checksum(slot)
+	  || slot[SLOT_PAGE] >= file[i].number_of_pages) {
+	slot[SLOT_COOKIE] = 0;
+	continue;
+      }
+      if (newest == NULL
+	  || time_stamp_is_newer_than(slot[SLOT_TIME_STAMP_HI],
+				      slot[SLOT_TIME_STAMP_LO],
+				      newest[SLOT_TIME_STAMP_HI],
+				      newest[SLOT_TIME_STAMP_LO]))
+	newest = slot;
+    }
+    /* As in the binary search, start allocating disk pages from the
+       newest root on, since the pages before it are more likely in
+       use. */
+    if (newest != NULL)
+      file[i].cursor = newest[SLOT_PAGE];
+  }
+
+  /* Try the slots from the newest down. */
+  for (;;) {
+    newest = NULL;
+    for (i = 0; i < number_of_files; i++) {
+      slot = index + i * (PAGE_SIZE / sizeof(word_t));
+      for (j = 0; j < ROOT_INDEX_SLOTS; j++, slot += WORDS_PER_DISK_BLOCK)
+	if (slot[SLOT_COOKIE] == ROOT_INDEX_COOKIE
+	    && (newest == NULL
+		|| time_stamp_is_newer_than(slot[SLOT_TIME_STAMP_HI],
+					    slot[SLOT_TIME_STAMP_LO],
+					    newest[SLOT_TIME_STAMP_HI],
+					    newest[SLOT_TIME_STAMP_LO]))) {
+	  newest = slot;
+	  newest_file = i;
+	}
+    }
+    if (newest == NULL) {
+      free(index);
+      return 0;
+    }
+    if (root_search_is_verbose)
+      fprintf(stderr, "Root index points to file %lu page %lu\n",
+	      newest_file, (unsigned long) newest[SLOT_PAGE]);
+    if (lseek(file[newest_file].fd,
+	      disk_skip_nbytes + newest[SLOT_PAGE] * PAGE_SIZE,
+	      SEEK_SET) == -1) {
+      perror("find_root_by_index/lseek");
+      exit(1);
+    }
+    if (read(file[newest_file].fd, (void *) root, DISK_BLOCK_SIZE)
+	!= DISK_BLOCK_SIZE) {
+      perror("find_root_by_index/read");
+      exit(1);
+    }
+    if (root_is_intact()
+	&& GET_ROOT_WORD(time_stamp_hi) == newest[SLOT_TIME_STAMP_HI]
+	&& GET_ROOT_WORD(time_stamp_lo) == newest[SLOT_TIME_STAMP_LO]) {
+      *root_file = newest_file;
+      *root_page = newest[SLOT_PAGE];
+      free(index);
+      return 1;
+    }
+    /* The root was never written, or it has been overwritten since. */
+    newest[SLOT_COOKIE] = 0;
   }
-
-return_from_write_page:
-  /* Increase file_cursor by one to point to the next file
-     so that the next write will go to it (if there's room). */
-  dpn = MAKE_DISK_PAGE_NUMBER(file_cursor, f->cursor);
-  file_cursor = (file_cursor + 1) % number_of_files;
-  f->cursor = (f->cursor + 1) % f->number_of_pages;
-  return dpn;
 }
 
-
-/* Normally `io_write_page' may assume the data behind the `ptr' given
-   to it does not change.  Calling this function allows the callee to
-   change any written page again. */
-void io_allow_page_changes(void)
-{
-  /* We either have to ensure the pages are already on disk, or we
-     have to make a temporary private copy of those pages that are not
-     on disk.  The former is simpler, so we use it here now. */
-#ifdef ASYNC_IO
-  asyncio_drain_pending_writes();
-#endif
-}
+#endif /* OPTIMIZED_ROOT_LOCATION */
 
 
 /* Write atomically the root block starting from `root' and extending
@@ -498,13 +1834,16 @@ void io_allow_page_changes(void)
    data pages.  Otherwise write it to the end of file[FIXED_ROOT_DISK]. */
 void io_write_root(void)
 {
-  long files_left, pages_left;
+  long files_left, page_number;
   unsigned long i;
   file_t *f;
 
   assert(root[0] == ROOT_MAGIC_COOKIE);
+  SET_ROOT_WORD(checksum, root_checksum());
 
 #ifdef ASYNC_IO
+  /* With a pipelined commit only the writes of the major gc may be
+     pending here. */
   asyncio_drain_pending_writes();
 #endif
 
@@ -521,19 +1860,19 @@ void io_write_root(void)
     fprintf(stderr, "io_write_root: disk backup file full.\n");
     exit(1);
   }
-  for (pages_left = f->number_of_pages; pages_left > 0; pages_left--) {
-    if (f->status[f->cursor] == FREE)
-      goto found_disk_page;
-    f->cursor = (f->cursor + 1) % f->number_of_pages;
+  page_number = find_free_page(f, f->cursor);
+  if (page_number != -1) {
+    f->cursor = page_number;
+    goto found_disk_page;
   }
 #else
   /* Search for a free page as we did in `io_write_page'. */
   for (files_left = number_of_files; files_left > 0; files_left--) {
     f = &file[file_cursor];
-    for (pages_left = f->number_of_pages; pages_left > 0; pages_left--) {
-      if (f->status[f->cursor] == FREE)
-	goto found_disk_page;
-      f->cursor = (f->cursor + 1) % f->number_of_pages;
+    page_number = find_free_page(f, f->cursor);
+    if (page_number != -1) {
+      f->cursor = page_number;
+      goto found_disk_page;
     }
     file_cursor = (file_cursor + 1) % number_of_files;
   }
@@ -541,36 +1880,36 @@ void io_write_root(void)
   assert(0);
 found_disk_page:
   f->status[f->cursor] = ROOT;
+  mark_page_not_free(f, f->cursor);
   f->number_of_free_pages--;
   number_of_free_disk_pages--;
 
-  /* Seek to the point of the root block, and write the root block. */ 
+  /* The index slot goes first, see `find_root_by_index'. */
+  write_root_index_slot(f, f->cursor);
+
+  /* Write the root block to its page. */ 
 #ifdef USE_FSYNC
   for (i = 0; i < number_of_files; i++)
-    fsync(file[i].fd);
+    sync_file(&file[i]);
 #endif
-  if (lseek(f->fd, disk_skip_nbytes + f->cursor * PAGE_SIZE, SEEK_SET) == -1) {
-    perror("io_write_root/lseek");
-    exit(1);
-  }
-  if (write(f->fd, (void *) root, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
-    perror("io_write_root/write");
-    exit(1);
-  }
+  write_block(f, disk_skip_nbytes + f->cursor * PAGE_SIZE, root);
   
   /* This might not be needed if only disk pages are freed suffiently
      late. */
 #ifdef USE_FSYNC
-  fsync(f->fd);
+  sync_file(f);
 #endif
 
-  if (prev_root_file != -1 && prev_root_page != -1) {
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes) {
+    /* The old root is obsolete only when the new one is on disk. */
+    obsolete_root_file = prev_root_file;
+    obsolete_root_page = prev_root_page;
+    start_commit();
+  } else
+#endif
     /* The old root is now obsolete and may be overwritten. */
-    assert(file[prev_root_file].status[prev_root_page] == ROOT);
-    file[prev_root_file].status[prev_root_page] = FREE;
-    file[prev_root_file].number_of_free_pages++;
-    number_of_free_disk_pages++;
-  }
+    free_root_page(prev_root_file, prev_root_page);
   prev_root_file = file_cursor;
   prev_root_page = f->cursor;
   f->cursor = (f->cursor + 1) % f->number_of_pages;
@@ -580,32 +1919,23 @@ found_disk_page:
 
 #ifdef USE_FSYNC
   for (i = 0; i < number_of_files; i++)
-    if (fsync(file[i].fd) == -1) {
-      perror("io_write_root/fsync");
-      exit(1);
-    }
+    sync_file(&file[i]);
 #endif
 
-  if (lseek(file[FIXED_ROOT_DISK].fd,
-	    disk_skip_nbytes
-	    + file[FIXED_ROOT_DISK].number_of_pages * PAGE_SIZE,
-	    SEEK_SET) == -1) {
-    perror("io_write_root/lseek");
-    exit(1);
-  }
-  if (write(file[FIXED_ROOT_DISK].fd,
-	    (void *) root, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
-    perror("io_write_root/write");
-    exit(1);
-  }
+  write_block(&file[FIXED_ROOT_DISK],
+	      disk_skip_nbytes
+	      + file[FIXED_ROOT_DISK].number_of_pages * PAGE_SIZE,
+	      root);
 
   /* This might not be needed if only disk pages are freed
      sufficiently late. */
 #ifdef USE_FSYNC
-  if (fsync(file[0].fd) == -1) {
-    perror("io_write_root/fsync2");
-    exit(1);
-  }
+  sync_file(&file[0]);
+#endif
+
+#ifdef PIPELINED_COMMIT
+  if (is_queueing_writes)
+    start_commit();
 #endif
 
 #endif /* OPTIMIZED_ROOT_LOCATION */
@@ -617,6 +1947,38 @@ found_disk_page:
 }
 
 
+/* Read at most `number_of_bytes' of disk page `page_number' of `f' to
+   `ptr'.  If the disk page is known to be compressed, only its
+   compressed blocks are read.  What is known may be out of date if
+   the disk page has been written again since, so the header read
+   tells whether the rest must be read after all.  Returns non-zero if
+   the read fails. */
+static int read_disk_page(file_t *f,
+			  unsigned long page_number,
+			  ptr_t ptr,
+			  unsigned long number_of_bytes)
+{
+  off_t offset = disk_skip_nbytes + page_number * PAGE_SIZE;
+  unsigned long nbytes = number_of_bytes, stored_nbytes;
+
+  if (f->compressed_nblocks[page_number] != 0
+      && f->compressed_nblocks[page_number] * WRITE_BOUNDARY < nbytes)
+    nbytes = f->compressed_nblocks[page_number] * WRITE_BOUNDARY;
+  if (pread(f->fd, (void *) ptr, nbytes, offset) != (signed long) nbytes)
+    return 1;
+  if (nbytes < number_of_bytes) {
+    stored_nbytes = stored_page_nbytes(ptr, number_of_bytes);
+    if (stored_nbytes > nbytes
+	&& pread(f->fd, (void *) ((char *) ptr + nbytes),
+		 stored_nbytes - nbytes, offset + nbytes)
+	   != (signed long) (stored_nbytes - nbytes))
+      return 1;
+  }
+  note_compressed_run(f, page_number, ptr);
+  return 0;
+}
+
+
 /* Read the given page from the given disk page. */
 void io_read_page(ptr_t ptr,
 		  unsigned long number_of_bytes,
@@ -630,18 +1992,12 @@ void io_read_page(ptr_t ptr,
   /* It must have been declared allocated prior to reading it. */
   assert(file[file_number].status[page_number] == ALLOCATED);
 
-  if (lseek(file[file_number].fd,
-	    disk_skip_nbytes + page_number * PAGE_SIZE,
-	    SEEK_SET) == -1) {
-    perror("io_read_page/lseek");
-    exit(1);
-  }
-  if (read(file[file_number].fd, (void *) ptr, number_of_bytes)
-      != (signed long) number_of_bytes) {
-    perror("io_read_page/read");
+  if (read_disk_page(&file[file_number], page_number, ptr, number_of_bytes)) {
+    perror("io_read_page/pread");
     exit(1);
   }
 
+  io_uncompress_page(ptr, uncompress_buffer);
   if (ptr[0] == SWAP_BYTES(PAGE_MAGIC_COOKIE))
     for (i = 0; i * sizeof(word_t) < number_of_bytes; i++)
       ptr[i] = SWAP_BYTES(ptr[i]);
@@ -652,6 +2008,23 @@ void io_read_page(ptr_t ptr,
   }
 }
 
+int io_pread_page(ptr_t ptr,
+		  ptr_t buffer,
+		  disk_page_number_t disk_page_number)
+{
+  unsigned long file_number = GET_FILE_NUMBER(disk_page_number);
+  unsigned long page_number = GET_PAGE_NUMBER(disk_page_number);
+  unsigned long i;
+
+  if (read_disk_page(&file[file_number], page_number, ptr, PAGE_SIZE))
+    return 1;
+  io_uncompress_page(ptr, buffer);
+  if (ptr[0] == SWAP_BYTES(PAGE_MAGIC_COOKIE))
+    for (i = 0; i < PAGE_SIZE / sizeof(word_t); i++)
+      ptr[i] = SWAP_BYTES(ptr[i]);
+  return ptr[0] != PAGE_MAGIC_COOKIE;
+}
+
 /* Start reading a page from a disk asynchronously.  This is not guaranteed
    to finish before `io_read_page_wait' is called. */
 void io_read_page_start(ptr_t ptr,
@@ -667,20 +2040,26 @@ void io_read_page_start(ptr_t ptr,
   assert(file[file_number].status[page_number] == ALLOCATED);
 
 #ifdef ASYNC_IO
-  if (asyncio_read_page(file_number, page_number, ptr, number_of_bytes) != 0)
+  if (asyncio_read_page(file_number, page_number, ptr, number_of_bytes) == 0) {
+    if (number_of_started_reads == max_number_of_started_reads) {
+      max_number_of_started_reads = 2 * max_number_of_started_reads + 64;
+      started_read = realloc(started_read,
+			     max_number_of_started_reads * sizeof(ptr_t));
+      if (started_read == NULL) {
+	fprintf(stderr, "io_read_page_start: `realloc' failed.\n");
+	exit(1);
+      }
+    }
+    started_read[number_of_started_reads++] = ptr;
+  } else
 #endif
   {
-    if (lseek(file[file_number].fd,
-	      disk_skip_nbytes + page_number * PAGE_SIZE,
-	      SEEK_SET) == -1) {
-      perror("io_read_page/lseek");
-      exit(1);
-    }
-    if (read(file[file_number].fd, (void *) ptr, number_of_bytes)
-	!= (signed long) number_of_bytes) {
-      perror("io_read_page/read");
+    if (read_disk_page(&file[file_number], page_number,
+		       ptr, number_of_bytes)) {
+      perror("io_read_page_start/pread");
       exit(1);
     }
+    io_uncompress_page(ptr, uncompress_buffer);
   }
 }
 
@@ -688,7 +2067,94 @@ void io_read_page_start(ptr_t ptr,
 void io_read_page_wait(void)
 {
 #ifdef ASYNC_IO
+  unsigned long i;
+
   asyncio_drain_pending_reads();
+  /* The asynchronous IO may have uncompressed the pages already. */
+  for (i = 0; i < number_of_started_reads; i++)
+    io_uncompress_page(started_read[i], uncompress_buffer);
+  number_of_started_reads = 0;
+#endif
+}
+
+
+void io_read_page_ahead(disk_page_number_t disk_page_number)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (number_of_read_aheads == max_number_of_read_aheads) {
+    max_number_of_read_aheads = 2 * max_number_of_read_aheads + 256;
+    read_ahead = realloc(read_ahead,
+			 max_number_of_read_aheads
+			 * sizeof(disk_page_number_t));
+    if (read_ahead == NULL) {
+      fprintf(stderr, "io_read_page_ahead: `realloc' failed.\n");
+      exit(1);
+    }
+  }
+  read_ahead[number_of_read_aheads++] = disk_page_number;
+#endif
+}
+
+
+#ifdef HAVE_POSIX_FADVISE
+static int compare_disk_page_numbers(const void *a, const void *b)
+{
+  disk_page_number_t x = *(disk_page_number_t *) a;
+  disk_page_number_t y = *(disk_page_number_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+#endif
+
+
+/* The disk pages are sorted by file and place in the file, and each
+   run of consecutive disk pages is given to `posix_fadvise' at once.
+   The system then reads the files in parallel, in long sequential
+   reads.  If `compressed_pages' is set, each disk page is instead
+   given with only its compressed blocks, which are learned from the
+   first block of each compressed run, see `write_pages_now'. */
+void io_start_read_ahead(void)
+{
+#ifdef HAVE_POSIX_FADVISE
+  unsigned long i, j, file_number, page_number, nbytes;
+  word_t block[WORDS_PER_DISK_BLOCK];
+  file_t *f;
+
+  qsort(read_ahead, number_of_read_aheads, sizeof(disk_page_number_t),
+	compare_disk_page_numbers);
+  for (i = 0; i < number_of_read_aheads; i = j) {
+    file_number = GET_FILE_NUMBER(read_ahead[i]);
+    page_number = GET_PAGE_NUMBER(read_ahead[i]);
+    if (compressed_pages) {
+      f = &file[file_number];
+      if (f->compressed_nblocks[page_number] == 0
+	  && pread(f->fd, (void *) block, WRITE_BOUNDARY,
+		   disk_skip_nbytes + page_number * PAGE_SIZE)
+	     == WRITE_BOUNDARY) {
+	note_compressed_run(f, page_number, block);
+	nbytes = stored_page_nbytes(block, PAGE_SIZE);
+	if (nbytes < PAGE_SIZE)
+	  f->compressed_nblocks[page_number] = nbytes / WRITE_BOUNDARY;
+      }
+      nbytes = f->compressed_nblocks[page_number] * WRITE_BOUNDARY;
+      posix_fadvise(f->fd, disk_skip_nbytes + page_number * PAGE_SIZE,
+		    nbytes != 0 ? nbytes : PAGE_SIZE, POSIX_FADV_WILLNEED);
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1;
+	 j < number_of_read_aheads
+	   && read_ahead[j] - read_ahead[j - 1] <= 1;
+	 j++)
+      ;
+    /* Only a hint, so failures are ignored. */
+    posix_fadvise(file[file_number].fd,
+		  disk_skip_nbytes + page_number * PAGE_SIZE,
+		  (GET_PAGE_NUMBER(read_ahead[j - 1]) - page_number + 1)
+		  * PAGE_SIZE,
+		  POSIX_FADV_WILLNEED);
+  }
+  number_of_read_aheads = 0;
 #endif
 }
 
@@ -710,6 +2176,13 @@ void io_read_root(void)
   file_t *f;
   int uninitialized_file_has_been_warned = 0;
 
+  if (find_root_by_index(&root_file, &root_page))
+    goto found_newest_root;
+  root_file = number_of_files;
+  if (be_verbose)
+    fprintf(stderr, "io_read_root: No root found through the root index, "
+	    "searching the files.\n");
+
 #ifdef FIXED_ROOT_DISK
   f = &file[FIXED_ROOT_DISK];
   {
@@ -737,8 +2210,8 @@ void io_read_root(void)
       perror("io_read_root/read");
       exit(1);
     }
-    if (root[0] != ROOT_MAGIC_COOKIE
-	&& root[0] != SWAP_BYTES(ROOT_MAGIC_COOKIE)) {
+    /* A torn root block is skipped like a data page. */
+    if (!root_is_intact()) {
       left_page++;
       if (left_page == f->number_of_pages
 	  || root[0] == UNUSED_PAGE_COOKIE
@@ -791,10 +2264,15 @@ void io_read_root(void)
     /* Check for the type of page that was read in and proceed
        accordingly. */
     if (root[0] == PAGE_MAGIC_COOKIE 
-	|| root[0] == SWAP_BYTES(PAGE_MAGIC_COOKIE)) {
-      /* Normal data page, but we're searching for a root page.  Scan
-	 in one direction, come back and change direction if left or
-	 right page is reached. */
+	|| root[0] == SWAP_BYTES(PAGE_MAGIC_COOKIE)
+	|| root[0] == COMPRESSED_PAGE_COOKIE
+	|| root[0] == SWAP_BYTES(COMPRESSED_PAGE_COOKIE)
+	|| ((root[0] == ROOT_MAGIC_COOKIE
+	     || root[0] == SWAP_BYTES(ROOT_MAGIC_COOKIE))
+	    && !root_is_intact())) {
+      /* Normal data page or a torn root, but we're searching for a
+	 root page.  Scan in one direction, come back and change
+	 direction if left or right page is reached. */
       if (direction == RIGHTWARD) {
 	mid_page++;
 	if (mid_page == right_page) {
@@ -905,8 +2383,13 @@ void io_read_root(void)
        after goto label happy. */
     ;
   }
+  if (root_file == number_of_files) {
+    fprintf(stderr, "io_read_root: No intact root block found.\n");
+    exit(1);
+  }
 
   /* Finally we should have the latest root file and page. */
+ found_newest_root:
   prev_root_file = root_file;
   prev_root_page = root_page;
   file[root_file].status[root_page] = ROOT;
@@ -931,12 +2414,14 @@ void io_read_root(void)
     exit(1);
   }
 
-  if (root[0] == SWAP_BYTES(ROOT_MAGIC_COOKIE))
-    for (i = 0; i * sizeof(word_t) < DISK_BLOCK_SIZE; i++)
-      root[i] = SWAP_BYTES(root[i]);
-
-  if (root[0] != ROOT_MAGIC_COOKIE) {
-    fprintf(stderr, "io_read_root: Incorrect magic cookie 0x%08lX\n", root[0]);
+  /* Only the fixed root location can get here with a bad root, and
+     it has no older root to fall back to. */
+  if (!root_is_intact()) {
+    if (root[0] != ROOT_MAGIC_COOKIE)
+      fprintf(stderr, "io_read_root: Incorrect magic cookie 0x%08lX\n",
+	      root[0]);
+    else
+      fprintf(stderr, "io_read_root: The root block is corrupt.\n");
     exit(1);
   }
 
@@ -963,8 +2448,18 @@ void io_free_disk_page(disk_page_number_t disk_page_number)
   unsigned long file_number = GET_FILE_NUMBER(disk_page_number);
   unsigned long page_number = GET_PAGE_NUMBER(disk_page_number);
 
+  if (file[file_number].status[page_number] == PINNED)
+    return;
+  if ((file[file_number].backup_map[page_number / WORD_BITS]
+       | file[file_number].copy_map[page_number / WORD_BITS])
+      & ((word_t) 1 << (page_number % WORD_BITS))) {
+    /* Free it when the backup and the copy have copied it. */
+    file[file_number].status[page_number] = PINNED;
+    return;
+  }
   if (file[file_number].status[page_number] != FREE) {
     file[file_number].status[page_number] = FREE;
+    mark_page_free(&file[file_number], page_number);
     file[file_number].number_of_free_pages++;
     number_of_free_disk_pages++;
   }
@@ -985,7 +2480,496 @@ void io_declare_unallocated_pages_free(void)
     for (j = 0; j < file[i].number_of_pages; j++)
       if (file[i].status[j] == UNKNOWN) {
 	file[i].status[j] = FREE;
+	mark_page_free(&file[i], j);
 	file[i].number_of_free_pages++;
 	number_of_free_disk_pages++;
       }
 }
+
+
+/* Online backups.
+
+   A backup is a stream of a header block, the root block, and the
+   disk pages allocated when the backup was started, each preceded by
+   its disk page number.  A disk page is not written again until it is
+   freed, so the pages can be copied a few at a time while the
+   database runs, as long as they are not reused before they are
+   copied.  Therefore `io_free_disk_page' only marks such a page
+   "pinned", and `io_backup_step' frees it once it is copied.  The
+   pages allocated after the root block are copied too, although
+   recovery does not need them.
+
+   An incremental backup leaves out the pages copied by the previous
+   backups and not freed since, which the database restored from those
+   backups already has.  The first backup after the database is
+   created or opened is always full.
+
+   The commits shipped to hot standbys are backups of the same format.
+   A standby is first sent a copy of the database in rounds, which are
+   pinned and copied a few pages at a time like the backups, a full
+   one followed by incremental ones until a round is small enough to
+   be copied at once.  Then it is sent an incremental backup for each
+   root block, of the pages allocated since the previous one. */
+
+/* The words of the header block. */
+#define BACKUP_COOKIE			0
+#define BACKUP_PAGE_SIZE		1
+#define BACKUP_NUMBER_OF_FILES		2
+#define BACKUP_IS_INCREMENTAL		3
+#define BACKUP_BASE_TIME_STAMP_HI	4
+#define BACKUP_BASE_TIME_STAMP_LO	5
+#define BACKUP_ROOT_FILE		6
+#define BACKUP_ROOT_PAGE		7
+#define BACKUP_NUMBER_OF_PAGES		8
+
+
+/* Read the newest root block, which must be on disk, to `header' and
+   the block after it, and fill in the rest of the header of a backup
+   of it.  The pages allocated so far must be on disk too. */
+static void read_backup_header(ptr_t header,
+			       int is_incremental,
+			       word_t base_time_stamp_hi,
+			       word_t base_time_stamp_lo,
+			       unsigned long number_of_pages)
+{
+  ptr_t block = header + WORDS_PER_DISK_BLOCK;
+  long root_file, root_page;
+
+  assert(!IS_QUEUEING_WRITES);
+#ifdef ASYNC_IO
+  asyncio_drain_pending_writes();
+#endif
+
+#ifdef OPTIMIZED_ROOT_LOCATION
+  root_file = prev_root_file;
+  root_page = prev_root_page;
+  assert(root_file != -1);
+#else
+  root_file = FIXED_ROOT_DISK;
+  root_page = file[FIXED_ROOT_DISK].number_of_pages;
+#endif
+  /* The writer threads of the asynchronous IO share the file
+     offset. */
+  if (pread(file[root_file].fd, (void *) block, DISK_BLOCK_SIZE,
+	    disk_skip_nbytes + root_page * PAGE_SIZE) != DISK_BLOCK_SIZE) {
+    perror("read_backup_header/pread");
+    exit(1);
+  }
+
+  memset(header, 0, DISK_BLOCK_SIZE);
+  header[BACKUP_COOKIE] = BACKUP_MAGIC_COOKIE;
+  header[BACKUP_PAGE_SIZE] = PAGE_SIZE;
+  header[BACKUP_NUMBER_OF_FILES] = number_of_files;
+  header[BACKUP_IS_INCREMENTAL] = is_incremental;
+  header[BACKUP_BASE_TIME_STAMP_HI] = base_time_stamp_hi;
+  header[BACKUP_BASE_TIME_STAMP_LO] = base_time_stamp_lo;
+  header[BACKUP_ROOT_FILE] = root_file;
+  header[BACKUP_ROOT_PAGE] = root_page;
+  header[BACKUP_NUMBER_OF_PAGES] = number_of_pages;
+}
+
+
+/* Read page `page_number' of file `f' to `buffer' for a backup. */
+static void read_backup_page(file_t *f,
+			     unsigned long page_number,
+			     ptr_t buffer)
+{
+  if (pread(f->fd, (void *) buffer, PAGE_SIZE,
+	    disk_skip_nbytes + page_number * PAGE_SIZE) != PAGE_SIZE) {
+    perror("read_backup_page/pread");
+    exit(1);
+  }
+}
+
+
+void io_start_backup(int fd, int is_incremental)
+{
+  word_t header[2 * WORDS_PER_DISK_BLOCK];
+  ptr_t block = header + WORDS_PER_DISK_BLOCK;
+  unsigned long i, j, k, n, number_of_pages = 0;
+  word_t bit;
+  file_t *f;
+
+  assert(backup_fd == -1);
+  /* The newest root block and the pages written before it must be on
+     disk. */
+  io_wait_for_commit();
+
+  /* Pin the allocated pages. */
+  if (!backup_was_taken)
+    is_incremental = 0;
+  for (i = 0; i < number_of_files; i++) {
+    f = &file[i];
+    n = (f->number_of_pages + WORD_BITS - 1) / WORD_BITS;
+    if (!is_incremental)
+      memset(f->backed_up_map, 0, n * sizeof(word_t));
+    memset(f->backup_map, 0, n * sizeof(word_t));
+    for (j = 0; j < f->number_of_pages; j++) {
+      k = j / WORD_BITS;
+      bit = (word_t) 1 << (j % WORD_BITS);
+      if (f->status[j] == ALLOCATED && !(f->backed_up_map[k] & bit)) {
+	f->backup_map[k] |= bit;
+	f->backed_up_map[k] |= bit;
+	number_of_pages++;
+      }
+    }
+  }
+
+  read_backup_header(header, is_incremental,
+		     backup_time_stamp_hi, backup_time_stamp_lo,
+		     number_of_pages);
+  if (write(fd, (void *) header, sizeof(header)) != sizeof(header)) {
+    perror("io_start_backup/write");
+    exit(1);
+  }
+
+  backup_fd = fd;
+  backup_file_cursor = 0;
+  backup_page_cursor = 0;
+  number_of_backup_pages_left = number_of_pages;
+  backup_was_taken = 1;
+  backup_time_stamp_hi = block[ROOT_IX_time_stamp_hi];
+  backup_time_stamp_lo = block[ROOT_IX_time_stamp_lo];
+}
+
+
+int io_backup_step(unsigned long number_of_pages)
+{
+  unsigned long k;
+  word_t w;
+  disk_page_number_t dpn;
+  struct iovec iov[2];
+  file_t *f;
+
+  if (backup_fd == -1)
+    return 1;
+  iov[0].iov_base = (void *) &dpn;
+  iov[0].iov_len = sizeof(dpn);
+  iov[1].iov_base = (void *) backup_buffer;
+  iov[1].iov_len = PAGE_SIZE;
+  for (; number_of_pages > 0 && number_of_backup_pages_left > 0;
+       number_of_pages--, number_of_backup_pages_left--) {
+    /* Find the next pinned page. */
+    f = &file[backup_file_cursor];
+    k = backup_page_cursor / WORD_BITS;
+    w = f->backup_map[k] & (~(word_t) 0 << (backup_page_cursor % WORD_BITS));
+    while (w == 0) {
+      if (++k >= (f->number_of_pages + WORD_BITS - 1) / WORD_BITS) {
+	assert(backup_file_cursor + 1 < number_of_files);
+	f = &file[++backup_file_cursor];
+	k = 0;
+      }
+      w = f->backup_map[k];
+    }
+    backup_page_cursor = k * WORD_BITS + LOWEST_BIT(w);
+    f->backup_map[k] &= ~((word_t) 1 << (backup_page_cursor % WORD_BITS));
+
+    read_backup_page(f, backup_page_cursor, backup_buffer);
+    dpn = MAKE_DISK_PAGE_NUMBER(backup_file_cursor, backup_page_cursor);
+    if (writev(backup_fd, iov, 2) != (signed long) (sizeof(dpn) + PAGE_SIZE)) {
+      perror("io_backup_step/writev");
+      exit(1);
+    }
+
+    if (f->status[backup_page_cursor] == PINNED) {
+      f->status[backup_page_cursor] = ALLOCATED;
+      io_free_disk_page(dpn);
+    }
+  }
+  if (number_of_backup_pages_left > 0)
+    return 0;
+  backup_fd = -1;
+  return 1;
+}
+
+
+unsigned long io_start_standby_copy(void (*write)(ptr_t ptr,
+						  unsigned long
+						  number_of_bytes),
+				    int is_incremental)
+{
+  word_t header[2 * WORDS_PER_DISK_BLOCK];
+  ptr_t block = header + WORDS_PER_DISK_BLOCK;
+  unsigned long i, j, k, n, number_of_pages = 0;
+  word_t bit;
+  file_t *f;
+
+  assert(!copy_is_running);
+  for (i = 0; i < number_of_files; i++) {
+    f = &file[i];
+    n = (f->number_of_pages + WORD_BITS - 1) / WORD_BITS;
+    if (!is_incremental)
+      memset(f->copied_map, 0, n * sizeof(word_t));
+    for (j = 0; j < f->number_of_pages; j++) {
+      k = j / WORD_BITS;
+      bit = (word_t) 1 << (j % WORD_BITS);
+      if (f->status[j] == ALLOCATED && !(f->copied_map[k] & bit)) {
+	f->copy_map[k] |= bit;
+	f->copied_map[k] |= bit;
+	number_of_pages++;
+      }
+    }
+  }
+
+  read_backup_header(header, is_incremental,
+		     copy_time_stamp_hi, copy_time_stamp_lo,
+		     number_of_pages);
+  write(header, sizeof(header));
+
+  copy_is_running = 1;
+  copy_file_cursor = 0;
+  copy_page_cursor = 0;
+  number_of_copy_pages_left = number_of_pages;
+  copy_time_stamp_hi = block[ROOT_IX_time_stamp_hi];
+  copy_time_stamp_lo = block[ROOT_IX_time_stamp_lo];
+  return number_of_pages;
+}
+
+
+int io_standby_copy_step(void (*write)(ptr_t ptr,
+				       unsigned long number_of_bytes),
+			 unsigned long number_of_pages)
+{
+  unsigned long k;
+  word_t w;
+  disk_page_number_t dpn;
+  file_t *f;
+
+  if (!copy_is_running)
+    return 1;
+  for (; number_of_pages > 0 && number_of_copy_pages_left > 0;
+       number_of_pages--, number_of_copy_pages_left--) {
+    /* Find the next pinned page as in `io_backup_step'. */
+    f = &file[copy_file_cursor];
+    k = copy_page_cursor / WORD_BITS;
+    w = f->copy_map[k] & (~(word_t) 0 << (copy_page_cursor % WORD_BITS));
+    while (w == 0) {
+      if (++k >= (f->number_of_pages + WORD_BITS - 1) / WORD_BITS) {
+	assert(copy_file_cursor + 1 < number_of_files);
+	f = &file[++copy_file_cursor];
+	k = 0;
+      }
+      w = f->copy_map[k];
+    }
+    copy_page_cursor = k * WORD_BITS + LOWEST_BIT(w);
+    f->copy_map[k] &= ~((word_t) 1 << (copy_page_cursor % WORD_BITS));
+
+    read_backup_page(f, copy_page_cursor, backup_buffer);
+    dpn = MAKE_DISK_PAGE_NUMBER(copy_file_cursor, copy_page_cursor);
+    write(&dpn, sizeof(dpn));
+    write(backup_buffer, PAGE_SIZE);
+
+    if (f->status[copy_page_cursor] == PINNED) {
+      f->status[copy_page_cursor] = ALLOCATED;
+      io_free_disk_page(dpn);
+    }
+  }
+  if (number_of_copy_pages_left > 0)
+    return 0;
+  copy_is_running = 0;
+  return 1;
+}
+
+
+void io_stop_standby_copy(void)
+{
+  unsigned long i, j;
+  file_t *f;
+
+  if (!copy_is_running)
+    return;
+  copy_is_running = 0;
+  for (i = 0; i < number_of_files; i++) {
+    f = &file[i];
+    memset(f->copy_map, 0,
+	   (f->number_of_pages + WORD_BITS - 1) / WORD_BITS * sizeof(word_t));
+    for (j = 0; j < f->number_of_pages; j++)
+      if (f->status[j] == PINNED) {
+	f->status[j] = ALLOCATED;
+	io_free_disk_page(MAKE_DISK_PAGE_NUMBER(i, j));
+      }
+  }
+}
+
+
+void io_ship_commit(void (*write)(ptr_t ptr, unsigned long number_of_bytes))
+{
+  word_t header[2 * WORDS_PER_DISK_BLOCK];
+  unsigned long i, j, n;
+  disk_page_number_t dpn;
+  word_t bit;
+  file_t *f;
+
+  /* Compact the list of the pages allocated since the previous call
+     to those still allocated and not shipped, each only once. */
+  if (unshipped_pages_are_listed) {
+    for (i = n = 0; i < number_of_unshipped_pages; i++) {
+      dpn = unshipped_page[i];
+      f = &file[GET_FILE_NUMBER(dpn)];
+      j = GET_PAGE_NUMBER(dpn);
+      bit = (word_t) 1 << (j % WORD_BITS);
+      if (f->status[j] == ALLOCATED
+	  && !(f->shipped_map[j / WORD_BITS] & bit)) {
+	f->shipped_map[j / WORD_BITS] |= bit;
+	unshipped_page[n++] = dpn;
+      }
+    }
+  } else {
+    for (i = n = 0; i < number_of_files; i++) {
+      f = &file[i];
+      for (j = 0; j < f->number_of_pages; j++) {
+	bit = (word_t) 1 << (j % WORD_BITS);
+	if (f->status[j] == ALLOCATED
+	    && !(f->shipped_map[j / WORD_BITS] & bit)) {
+	  f->shipped_map[j / WORD_BITS] |= bit;
+	  unshipped_page[n++] = MAKE_DISK_PAGE_NUMBER(i, j);
+	}
+      }
+    }
+  }
+
+  read_backup_header(header, 1, ship_time_stamp_hi, ship_time_stamp_lo, n);
+  ship_time_stamp_hi = header[WORDS_PER_DISK_BLOCK + ROOT_IX_time_stamp_hi];
+  ship_time_stamp_lo = header[WORDS_PER_DISK_BLOCK + ROOT_IX_time_stamp_lo];
+  if (write != NULL) {
+    write(header, sizeof(header));
+    for (i = 0; i < n; i++) {
+      dpn = unshipped_page[i];
+      read_backup_page(&file[GET_FILE_NUMBER(dpn)], GET_PAGE_NUMBER(dpn),
+		       backup_buffer);
+      write(&dpn, sizeof(dpn));
+      write(backup_buffer, PAGE_SIZE);
+    }
+  }
+  number_of_unshipped_pages = 0;
+  unshipped_pages_are_listed = 1;
+}
+
+
+/* Return non-zero if the disk page `ptr' read from a backup is
+   intact.  The page is uncompressed in `compress_buffer', which is
+   not otherwise used while restoring, and its checksum computed as
+   `page_checksum' in `shades.c' does: over the first two words and the
+   words in use after the three header words. */
+static int backup_page_is_intact(ptr_t ptr)
+{
+  ptr_t p = compress_buffer;
+  unsigned long i, n;
+
+  memcpy(p, ptr, PAGE_SIZE);
+  io_uncompress_page(p, uncompress_buffer);
+  if (p[0] == SWAP_BYTES(PAGE_MAGIC_COOKIE))
+    for (i = 0; i < PAGE_SIZE / sizeof(word_t); i++)
+      p[i] = SWAP_BYTES(p[i]);
+  n = p[1];
+  if (p[0] != PAGE_MAGIC_COOKIE || n < 3 || n > PAGE_SIZE / sizeof(word_t))
+    return 0;
+  return p[2] == crc32c(crc32c(0, p, 2), p + 3, n - 3);
+}
+
+
+int io_restore_backup(int (*read)(void *ptr, unsigned long number_of_bytes))
+{
+  word_t header[WORDS_PER_DISK_BLOCK], block[WORDS_PER_DISK_BLOCK];
+  word_t time_stamp_hi, time_stamp_lo;
+  struct iovec iov;
+  unsigned long i, file_number, page_number;
+  disk_page_number_t dpn;
+  int is_complete = 1;
+
+  if (!read(header, DISK_BLOCK_SIZE) || !read(block, DISK_BLOCK_SIZE))
+    return 0;
+  if (header[BACKUP_COOKIE] != BACKUP_MAGIC_COOKIE) {
+    fprintf(stderr, "io_restore_backup: Incorrect magic cookie 0x%08lX\n",
+	    (unsigned long) header[BACKUP_COOKIE]);
+    exit(1);
+  }
+  if (header[BACKUP_PAGE_SIZE] != PAGE_SIZE
+      || header[BACKUP_NUMBER_OF_FILES] != number_of_files) {
+    fprintf(stderr, "io_restore_backup: The backup is of other disk files.\n");
+    exit(1);
+  }
+
+  /* The files are opened here rather than with `io_create_file' or
+     `io_open_file', which would start the asynchronous IO before
+     `recover_db' does. */
+  for (i = 0; i < number_of_files; i++) {
+    file[i].fd = open(file[i].filename, O_CREAT | O_RDWR | O_SYNC_FLAG, 0666);
+    if (file[i].fd == -1) {
+      perror("io_restore_backup/open");
+      exit(1);
+    }
+    extend_file(&file[i]);
+#ifdef OPTIMIZED_ROOT_LOCATION
+    if (!header[BACKUP_IS_INCREMENTAL])
+      wipe_file(&file[i]);
+#endif
+  }
+  if (header[BACKUP_IS_INCREMENTAL]) {
+    /* The database must be the one restored from the previous
+       backup. */
+    io_read_root();
+    time_stamp_hi = GET_ROOT_WORD(time_stamp_hi);
+    time_stamp_lo = GET_ROOT_WORD(time_stamp_lo);
+    if (time_stamp_lo-- == 0)
+      time_stamp_hi--;
+    if (time_stamp_hi != header[BACKUP_BASE_TIME_STAMP_HI]
+	|| time_stamp_lo != header[BACKUP_BASE_TIME_STAMP_LO]) {
+      fprintf(stderr, "io_restore_backup: The database is not that "
+	      "of the previous backup.\n");
+      exit(1);
+    }
+  }
+
+  iov.iov_base = (void *) backup_buffer;
+  iov.iov_len = PAGE_SIZE;
+  for (i = 0; i < header[BACKUP_NUMBER_OF_PAGES]; i++) {
+    if (!read(&dpn, sizeof(dpn)) || !read(backup_buffer, PAGE_SIZE)) {
+      /* The pages written so far are not used by the root block
+	 restored last, so the files are left as restored by it. */
+      is_complete = 0;
+      break;
+    }
+    file_number = GET_FILE_NUMBER(dpn);
+    page_number = GET_PAGE_NUMBER(dpn);
+    if (file_number >= number_of_files
+	|| page_number >= file[file_number].number_of_pages) {
+      fprintf(stderr, "io_restore_backup: Bad disk page number 0x%08lX\n",
+	      (unsigned long) dpn);
+      exit(1);
+    }
+    if (!backup_page_is_intact(backup_buffer)) {
+      fprintf(stderr, "io_restore_backup: Disk page 0x%08lX of the "
+	      "backup is corrupt.\n", (unsigned long) dpn);
+      exit(1);
+    }
+    write_now(&file[file_number],
+	      disk_skip_nbytes + page_number * PAGE_SIZE, &iov, 1);
+  }
+
+  /* The root block goes last, when the pages it refers to are on
+     disk. */
+  if (is_complete) {
+#ifdef USE_FSYNC
+    for (i = 0; i < number_of_files; i++)
+      sync_file(&file[i]);
+#endif
+    memcpy(root, block, DISK_BLOCK_SIZE);
+    file_number = header[BACKUP_ROOT_FILE];
+    page_number = header[BACKUP_ROOT_PAGE];
+#ifdef OPTIMIZED_ROOT_LOCATION
+    write_root_index_slot(&file[file_number], page_number);
+#endif
+    write_block(&file[file_number],
+		disk_skip_nbytes + page_number * PAGE_SIZE, root);
+  }
+
+  for (i = 0; i < number_of_files; i++) {
+    if (close(file[i].fd)) {
+      perror("io_restore_backup/close");
+      exit(1);
+    }
+    file[i].fd = -1;
+  }
+  return is_complete;
+}
@@ -49,6 +49,16 @@ void io_close_file(void);
    will not be changed until the next `io_write_root' has returned.  */
 disk_page_number_t io_write_page(ptr_t ptr, unsigned long number_of_bytes);
 
+/* Write the `n' memory areas in `ptrs', of the sizes given in
+   `number_of_bytes', and store their disk page numbers in
+   `disk_pages'.  The pages are placed in runs of contiguous disk
+   pages, each written with a single system call.  Otherwise as
+   `io_write_page'. */
+void io_write_pages(ptr_t *ptrs,
+		    unsigned long *number_of_bytes,
+		    unsigned long n,
+		    disk_page_number_t *disk_pages);
+
 /* Normally `io_write_page' may assume the data behind the `ptr' given
    to it does not change.  Calling this function allows the callee to
    change any written page again.  `io_write_root' performs the same
@@ -56,6 +66,18 @@ disk_page_number_t io_write_page(ptr_t ptr, unsigned long number_of_bytes);
    block. */
 void io_allow_page_changes(void);
 
+/* If `pipelined_commit' is set, leave the writes of the commit group
+   that follows, up to and including the root block written by
+   `io_write_root', to a commit thread.  `io_write_root' then returns
+   before the commit group is on disk.  The written pages must not be
+   changed and the disk pages still used by the previous root block
+   must not be freed until `io_wait_for_commit' has returned. */
+void io_begin_commit(void);
+
+/* Wait until the commit group, if any, left to the commit thread is
+   on disk. */
+void io_wait_for_commit(void);
+
 /* Write atomically the root block starting from `root' and extending
    for `number_of_bytes' to the disk.  All pending page are written
    synchronously before `root' is written.  The root block is written
@@ -64,12 +86,36 @@ void io_allow_page_changes(void);
 void io_write_root(void);
 
 
+/* Compress the page `ptr' of `number_of_bytes' into `buffer' of
+   `PAGE_SIZE' bytes.  Returns the number of bytes to write from
+   `buffer' in place of the page, or zero if the page does not
+   compress and should be written as such.  Called by the threads
+   that write the pages if `compressed_pages' is set. */
+unsigned long io_compress_page(ptr_t ptr,
+			       unsigned long number_of_bytes,
+			       ptr_t buffer);
+
+/* If the page just read to `ptr' is compressed, uncompress it in
+   place with the help of `buffer' of `PAGE_SIZE' bytes.  A corrupt
+   compressed page is left with a bad magic cookie. */
+void io_uncompress_page(ptr_t ptr, ptr_t buffer);
+
+
 /* Read the given number of bytes to the given place from the given
    disk page. */
 void io_read_page(ptr_t ptr,
 		  unsigned long number_of_bytes,
 		  disk_page_number_t disk_page_number);
 
+/* Read a whole page like `io_read_page', but with `pread' and with
+   the caller's `buffer' of `PAGE_SIZE' bytes for uncompressing it, so
+   that a thread other than the one doing the rest of the IO may call
+   this.  Returns non-zero instead of exiting if the page can not be
+   read. */
+int io_pread_page(ptr_t ptr,
+		  ptr_t buffer,
+		  disk_page_number_t disk_page_number);
+
 /* Start reading a page from a disk asynchronously.  This is not guaranteed
    to finish before `io_read_page_wait' is called. */
 void io_read_page_start(ptr_t ptr,
@@ -79,6 +125,14 @@ void io_read_page_start(ptr_t ptr,
 /* Waits for all pending reads from all files to complete. */
 void io_read_page_wait(void);
 
+/* Tell that the given disk page will be read soon.  The disk pages
+   are gathered until `io_start_read_ahead'. */
+void io_read_page_ahead(disk_page_number_t disk_page_number);
+
+/* Let the system start reading the gathered disk pages in the
+   background, so that the reads that follow find them in memory. */
+void io_start_read_ahead(void);
+
 /* Read the root of the database. */
 void io_read_root(void);
 
@@ -110,6 +164,79 @@ void io_declare_unallocated_pages_free(void);
 unsigned long io_number_of_free_disk_pages(void);
 
 
+/* The delta log, see `commit_batch' in `shades.c'.  The log is a
+   sequential file of its own, written synchronously at the current
+   offset. */
+
+/* Open the delta log named by `delta_log_filename', emptying it if
+   `is_created'.  A missing log is created empty.  Returns zero if no
+   delta log is used. */
+int io_open_delta_log(int is_created);
+
+/* Move the offset of the delta log to `offset' bytes from its
+   beginning. */
+void io_seek_delta_log(unsigned long offset);
+
+/* Append the `n' memory areas in `ptrs', of the sizes given in
+   `number_of_bytes', to the delta log at the current offset with one
+   write.  Returns when they are on disk. */
+void io_write_delta_log(ptr_t *ptrs, unsigned long *number_of_bytes, int n);
+
+/* Read the given number of bytes from the current offset of the delta
+   log.  Returns the number of bytes read, which is less only at the
+   end of the log. */
+unsigned long io_read_delta_log(ptr_t ptr, unsigned long number_of_bytes);
+
+
+/* Online backups, see `start_backup' in `shades.h'. */
+
+/* Start writing a backup of the database as of the newest root block
+   to `fd'.  The root block must be on disk.  If `is_incremental',
+   only the disk pages not in the previous backups are included.  The
+   disk pages of the backup are not freed until they are copied. */
+void io_start_backup(int fd, int is_incremental);
+
+/* Copy at most `number_of_pages' more disk pages to the running
+   backup.  Returns non-zero when the backup is complete. */
+int io_backup_step(unsigned long number_of_pages);
+
+/* Write the disk pages and the root block of the backup read with
+   `read' to the database files, which must hold the database restored
+   from the previous backups if the backup is incremental.  `read'
+   reads the given number of bytes and returns zero if the backup ends
+   before them.  This is done before `io_open_file', and the files are
+   closed afterwards.  Returns zero if the backup ended before it was
+   complete, in which case the files hold the database as it was. */
+int io_restore_backup(int (*read)(void *ptr, unsigned long number_of_bytes));
+
+/* Start a round of copying the database as of the newest root block,
+   which must be on disk, to a hot standby with `write' as a backup,
+   see `replica.h'.  If `is_incremental', only the disk pages not in
+   the previous rounds are included.  The disk pages of the round are
+   not freed until they are copied.  Returns the number of disk pages
+   in the round. */
+unsigned long io_start_standby_copy(void (*write)(ptr_t ptr,
+						  unsigned long
+						  number_of_bytes),
+				    int is_incremental);
+
+/* Copy at most `number_of_pages' more disk pages of the running round
+   with `write'.  Returns non-zero when the round is complete. */
+int io_standby_copy_step(void (*write)(ptr_t ptr,
+				       unsigned long number_of_bytes),
+			 unsigned long number_of_pages);
+
+/* Give up the running round, as when its standby was lost. */
+void io_stop_standby_copy(void);
+
+/* Write the newest root block, which must be on disk, and the disk
+   pages allocated since the previous call to the hot standbys with
+   `write' as an incremental backup.  If `write' is NULL, the commit
+   is only marked shipped, as when a standby has just been copied the
+   database as of it. */
+void io_ship_commit(void (*write)(ptr_t ptr, unsigned long number_of_bytes));
+
+
 /* Should be called after reading parameters, but before
    `io_create_file' and `io_open_file'.  Returns non-zero on
    failure. */
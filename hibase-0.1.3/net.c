@@ -32,6 +32,10 @@
    }
  */
 
+/* `strdup', `struct hostent's `h_addr' and `fd_set' are not declared
+   in strict ISO C mode, e.g. with `--enable-warnings'. */
+#define _DEFAULT_SOURCE 1
+
 static char *rev_id = "$Id: net.c,v 1.51 1998/03/29 20:36:16 apl Exp $";
 static char *rev_host = SHADES_REV_HOST;
 static char *rev_date = SHADES_REV_DATE;
@@ -862,6 +866,13 @@ static void destroy_connection (net_handle_t handle)
    are documented in net.h. */
 void net_init (void)
 {
+  static int is_initialized = 0;
+
+  /* Both the replication and the byte code interpreter may need the
+     network. */
+  if (is_initialized)
+    return;
+  is_initialized = 1;
   buffer_init();
 
   connection = NULL;
@@ -1281,6 +1292,8 @@ net_return_t net_do_connect (word_t thread_id, net_handle_t handle)
   net_return_t ret;
   struct hostent *host;
   struct sockaddr_in addr;
+  socklen_t error_length;
+  int error;
 
   ret.handle = handle;
   ret.thread_id = thread_id;
@@ -1314,7 +1327,7 @@ net_return_t net_do_connect (word_t thread_id, net_handle_t handle)
     addr.sin_port = htons(c->destination_port);
     
     if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
-      if (errno != EAGAIN) {
+      if (errno != EAGAIN && errno != EINPROGRESS) {
 	/* System error (other than blocking) occured, mark the socket
 	   to be undetermined and make sure it's not polled. */
 	perror("net_do_connect()/connect()");
@@ -1326,6 +1339,7 @@ net_return_t net_do_connect (word_t thread_id, net_handle_t handle)
 	   to poll for succesful connection later in
 	   `net_number_of_wakeups()'. */
 	FD_SET(c->fd, &write_set);
+	c->status = CONN_CONNECTING;
 	connection[handle].thread_id = thread_id;
 	ret.handle = handle;
 	ret.thread_id = thread_id;
@@ -1345,10 +1359,17 @@ net_return_t net_do_connect (word_t thread_id, net_handle_t handle)
     ret.event = NET_CONNECT_EVENT;
   } else if (c->status == CONN_CONNECTING) {
     /* This socket already blocked and has been succesfully selected for
-       writing.  There is no way to check for the success of connecting,
-       so we just assume it is connected. */
+       writing.  The success of connecting is in its pending error. */
     FD_CLR(c->fd, &write_set);
     FD_CLR(c->fd, &read_set);
+    error_length = sizeof(error);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1)
+      error = errno;
+    if (error != 0) {
+      ret.error = error;
+      destroy_connection(handle);
+      return ret;
+    }
     c->status = CONN_CONNECTED;
 
     ret.handle = handle;
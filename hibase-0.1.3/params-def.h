@@ -17,41 +17,123 @@
    `PAGE_SIZE'. */
 PARAM(int, db_size, 20*1024*1024)
 
+/* Should the main memory image of the database be backed by huge
+   pages in order to reduce TLB misses?  Zero means no, one means
+   transparent huge pages, and two means pages from the huge page
+   pool reserved by the administrator, or transparent huge pages if
+   the pool is too small.  Meaningful only on systems with `mmap'. */
+PARAM(int, huge_pages, 0)
+
 /* Size of the first generation, in bytes.  Also serves as the upper
    limit of the commit group. */
 PARAM(int, first_generation_size, 1*1024*1024)
 
+/* Close the commit group, see `commit_is_due', when it has been open
+   for this many microseconds.  Zero disables the deadline.  With
+   `commit_latency_target_usecs' this is the upper bound of the tuned
+   deadline. */
+PARAM(int, commit_deadline_usecs, 0)
+
+/* Close the commit group when the estimated size of its survivors,
+   i.e. of what the commit writes to disk, exceeds this many bytes.
+   Zero disables the limit. */
+PARAM(int, commit_survivor_limit, 0)
+
+/* Tune the commit deadline so that the 99th percentile of the commit
+   latency, from the opening of a commit group to the end of its
+   `flush_batch', stays near this many microseconds.  Zero disables
+   the tuning. */
+PARAM(int, commit_latency_target_usecs, 0)
+
 /* Merge two mature generations if their size before collection is
    less than `first_generation_size * relative_mature_generation_size'. */
 PARAM(double, relative_mature_generation_size, 0.7)
 
 /* Maximum writing for mature garbage collection during each group
-   commit.  */
+   commit.  A mature garbage collection is started when it could no
+   longer keep ahead of the allocation at half of this.  */
 PARAM(int, max_gc_effort, 20*1024*1024)
 
-/* Amount of free memory when the maximum mature garbage collection
-   effort is reached. */
+/* Amount of free memory the mature garbage collection is paced to
+   keep in reserve.  Below it, the collection proceeds at the maximum
+   effort and not in the background. */
 PARAM(int, max_gc_limit, 1.5*1024*1024)
 
-/* Amount of free memory when mature garbage collection is initiated.
-   Idle-time mature garbage collection is done regardless of this
-   parameter.  */
+/* Amount of free memory when mature garbage collection is initiated
+   at the latest.  Idle-time mature garbage collection is done
+   regardless of this parameter.  */
 PARAM(int, start_gc_limit, (int) 2.5*1024*1024)
 
-/* Is additional generationality allowed?  
+/* Should the interpreter spend the time when it has no runnable
+   threads in mature garbage collection, see `idle_gc_step'? */
+PARAM(int, idle_gc, 1)
 
-   XXX Currently unrecoverable. */
+/* Is additional generationality allowed?  If so, a major collection
+   passes over the older mature generations that are expected to
+   yield little garbage, see `mark_major_gc_generations'. */
 PARAM(int, allow_additional_generationality, 0)
 
-/* Given a average generation shrinkage of `avg_generation_shrinkage',
-   then collect a mature generation if it's previous shrinkage was
-   less than `avg_generation_shrinkage + generation_shrinkage_margin'. */
+/* With `allow_additional_generationality', pass over a mature
+   generation if its expected shrinkage is less than
+   `1 + generation_shrinkage_margin'. */
 PARAM(double, generation_shrinkage_margin, 0.2)
 
+/* A mature generation is passed over in at most this many major
+   collections in a row. */
+PARAM(int, max_generation_skips, 4)
+
 /* How many remembered sets do we allocate with a single malloc
    call.  See remembered sets in `shades.c'. */
 PARAM(int, rem_sets_per_malloc, 24)
 
+/* The number of threads that copy the first generation in parallel
+   during group commit.  Zero means the number of online processors.
+   Meaningful only when PARALLEL_GC is enabled. */
+PARAM(int, gc_threads, 0)
+
+/* Should mature collection steps be done by a background thread
+   between group commits instead of within them?  Meaningful only when
+   BACKGROUND_GC is enabled. */
+PARAM(int, background_gc, 1)
+
+/* Should the disk writes of a commit group be left to a background
+   thread so that the next commit group may run meanwhile?  Then
+   `flush_batch' returns before the group is durable, and
+   `wait_for_commit' waits until it is.  A major gc step done by the
+   mutator waits for the writes, so the overlap is largest together
+   with `background_gc'.  Meaningful only when PIPELINED_COMMIT is
+   enabled. */
+PARAM(int, pipelined_commit, 1)
+
+/* Name of the delta log file.  If given, `commit_batch' appends the
+   changes of small commit batches to this file instead of collecting
+   the first generation, and recovery replays them.  A commit that
+   does a major gc step in the foreground does not start the log, so
+   the next commit also collects the first generation; steps left to
+   `background_gc' do not stop the log.  Empty disables the delta
+   log. */
+PARAM(char *, delta_log_filename, "")
+
+/* With the delta log, `commit_batch' does a normal `flush_batch', a
+   checkpoint, when this many bytes of the first generation are in
+   use. */
+PARAM(int, delta_log_checkpoint_size, 256*1024)
+
+/* Should recovery leave the pages of the oldest generations to be
+   read from disk only when they are first touched?  This shortens
+   the time until the first transaction after a crash.  Meaningful
+   only with `--enable-lazy-recovery' on systems with `mmap',
+   `mprotect' and `sigaction', and not with `huge_pages' two. */
+PARAM(int, lazy_recovery, 0)
+
+/* If nonzero, evict the pages of the least recently touched mature
+   generations from memory after a commit when more than this many
+   bytes of them are resident, and read them back from disk when they
+   are next touched.  `db_size' may then exceed the memory available.
+   Meaningful only with `--enable-lazy-recovery' on systems that also
+   have `madvise', and not with `huge_pages' two. */
+PARAM(int, max_resident_size, 0)
+
 
 /* Parameters for IO.
  */
@@ -81,6 +163,15 @@ PARAM(char *, disk_filesize, "300M")
    for raw devices. */
 PARAM(int, disk_skip_nbytes, 1*1024*1024)
 
+/* If this is set, compress the pages written to the disk, see
+   `io_compress_page'.  A run of pages is still written with one system
+   call that fills their whole disk pages, but recovery and lazy
+   loading read only the compressed blocks, and the pthread
+   asynchronous IO writes only those.  Compressed pages are read back
+   regardless of this.  Not supported with POSIX or io_uring
+   asynchronous IO. */
+PARAM(int, compressed_pages, 0)
+
 /* If this is set, displays root timestamps on reading and writing
    of root block. */
 PARAM(int, root_timestamp_is_displayed, 0)
@@ -109,6 +200,24 @@ PARAM(int, buffer_chunk_size, 1024)
 /* Listen port.  The port the shades server listens to. */
 PARAM(int, listen_port, 7777)
 
+/* If nonzero, the port on which the primary listens for hot standbys
+   and ships its commits to them, see `replica.h'. */
+PARAM(int, replication_port, 0)
+
+/* The most bytes of shipped commits that may wait to be written to a
+   standby.  A standby lagging more is sent a new copy of the database
+   once it has received them. */
+PARAM(int, max_standby_backlog, 16777216)
+
+/* How many disk pages of the copy of the database a standby that has
+   just connected is sent with each commit shipped. */
+PARAM(int, standby_copy_step, 64)
+
+/* If given as "host:port", `recover_db' first acts as a hot standby
+   of the primary replicating to that port, and recovers the database
+   when the primary is gone. */
+PARAM(char *, standby_of, "")
+
 
 /* Parameters that control the byte code interpreter.
  */
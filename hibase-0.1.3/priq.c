@@ -138,7 +138,7 @@ static inline ptr_t merge(ptr_t pq_1,
 	tmp[2] = son[2];
 	tmp[3] = pq_1[2];
 	new_height = HEIGHT(pq_1) + 1;
-	pq_1[0] &= 0xFF << 24;
+	pq_1[0] &= CELL_TYPE_MASK;
 	pq_1[0] |= new_height;
 	pq_1[2] = PTR_TO_WORD(tmp);
 	pq_1[3] = son[3];
@@ -226,7 +226,7 @@ static inline ptr_t merge(ptr_t pq_1,
 	tmp[2] = son[2];
 	tmp[3] = pq_1[2];
 	new_height = HEIGHT(pq_1) + 1;
-	pq_1[0] &= 0xFF << 24;
+	pq_1[0] &= CELL_TYPE_MASK;
 	pq_1[0] |= new_height;
 	pq_1[2] = PTR_TO_WORD(tmp);
 	pq_1[3] = son[3];
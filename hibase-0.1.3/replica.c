@@ -0,0 +1,395 @@
+/* This file is part of the Shades main memory database system.
+ *
+ * Copyright (c) 1996 Nokia Telecommunications
+ * All Rights Reserved.
+ *
+ * Authors: Kenneth Oksanen <cessu@iki.fi>
+ *          Antti-Pekka Liedes <apl@cs.hut.fi>
+ */
+
+/* Hot standby replicas, see `replica.h'.
+ */
+
+static char *rev_id = "$Id$";
+static char *rev_host = SHADES_REV_HOST;
+static char *rev_date = SHADES_REV_DATE;
+static char *rev_by = SHADES_REV_BY;
+static char *rev_cc = SHADES_REV_CC;
+
+
+#include "includes.h"
+#include "params.h"
+#include "io.h"
+#include "net.h"
+#include "replica.h"
+
+
+/* The primary.
+ */
+
+/* The socket listening for standbys, valid if `is_listening'. */
+static int is_listening = 0;
+static net_handle_t listen_handle;
+
+/* The states of a standby: it has received the previous commit
+   shipped, it waits to be copied the database, it is being copied
+   the database, or its connection failed. */
+#define STANDBY_IS_SHIPPED	0
+#define STANDBY_IS_WAITING	1
+#define STANDBY_IS_COPIED	2
+#define STANDBY_IS_LOST		3
+
+typedef struct {
+  net_handle_t handle;
+  int state;
+} standby_t;
+
+/* The connected standbys. */
+static standby_t *standby = NULL;
+static unsigned long number_of_standbys = 0;
+static unsigned long max_number_of_standbys = 0;
+
+/* The index of the standby being copied the database, or -1. */
+static long copied_standby = -1;
+
+
+/* Accept the standbys that have connected since the previous call. */
+static void accept_standbys(void)
+{
+  net_return_t net_return;
+
+  for (;;) {
+    net_return = net_accept(REPLICA_THREAD_ID, listen_handle);
+    if (net_return.error == NET_BLOCKED)
+      return;
+    if (net_return.error != 0) {
+      fprintf(stderr, "accept_standbys: net_accept failed.\n");
+      return;
+    }
+    if (number_of_standbys == max_number_of_standbys) {
+      max_number_of_standbys = 2 * max_number_of_standbys + 4;
+      standby = realloc(standby,
+			max_number_of_standbys * sizeof(standby_t));
+      if (standby == NULL) {
+	fprintf(stderr, "accept_standbys: `realloc' failed.\n");
+	exit(1);
+      }
+    }
+    /* The writes to the standbys never block, since a backup must not
+       be cut short.  Instead the data waiting to be written is
+       buffered in `net.c', and a standby with more than
+       `max_standby_backlog' bytes of it is sent nothing more until
+       it has received them. */
+    net_set_write_block_threshold(net_return.handle, ~0UL);
+    standby[number_of_standbys].handle = net_return.handle;
+    standby[number_of_standbys++].state = STANDBY_IS_WAITING;
+    if (be_verbose)
+      fprintf(stderr, "Standby %lu connected.\n",
+	      (unsigned long) net_return.handle);
+  }
+}
+
+
+/* Write the given data to standby `i', which is marked lost if its
+   connection fails.  Returns the number of bytes still waiting to be
+   written to it. */
+static unsigned long write_to_standby(unsigned long i,
+				      ptr_t ptr,
+				      unsigned long number_of_bytes)
+{
+  net_return_t net_return;
+
+  if (standby[i].state == STANDBY_IS_LOST)
+    return 0;
+  net_return = net_write_mem(REPLICA_THREAD_ID, standby[i].handle,
+			     ptr, number_of_bytes);
+  if (net_return.error != 0) {
+    if (be_verbose)
+      fprintf(stderr, "Standby %lu lost.\n",
+	      (unsigned long) standby[i].handle);
+    if (!NET_IS_FATAL_ERROR(net_return.error))
+      net_close(REPLICA_THREAD_ID, standby[i].handle);
+    standby[i].state = STANDBY_IS_LOST;
+    return 0;
+  }
+  return net_return.bytes_left;
+}
+
+/* Return non-zero if standby `i' was lost or lags more than
+   `max_standby_backlog' bytes behind.  Writing nothing to it writes
+   as much of its backlog as it can receive now. */
+static int standby_is_behind(unsigned long i)
+{
+  return write_to_standby(i, NULL, 0) > (unsigned long) max_standby_backlog
+    || standby[i].state == STANDBY_IS_LOST;
+}
+
+static void write_shipped(ptr_t ptr, unsigned long number_of_bytes)
+{
+  unsigned long i;
+
+  for (i = 0; i < number_of_standbys; i++)
+    if (standby[i].state == STANDBY_IS_SHIPPED)
+      write_to_standby(i, ptr, number_of_bytes);
+}
+
+static void write_copied(ptr_t ptr, unsigned long number_of_bytes)
+{
+  write_to_standby(copied_standby, ptr, number_of_bytes);
+}
+
+
+/* Copy `standby_copy_step' more disk pages of the database to the
+   standby being copied, or start copying it to a waiting standby.
+   Returns non-zero if the copy was complete, and the standby thereby
+   received the newest commit. */
+static int copy_to_standby(void)
+{
+  unsigned long i;
+  int is_incremental = 1;
+
+  if (copied_standby == -1) {
+    for (i = 0; i < number_of_standbys; i++)
+      if (standby[i].state == STANDBY_IS_WAITING && !standby_is_behind(i))
+	break;
+    if (i == number_of_standbys)
+      return 0;
+    if (be_verbose)
+      fprintf(stderr, "Copying the database to standby %lu.\n",
+	      (unsigned long) standby[i].handle);
+    copied_standby = i;
+    standby[i].state = STANDBY_IS_COPIED;
+    is_incremental = 0;
+  } else if (standby_is_behind(copied_standby)
+	     || !io_standby_copy_step(write_copied, standby_copy_step))
+    return 0;
+
+  /* Start the next round of the copy as of the newest root block.
+     The commits shipped meanwhile make each incremental round smaller
+     than the previous one, until one is copied at once. */
+  if (io_start_standby_copy(write_copied, is_incremental)
+      > (unsigned long) standby_copy_step)
+    return 0;
+  io_standby_copy_step(write_copied, standby_copy_step);
+  if (standby[copied_standby].state == STANDBY_IS_LOST)
+    return 0;
+  standby[copied_standby].state = STANDBY_IS_SHIPPED;
+  copied_standby = -1;
+  return 1;
+}
+
+
+/* Forget the lost standbys, and the copy to one of them. */
+static void remove_lost_standbys(void)
+{
+  unsigned long i, j;
+
+  if (copied_standby != -1
+      && standby[copied_standby].state == STANDBY_IS_LOST) {
+    io_stop_standby_copy();
+    copied_standby = -1;
+  }
+  for (i = j = 0; i < number_of_standbys; i++)
+    if (standby[i].state != STANDBY_IS_LOST) {
+      if (copied_standby == (long) i)
+	copied_standby = j;
+      standby[j++] = standby[i];
+    }
+  number_of_standbys = j;
+}
+
+
+void replica_ship_commit(void)
+{
+  net_return_t net_return;
+  unsigned long i, number_of_shipped_standbys = 0;
+
+  if (!is_listening) {
+    net_init();
+    net_return = net_listen(replication_port);
+    if (net_return.error != 0) {
+      fprintf(stderr, "replica_ship_commit: Can not listen to port %d.\n",
+	      replication_port);
+      exit(1);
+    }
+    listen_handle = net_return.handle;
+    is_listening = 1;
+  }
+  accept_standbys();
+
+  /* A standby that can not keep up with the commits is copied the
+     database again rather than buffering commits for it without
+     bound.  This is done between commits, since a standby must not
+     receive a part of one. */
+  for (i = 0; i < number_of_standbys; i++)
+    if (standby[i].state == STANDBY_IS_SHIPPED) {
+      if (!standby_is_behind(i))
+	number_of_shipped_standbys++;
+      else if (standby[i].state != STANDBY_IS_LOST) {
+	if (be_verbose)
+	  fprintf(stderr, "Standby %lu lags behind.\n",
+		  (unsigned long) standby[i].handle);
+	standby[i].state = STANDBY_IS_WAITING;
+      }
+    }
+  if (number_of_shipped_standbys > 0)
+    io_ship_commit(write_shipped);
+  if (copy_to_standby() && number_of_shipped_standbys == 0)
+    /* The next commit is shipped to the copied standby. */
+    io_ship_commit(NULL);
+  remove_lost_standbys();
+}
+
+
+void replica_close(void)
+{
+  unsigned long i;
+  int is_done, is_waiting;
+
+  if (!is_listening)
+    return;
+  accept_standbys();
+  for (;;) {
+    copy_to_standby();
+    remove_lost_standbys();
+    is_done = copied_standby == -1;
+    is_waiting = 0;
+    for (i = 0; i < number_of_standbys; i++) {
+      if (standby[i].state == STANDBY_IS_WAITING)
+	is_done = 0;
+      if (write_to_standby(i, NULL, 0) > 0) {
+	is_done = 0;
+	is_waiting = 1;
+      }
+    }
+    if (is_done)
+      break;
+    if (is_waiting)
+      for (i = net_number_of_wakeups(NULL); i > 0; i--)
+	net_get_wakeup();
+  }
+  for (i = 0; i < number_of_standbys; i++)
+    if (standby[i].state != STANDBY_IS_LOST)
+      net_close(REPLICA_THREAD_ID, standby[i].handle);
+  number_of_standbys = 0;
+  net_close(REPLICA_THREAD_ID, listen_handle);
+  is_listening = 0;
+}
+
+
+void replica_wakeup(net_return_t *net_return)
+{
+  switch (net_return->event) {
+  case NET_ACCEPT_EVENT:
+    /* The new standbys are copied the database with the next
+       commits shipped. */
+    accept_standbys();
+    break;
+  case NET_CLOSE_EVENT:
+    net_close(REPLICA_THREAD_ID, net_return->handle);
+    break;
+  default:
+    /* The writes were flushed, or they failed, which the next write
+       finds out. */
+    break;
+  }
+}
+
+
+/* The standby.
+ */
+
+/* The connection to the primary. */
+static net_handle_t primary;
+static int primary_is_connected = 0;
+
+
+/* Wait until the connection to the primary wakes up. */
+static void wait_for_primary(void)
+{
+  if (net_number_of_wakeups(NULL) > 0)
+    net_get_wakeup();
+}
+
+
+/* Connect to the primary at `host_name' and `port'.  Returns zero if
+   the primary did not accept the connection. */
+static int connect_to_primary(char *host_name, int port)
+{
+  net_return_t net_return;
+
+  net_return = net_prepare_connect(host_name, port);
+  if (net_return.error != 0)
+    return 0;
+  primary = net_return.handle;
+  for (;;) {
+    net_return = net_do_connect(REPLICA_THREAD_ID, primary);
+    if (net_return.error == 0)
+      break;
+    if (net_return.error != NET_BLOCKED)
+      return 0;
+    wait_for_primary();
+  }
+  primary_is_connected = 1;
+  return 1;
+}
+
+
+/* Read the next `number_of_bytes' shipped by the primary to `ptr'.
+   Returns zero if the primary is gone. */
+static int read_from_primary(void *ptr, unsigned long number_of_bytes)
+{
+  net_return_t net_return;
+
+  if (!primary_is_connected)
+    return 0;
+  for (;;) {
+    net_return =
+      net_read_mem(REPLICA_THREAD_ID, primary, ptr, number_of_bytes);
+    if (net_return.error == 0)
+      return 1;
+    if (net_return.error != NET_BLOCKED)
+      break;
+    wait_for_primary();
+  }
+  if (!NET_IS_FATAL_ERROR(net_return.error))
+    net_close(REPLICA_THREAD_ID, primary);
+  primary_is_connected = 0;
+  return 0;
+}
+
+
+void replica_standby(void)
+{
+  char host_name[256], *colon;
+  unsigned long number_of_commits = 0;
+  int port;
+
+  colon = strrchr(standby_of, ':');
+  if (colon == NULL
+      || colon - standby_of < 0
+      || (size_t) (colon - standby_of) >= sizeof(host_name)
+      || (port = atoi(colon + 1)) <= 0) {
+    fprintf(stderr, "replica_standby: `standby_of' is not \"host:port\".\n");
+    exit(1);
+  }
+  memcpy(host_name, standby_of, colon - standby_of);
+  host_name[colon - standby_of] = '\0';
+
+  net_init();
+  /* The primary listens only after its first commit. */
+  while (!connect_to_primary(host_name, port))
+    sleep(1);
+  if (be_verbose)
+    fprintf(stderr, "Standby of %s.\n", standby_of);
+
+  while (io_restore_backup(read_from_primary))
+    number_of_commits++;
+  if (number_of_commits == 0) {
+    fprintf(stderr,
+	    "replica_standby: The primary was gone before the first commit.\n");
+    exit(1);
+  }
+  if (be_verbose)
+    fprintf(stderr, "Taking over after %lu commits.\n", number_of_commits);
+}
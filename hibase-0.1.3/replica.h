@@ -0,0 +1,61 @@
+/* This file is part of the Shades main memory database system.
+ *
+ * Copyright (c) 1996 Nokia Telecommunications
+ * All Rights Reserved.
+ *
+ * Authors: Kenneth Oksanen <cessu@iki.fi>
+ *          Antti-Pekka Liedes <apl@cs.hut.fi>
+ */
+
+/* Hot standby replicas.  If `replication_port' is set, the primary
+   listens on it for standbys and ships each commit group to them once
+   its root block is on disk.  The commit groups are shipped as the
+   online backups of `io.c'.  A standby that has just connected is
+   first copied the database a few pages with each commit, after which
+   it is shipped an incremental backup for each root block.  A standby
+   that lags more than `max_standby_backlog' bytes behind is copied
+   the database again.
+
+   A standby is a process started with `standby_of' naming its
+   primary.  Its `recover_db' writes the shipped backups to its own
+   disk files as they arrive.  When the primary is gone, the standby
+   takes over by recovering the database from the newest root block
+   it received.  Replication is asynchronous: the commits the standby
+   had not yet fully received are lost in the takeover, and so are the
+   commits written only to the delta log since the previous
+   `flush_batch'.
+ */
+
+#ifndef INCL_REPLICA
+#define INCL_REPLICA 1
+
+#include "includes.h"
+#include "params.h"
+#include "net.h"
+
+
+/* The thread id given to `net.c' for the connections of the
+   replication.  The byte code interpreter passes their wakeups to
+   `replica_wakeup'. */
+#define REPLICA_THREAD_ID  (~(word_t) 0)
+
+/* Ship the newest root block, which must be on disk, and the disk
+   pages it uses to the standbys.  Called by `flush_batch' before
+   any disk pages are freed. */
+void replica_ship_commit(void);
+
+/* Finish copying the database to the standbys and writing the
+   commits shipped to them, and close their connections.  Called when
+   the primary stops. */
+void replica_close(void);
+
+/* Handle a wakeup of a connection of the replication. */
+void replica_wakeup(net_return_t *net_return);
+
+/* Receive commits from the primary named by `standby_of' into the
+   database files until the primary is gone.  Called by `recover_db'
+   before it opens the files. */
+void replica_standby(void);
+
+
+#endif /* INCL_REPLICA */
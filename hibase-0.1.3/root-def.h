@@ -18,10 +18,12 @@
    A magic cookie and a 64-bit time stamp.  The cookie distinguishes
    this the root page from other pages and is also used to fix byte a
    difference in byte orders.  The time stamps are needed in order to
-   find the newest possible root block in the database. */
+   find the newest possible root block in the database.  The checksum
+   is the CRC32C of the rest of the root block, see `io_write_root'. */
 ROOT_WORD(magic_cookie, ROOT_MAGIC_COOKIE)
 ROOT_WORD(time_stamp_hi, 0)
 ROOT_WORD(time_stamp_lo, 1)
+ROOT_WORD(checksum, 0)
 
 ROOT_PTR(interned_shtrings)
 
@@ -83,6 +85,31 @@ ROOT_PTR(test_cust_info)
 ROOT_PTR(test_hot_info)
 ROOT_PTR(test_store_info)
 
+/* The statistics that pace the mature garbage collection, in fixed
+   point, see `save_gc_statistics' in `shades.c'. */
+ROOT_WORD(avg_generation_shrinkage, 0)
+ROOT_WORD(avg_pages_per_commit, 0)
+
+/* The order in which the major collection copies cells, which
+   recovery redoes and therefore must use as well.  Bit 0 is set with
+   `REM_SET_BITMAP', bit 1 with `HIERARCHICAL_GC', see `recover_db' in
+   `shades.c'. */
+#ifndef GC_COPY_ORDER
+#ifdef REM_SET_BITMAP
+#define GC_COPY_ORDER_REM_SET_BITMAP  1
+#else
+#define GC_COPY_ORDER_REM_SET_BITMAP  0
+#endif
+#ifdef HIERARCHICAL_GC
+#define GC_COPY_ORDER_HIERARCHICAL  2
+#else
+#define GC_COPY_ORDER_HIERARCHICAL  0
+#endif
+#define GC_COPY_ORDER  \
+  (GC_COPY_ORDER_REM_SET_BITMAP | GC_COPY_ORDER_HIERARCHICAL)
+#endif
+ROOT_WORD(gc_copy_order, GC_COPY_ORDER)
+
 /* THESE MUST BE LAST!
 
    These are the equivalents of the `generation_map' of the latest
@@ -20,6 +20,10 @@
      8) initialization and recovery routines. */
 
 
+/* `mmap' with `MAP_ANONYMOUS', `madvise' and `sigaction' are not
+   declared in strict ISO C mode, e.g. with `--enable-warnings'. */
+#define _DEFAULT_SOURCE 1
+
 #include "includes.h"
 #include "cookies.h"
 #include "shades.h"
@@ -31,6 +35,33 @@
 /* Disabled until the KDQ becomes public.
    #include "kdqtrie.h" */
 #include "smartptr.h"
+#include "replica.h"
+#include <sys/time.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS  MAP_ANON
+#endif
+#ifndef MAP_ANONYMOUS
+/* Allocate the memory as if there were no `mmap'. */
+#undef HAVE_MMAP
+#endif
+#endif
+#if defined(LAZY_RECOVERY) \
+    && !(defined(HAVE_MMAP) && defined(HAVE_MPROTECT) \
+	 && defined(HAVE_SIGACTION))
+#undef LAZY_RECOVERY
+#endif
+#ifdef LAZY_RECOVERY
+#include <signal.h>
+#ifdef HAVE_MADVISE
+#define TIERED_STORAGE 1
+#endif
+#endif
+
+#if defined(PARALLEL_GC) || defined(BACKGROUND_GC) || defined(LAZY_RECOVERY)
+#include <pthread.h>
+#endif
 
 
 static char *rev_id = "$Id: shades.c,v 1.130 1998/03/30 18:43:49 cessu Exp $";
@@ -58,8 +89,18 @@ static unsigned long number_of_written_bytes = 0;
 unsigned long number_of_major_gc_written_pages = 0;
 unsigned long number_of_written_pages = 0;
 
+/* Commit statistics, see `commit_is_due'. */
+unsigned long number_of_commits = 0;
+unsigned long number_of_committed_words = 0;
+long commit_latency_p99_usecs = 0;
+long max_commit_latency_usecs = 0;
+
 #define NUMBER_OF_WORDS_PER_PAGE  (PAGE_SIZE / sizeof(word_t))
 
+/* The number of words in the header of a page before its first cell.
+   See the page management section for their contents. */
+#define PAGE_HEADER_WORDS  3
+
 
 
 /* The first generation and routines for managing it.
@@ -86,6 +127,7 @@ unsigned long number_of_written_pages = 0;
   (first_generation_size / sizeof(word_t))
 
 ptr_t first_generation_start;
+ptr_t first_generation_logged_ptr;
 #ifndef REG2
 ptr_t first_generation_allocation_ptr;
 #endif
@@ -144,7 +186,8 @@ ptr_t allocate(int number_of_words, cell_type_t type)
 #endif
 
   assert(number_of_words >= 2);
-  assert(number_of_words <= (signed) NUMBER_OF_WORDS_PER_PAGE - 2);
+  assert(number_of_words
+	 <= (signed) (NUMBER_OF_WORDS_PER_PAGE - PAGE_HEADER_WORDS));
 
 #ifdef ENABLE_BCPROF
   number_of_words_allocated += number_of_words;
@@ -154,7 +197,7 @@ ptr_t allocate(int number_of_words, cell_type_t type)
   for (i = 0; i < number_of_words; i++)
     assert(first_generation_allocation_ptr[i] == FIRST_GENERATION_DEADBEEF);
 #endif
-  *first_generation_allocation_ptr = type << (32 - CELL_TYPE_BITS);
+  *first_generation_allocation_ptr = CELL_HEADER(type);
 #ifdef ENABLE_RED_ZONES
   /* Make a red zone in the first generation immediately below the
      allocated cell. */
@@ -180,7 +223,8 @@ ptr_t raw_allocate(int number_of_words)
 #endif
 
   assert(number_of_words >= 2);
-  assert(number_of_words <= (signed) NUMBER_OF_WORDS_PER_PAGE - 2);
+  assert(number_of_words
+	 <= (signed) (NUMBER_OF_WORDS_PER_PAGE - PAGE_HEADER_WORDS));
 
 #ifdef ENABLE_BCPROF
   number_of_words_allocated += number_of_words;
@@ -242,6 +286,7 @@ static void clear_first_generation(void)
     *p = FIRST_GENERATION_DEADBEEF;
 #endif
   first_generation_allocation_ptr = first_generation_start;
+  first_generation_logged_ptr = first_generation_start;
 #ifndef NDEBUG
   first_generation_can_allocate_ptr = first_generation_start;
 #endif
@@ -349,10 +394,18 @@ void first_generation_fprint(FILE *fp, unsigned int heaviness)
    `PREPEND_TO_REM_SET'.
 
    The unused remembered set nodes are organized in a freelist, and
-   new nodes are allocated in larger chunks, not individually. */
-
+   new nodes are allocated in larger chunks, not individually.
 
-#define REM_SET_SIZE 40
+   If `REM_SET_BITMAP' is defined, the remembered sets are instead
+   card-marked: a single bitmap with one bit per database word tells
+   which words are referrers to some generation to be collected, and
+   each generation's `rem_set' is a bitmap of the pages that contain
+   referrers to it.  The memory consumption is thus bounded by the
+   database size, and scanning proceeds a word of bits at a time.  The
+   referrers are visited in address order, which is equally
+   reproducible during recovery as the list order.  Since the orders
+   differ, the root block tells which one wrote the database, see
+   `gc_copy_order' in `root-def.h'. */
 
 
 #ifdef GC_PROFILING
@@ -361,6 +414,72 @@ unsigned long max_rem_set_size = 0;
 #endif
 
 
+#ifdef REM_SET_BITMAP
+
+#define REM_SET_BITS_PER_WORD  (8 * sizeof(word_t))
+
+typedef word_t rem_set_t;
+
+/* The referrer bitmap of the whole database, the number of words in
+   a page bitmap, and a page bitmap for collecting the union of the
+   page bitmaps of the generations collected in a step. */
+static word_t *rem_set_bitmap = NULL;
+static unsigned long rem_set_page_bitmap_size = 0;
+static word_t *rem_set_page_union = NULL;
+
+static rem_set_t *allocate_rem_set(void)
+{
+  rem_set_t *p;
+
+  p = (rem_set_t *) calloc(rem_set_page_bitmap_size, sizeof(word_t));
+  if (p == NULL) {
+    fprintf(stderr, "allocate_rem_set: calloc failed.\n");
+    exit(1);
+  }
+  return p;
+}
+
+#ifdef GC_PROFILING
+#define REM_SET_BITMAP_PROFILE						\
+  do {									\
+    current_rem_set_size++;						\
+    if (current_rem_set_size >= max_rem_set_size)			\
+      max_rem_set_size = current_rem_set_size;				\
+  } while (0)
+#else
+#define REM_SET_BITMAP_PROFILE  /* Nothing. */
+#endif
+
+#define PREPEND_TO_REM_SET(rem_set, ref, rem_set_allocation_ptr)	\
+  do {									\
+    unsigned long _i = (ref) - NULL_PTR, _pn;				\
+    word_t _m = (word_t) 1 << (_i % REM_SET_BITS_PER_WORD);		\
+									\
+    if (!(rem_set_bitmap[_i / REM_SET_BITS_PER_WORD] & _m)) {		\
+      rem_set_bitmap[_i / REM_SET_BITS_PER_WORD] |= _m;			\
+      REM_SET_BITMAP_PROFILE;						\
+    }									\
+    if ((rem_set) == REM_SET_TAIL_COOKIE)				\
+      (rem_set) = allocate_rem_set();					\
+    _pn = _i / NUMBER_OF_WORDS_PER_PAGE;				\
+    (rem_set)[_pn / REM_SET_BITS_PER_WORD] |=				\
+      (word_t) 1 << (_pn % REM_SET_BITS_PER_WORD);			\
+  } while (0)
+
+/* The referrer bits are cleared when the referrers are copied, see
+   `scan_rem_sets'. */
+static void free_rem_set(rem_set_t *rem_set, ptr_t rem_set_allocation_ptr)
+{
+  if (rem_set == REM_SET_TAIL_COOKIE)
+    return;
+  free(rem_set);
+}
+
+#else /* not REM_SET_BITMAP */
+
+#define REM_SET_SIZE 40
+
+
 typedef struct rem_set_t {
   word_t referrer[REM_SET_SIZE];
   struct rem_set_t *next;
@@ -450,6 +569,8 @@ static void free_rem_set(rem_set_t *rem_set, ptr_t rem_set_allocation_ptr)
   rem_set_free_list = rem_set;
 }
 
+#endif /* not REM_SET_BITMAP */
+
 
 /* Page management.
 
@@ -457,9 +578,13 @@ static void free_rem_set(rem_set_t *rem_set, ptr_t rem_set_allocation_ptr)
      1. The actual memory image of the raw data of the page.  In
         various conversion macro names `PAGE_PTR' denotes the pointer
         to the beginning of the raw data of the page.  The first word
-        of the page contains a `PAGE_MAGIC_COOKIE' and the second word
-        denotes the number of words used in that page.  Main memory
-        pages are identified by the integer type `page_number_t'.
+        of the page contains a `PAGE_MAGIC_COOKIE', the second word
+        denotes the number of words used in that page, and the third
+        word the CRC32C checksum of the other words in use.  The
+        checksum is set just before the page is written to disk, and
+        checked by `check_page' when it is read back in recovery.
+        Main memory pages are identified by the integer type
+        `page_number_t'.
      2. The disk image of the page.  See the file `io.h' for the
         interfaces available to manipulating disk pages.  Disk pages
         are identified by `disk_page_number_t's.  Note that although
@@ -510,7 +635,16 @@ typedef struct generation_info_t generation_info_t;
 typedef struct page_info_t {
   /* Pointer to the generation which that this page is part of. */
   generation_info_t *generation;
-  int is_allocated;
+  char is_allocated;
+  /* Set when the major collection redirects a referrer on the page
+     and cleared when the page is written or read, so a page that is
+     not dirty is the same as its disk page. */
+  char is_dirty;
+#ifdef TIERED_STORAGE
+  /* Set when the page is protected by `sample_generation' while
+     still resident, see `evict_cold_generations'. */
+  char is_sampled;
+#endif
   /* Used as a link in the linked list of free pages, though not
      during recovery. */
   page_number_t next_free_page;
@@ -556,12 +690,341 @@ static page_info_t *page_info = NULL;
   ((unsigned long) (PAGE_NUMBER_TO_PAGE_PTR(pn)[1]))
 
 
-/* Free page management. */
+/* Compute the checksum of the words in use in the given page, skipping
+   the checksum word itself. */
+static word_t page_checksum(ptr_t p)
+{
+  unsigned long n = p[1];
+
+  if (n < PAGE_HEADER_WORDS || n > NUMBER_OF_WORDS_PER_PAGE)
+    /* Garbage in the word count.  The checksum will not match. */
+    n = PAGE_HEADER_WORDS;
+  return crc32c(crc32c(0, p, 2),
+		p + PAGE_HEADER_WORDS, n - PAGE_HEADER_WORDS);
+}
+
+#define page_is_intact(p)  ((p)[0] == PAGE_MAGIC_COOKIE		\
+			    && (p)[2] == page_checksum(p))
+
+#define PAGE_SET_CHECKSUM(pn)						\
+  do {									\
+    ptr_t _p = PAGE_NUMBER_TO_PAGE_PTR(pn);				\
+    _p[2] = page_checksum(_p);						\
+  } while (0)
+
+
+/* Check that the page just read from the given disk page is intact.
+   A torn or otherwise corrupted page is fatal: recovering from the
+   data in it would silently corrupt the database. */
+static void check_page(page_number_t pn, disk_page_number_t dpn)
+{
+  ptr_t p = PAGE_NUMBER_TO_PAGE_PTR(pn);
+
+  if (!page_is_intact(p)) {
+    fprintf(stderr,
+	    "check_page: Disk page 0x%08lX (page %ld) is corrupt.\n",
+	    (unsigned long) dpn, (long) pn);
+    exit(1);
+  }
+}
+
+
+#ifdef LAZY_RECOVERY
+
+/* Lazily read pages.
+
+   If `lazy_recovery' is set, `rvy_base_major_gc_round' does not read
+   the pages of the generations it recovers.  It only protects them
+   and records the disk page of each in `lazy_disk_page'.  The first
+   touch of such a page raises SIGSEGV, and the page is read then.
+   The oldest generations, which usually hold most of the database,
+   are thereby read only when the replayed collections or the first
+   transactions need them, and a page that a later recovery step
+   overwrites is never read at all.
+
+   Little of the IO code is async-signal-safe, so the signal handler
+   `lazy_page_fault' does not read the page itself.  It writes the
+   page number to `lazy_request_pipe' and waits for a byte from
+   `lazy_reply_pipe'.  The page reader thread reads the requested
+   page, lifts its protection and then writes the byte.  A thread that
+   gets the byte meant for another one just faults again.
+
+   The reader reads the page to a buffer of its own and copies it in
+   place only then, but a thread that touches the page during the
+   copy without first faulting on it could still see it half-copied.
+   Therefore the pages that the other threads use are read with
+   `load_lazy_page' before the threads are given them.  Likewise a
+   page must be read before it is passed to a system call, which would
+   fail with EFAULT instead of faulting.
+
+   If `max_resident_size' is set, `evict_cold_generations' likewise
+   leaves pages of the mature generations to be read back when next
+   touched, or protects them only to notice the next touch, see
+   below. */
+
+/* The disk page to read to the given page on first touch, or
+   `INVALID_DISK_PAGE_NUMBER' if the page is not lazy.  NULL unless
+   lazy recovery is in use. */
+static disk_page_number_t *lazy_disk_page = NULL;
+
+static unsigned long number_of_lazy_pages = 0;
+
+/* Serializes the changes to the above and to the protection of the
+   pages between the page reader thread and the others. */
+static pthread_mutex_t lazy_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int lazy_request_pipe[2], lazy_reply_pipe[2];
+static pthread_t lazy_page_reader_thread;
+
+/* The page reader thread's buffers for reading and uncompressing a
+   page. */
+static ptr_t lazy_page_buffer, lazy_uncompress_buffer;
+
+/* The action for SIGSEGV before `init_lazy_pages'. */
+static struct sigaction previous_segv_action;
+
+#ifdef TIERED_STORAGE
+static void touch_generation(page_number_t pn);
+#endif
+
+
+static void lock_lazy_pages(void)
+{
+  if (pthread_mutex_lock(&lazy_pages_lock)) {
+    perror("lock_lazy_pages/pthread_mutex_lock");
+    exit(1);
+  }
+}
+
+static void unlock_lazy_pages(void)
+{
+  if (pthread_mutex_unlock(&lazy_pages_lock)) {
+    perror("unlock_lazy_pages/pthread_mutex_unlock");
+    exit(1);
+  }
+}
+
+
+static void protect_page(page_number_t pn, int prot)
+{
+  if (mprotect((void *) PAGE_NUMBER_TO_PAGE_PTR(pn), PAGE_SIZE, prot)) {
+    perror("protect_page/mprotect");
+    exit(1);
+  }
+}
+
+
+/* Make the page read from the given disk page when first touched. */
+static void make_page_lazy(page_number_t pn, disk_page_number_t dpn)
+{
+  lock_lazy_pages();
+  assert(lazy_disk_page[pn] == INVALID_DISK_PAGE_NUMBER);
+  protect_page(pn, PROT_NONE);
+  lazy_disk_page[pn] = dpn;
+  page_info[pn].is_dirty = 0;
+#ifdef TIERED_STORAGE
+  page_info[pn].is_sampled = 0;
+#endif
+  number_of_lazy_pages++;
+  unlock_lazy_pages();
+}
+
+
+/* Make the page accessible again without reading it.  Used when the
+   contents of the page are about to be discarded. */
+static void forget_lazy_page(page_number_t pn)
+{
+  if (lazy_disk_page == NULL
+      || lazy_disk_page[pn] == INVALID_DISK_PAGE_NUMBER)
+    return;
+  lock_lazy_pages();
+  /* The page reader may have read it meanwhile. */
+  if (lazy_disk_page[pn] != INVALID_DISK_PAGE_NUMBER) {
+    protect_page(pn, PROT_READ | PROT_WRITE);
+    /* An evicted page has lost even its magic cookie. */
+    PAGE_NUMBER_TO_PAGE_PTR(pn)[0] = PAGE_MAGIC_COOKIE;
+    lazy_disk_page[pn] = INVALID_DISK_PAGE_NUMBER;
+    number_of_lazy_pages--;
+#ifdef TIERED_STORAGE
+    page_info[pn].is_sampled = 0;
+#endif
+  }
+  unlock_lazy_pages();
+}
+
+
+/* Read the page if it is lazy. */
+static void load_lazy_page(page_number_t pn)
+{
+  disk_page_number_t dpn;
+
+  if (lazy_disk_page == NULL
+      || lazy_disk_page[pn] == INVALID_DISK_PAGE_NUMBER)
+    return;
+  lock_lazy_pages();
+  dpn = lazy_disk_page[pn];
+  if (dpn != INVALID_DISK_PAGE_NUMBER) {
+#ifdef TIERED_STORAGE
+    if (page_info[pn].is_sampled) {
+      /* The contents are still there, only the touch was wanted. */
+      page_info[pn].is_sampled = 0;
+      protect_page(pn, PROT_READ | PROT_WRITE);
+    } else
+#endif
+    {
+      if (io_pread_page(lazy_page_buffer, lazy_uncompress_buffer, dpn)
+	  || !page_is_intact(lazy_page_buffer)) {
+	fprintf(stderr,
+		"load_lazy_page: Disk page 0x%08lX (page %ld) is corrupt.\n",
+		(unsigned long) dpn, (long) pn);
+	exit(1);
+      }
+      protect_page(pn, PROT_READ | PROT_WRITE);
+      memcpy(PAGE_NUMBER_TO_PAGE_PTR(pn), lazy_page_buffer, PAGE_SIZE);
+    }
+    lazy_disk_page[pn] = INVALID_DISK_PAGE_NUMBER;
+    number_of_lazy_pages--;
+#ifdef TIERED_STORAGE
+    touch_generation(pn);
+#endif
+  }
+  unlock_lazy_pages();
+}
+
+
+static void *lazy_page_reader(void *arg)
+{
+  page_number_t pn;
+  long n;
+  char c = 0;
+
+  while (1) {
+    n = read(lazy_request_pipe[0], &pn, sizeof(pn));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n != sizeof(pn)) {
+      perror("lazy_page_reader/read");
+      exit(1);
+    }
+    load_lazy_page(pn);
+    if (write(lazy_reply_pipe[1], &c, 1) != 1) {
+      perror("lazy_page_reader/write");
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+
+/* Only async-signal-safe calls here.  Since only lazy pages are
+   protected, a fault in the database memory is always on a lazy
+   page, or on one that the page reader is just reading. */
+static void lazy_page_fault(int sig, siginfo_t *info, void *context)
+{
+  ptr_as_scalar_t addr = (ptr_as_scalar_t) info->si_addr;
+  page_number_t pn;
+  int saved_errno = errno;
+  long n;
+  char c;
+
+  if (addr >= mem_base && addr < mem_base + number_of_pages * PAGE_SIZE) {
+    pn = PTR_TO_PAGE_NUMBER((ptr_t) addr);
+    if (write(lazy_request_pipe[1], &pn, sizeof(pn)) == sizeof(pn)) {
+      do
+	n = read(lazy_reply_pipe[0], &c, 1);
+      while (n == -1 && errno == EINTR);
+      errno = saved_errno;
+      if (n == 1)
+	/* Retry the faulting instruction. */
+	return;
+    }
+  }
+  /* A genuine segmentation fault.  Restore the previous action and
+     let the faulting instruction trap again. */
+  sigaction(SIGSEGV, &previous_segv_action, NULL);
+}
+
+
+/* Called in the beginning of recovery if `lazy_recovery' is set, and
+   when the database is created or recovered if `max_resident_size' is
+   set.  No page is left lazy if the pages can not be protected
+   individually. */
+static void init_lazy_pages(void)
+{
+  struct sigaction action;
+  page_number_t pn;
+
+  if (lazy_disk_page != NULL)
+    return;
+  if (PAGE_SIZE % sysconf(_SC_PAGESIZE) != 0 || huge_pages == 2) {
+    if (be_verbose)
+      fprintf(stderr,
+	      "init_lazy_pages: Pages can not be protected "
+	      "individually, reading all of them.\n");
+    return;
+  }
+  lazy_disk_page = malloc(number_of_pages * sizeof(disk_page_number_t));
+  lazy_page_buffer = malloc(PAGE_SIZE);
+  lazy_uncompress_buffer = malloc(PAGE_SIZE);
+  if (lazy_disk_page == NULL || lazy_page_buffer == NULL
+      || lazy_uncompress_buffer == NULL) {
+    fprintf(stderr, "Fatal: malloc failed for `lazy_disk_page'.\n");
+    exit(2);
+  }
+  for (pn = 0; pn < number_of_pages; pn++)
+    lazy_disk_page[pn] = INVALID_DISK_PAGE_NUMBER;
+  if (pipe(lazy_request_pipe) || pipe(lazy_reply_pipe)) {
+    perror("init_lazy_pages/pipe");
+    exit(1);
+  }
+  if (pthread_create(&lazy_page_reader_thread, NULL,
+		     lazy_page_reader, NULL) != 0) {
+    perror("init_lazy_pages/pthread_create");
+    exit(1);
+  }
+  action.sa_sigaction = lazy_page_fault;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO;
+  if (sigaction(SIGSEGV, &action, &previous_segv_action)) {
+    perror("init_lazy_pages/sigaction");
+    exit(1);
+  }
+}
+
+#endif /* LAZY_RECOVERY */
+
+
+/* Free page management.
+
+   The free pages are kept in a stack linked through their
+   `next_free_page'.  Only one thread pushes to it and pops from it,
+   except that the workers of a parallel collection pop batches of
+   pages from it concurrently, see `par_take_to_page'.
+
+   While a background step is being copied, that one thread is the
+   background thread, which takes its to-pages here and writes them
+   with `io_write_pages'.  The mutator reaches these only through
+   `flush_batch' and `new_pretenured_page', and both first wait for
+   the copy with `wait_for_background_gc_copy'.  `ASSERT_PAGE_OWNER'
+   checks this. */
 
 static page_number_t list_of_free_pages = INVALID_PAGE_NUMBER;
 
 static unsigned long number_of_free_pages = 0;
 
+#ifdef BACKGROUND_GC
+static pthread_t background_gc_thread;
+/* Set when a step is started, cleared by the background thread when
+   it has copied the step. */
+static int background_gc_is_copying = 0;
+
+#define ASSERT_PAGE_OWNER						\
+  assert(!background_gc_is_copying					\
+	 || pthread_equal(pthread_self(), background_gc_thread))
+#else
+#define ASSERT_PAGE_OWNER
+#endif
+
 
 /* Free the given page.  If the system is no longer recovering, then
    prepend the page to the global list of free pages. */
@@ -569,7 +1032,13 @@ static void free_page(page_number_t pn)
 {
 #ifndef NDEBUG
   unsigned long i;
+#endif
 
+  ASSERT_PAGE_OWNER;
+#ifdef LAZY_RECOVERY
+  forget_lazy_page(pn);
+#endif
+#ifndef NDEBUG
   assert(PAGE_NUMBER_TO_PAGE_PTR(pn)[0] == PAGE_MAGIC_COOKIE);
   assert(page_info[pn].is_allocated);
   for (i = 1; i < NUMBER_OF_WORDS_PER_PAGE; i++)
@@ -577,6 +1046,9 @@ static void free_page(page_number_t pn)
 #endif
   page_info[pn].is_allocated = 0;
   page_info[pn].generation = NULL;
+#ifdef TIERED_STORAGE
+  page_info[pn].is_sampled = 0;
+#endif
   if (!is_recovering) {
     page_info[pn].next_free_page = list_of_free_pages;
     list_of_free_pages = pn;
@@ -585,13 +1057,32 @@ static void free_page(page_number_t pn)
 }
 
 
-static page_number_t allocate_page(void)
+/* Prepare the page `pn' just taken from the list of free pages for
+   use. */
+static void take_page(page_number_t pn)
 {
-  page_number_t pn;
 #ifndef NDEBUG
   unsigned long i;
+
+  assert(!page_info[pn].is_allocated);
+  assert(PAGE_NUMBER_TO_PAGE_PTR(pn)[0] == PAGE_MAGIC_COOKIE);
+  for (i = 1; i < NUMBER_OF_WORDS_PER_PAGE; i++)
+    assert(PAGE_NUMBER_TO_PAGE_PTR(pn)[i] == PAGE_DEADBEEF);
+  assert(!is_recovering);	/* Use `rvy_allocate_page' during recovery. */
 #endif
+  /* The cookie is written here rather than in `init_shades' so that
+     the memory of a page is not touched before it is needed. */
+  PAGE_NUMBER_TO_PAGE_PTR(pn)[0] = PAGE_MAGIC_COOKIE;
+  page_info[pn].is_allocated = 1;
+  page_info[pn].is_dirty = 0;
+}
+
+
+static page_number_t allocate_page(void)
+{
+  page_number_t pn;
 
+  ASSERT_PAGE_OWNER;
   if (list_of_free_pages == INVALID_PAGE_NUMBER) {
     /* The list of free pages is exhausted. */
     fprintf(stderr, "allocate_page: Out of main memory\n");
@@ -599,14 +1090,7 @@ static page_number_t allocate_page(void)
   }
   pn = list_of_free_pages;
   list_of_free_pages = page_info[list_of_free_pages].next_free_page;
-#ifndef NDEBUG
-  assert(!page_info[pn].is_allocated);
-  assert(PAGE_NUMBER_TO_PAGE_PTR(pn)[0] == PAGE_MAGIC_COOKIE);
-  for (i = 1; i < NUMBER_OF_WORDS_PER_PAGE; i++)
-    assert(PAGE_NUMBER_TO_PAGE_PTR(pn)[i] == PAGE_DEADBEEF);
-  assert(!is_recovering);	/* Use `rvy_allocate_page' during recovery. */
-#endif
-  page_info[pn].is_allocated = 1;
+  take_page(pn);
   number_of_free_pages--;
   return pn;
 }
@@ -692,10 +1176,24 @@ struct generation_info_t {
      COLLECTED_TWICE. */
   generation_number_t next_collected_twice;
 
-  /* Statistics for heuristics that control additional generationality.
-
-     XXX Tentative, can't recover these. */
+  /* Statistics for heuristics that control additional generationality:
+     the shrinkage of the generations copied to this one, or zero if
+     unknown, and the number of major collections that have since
+     passed over it.  See `mark_major_gc_generations'. */
   double shrinkage;
+  int number_of_skips;
+  /* The number of pages that had to be written when the generation
+     was last passed over, or -1 if it was not. */
+  int number_of_rewritten_pages;
+#ifdef TIERED_STORAGE
+  /* The `number_of_commits' when the generation was created or one of
+     its evicted or sampled pages was last touched, when
+     `evict_cold_generations' last chose it, and when
+     `sample_generation' last protected its pages. */
+  unsigned long last_touch;
+  unsigned long last_eviction;
+  unsigned long last_sampling;
+#endif
 };
 
 /* An array indexed by the generation number.  Allocated and extended
@@ -720,11 +1218,32 @@ static generation_number_t
 static unsigned long number_of_generations = 0;
 static unsigned long number_of_nonexistent_generations = 0;
 
-/* How much do mature generations on average shrink when collected? 
-
-   XXX Not recovered. Is this the right place for defining this? */
+/* How much do mature generations on average shrink when collected?
+   Kept in the root block by `save_gc_statistics', so that recovery
+   finds it as it was. */
 static double avg_generation_shrinkage = 0;
 
+/* How many pages the new generation of a commit group takes on
+   average, and how many it took in the previous one.  These pace the
+   major collection, see `major_gc'.  The average is recovered
+   likewise. */
+static double avg_pages_per_commit = 0;
+static unsigned long pages_in_previous_commit = 0;
+
+/* How much the generations of the latest steps of the current major
+   collection shrank.  The generations are collected from the youngest
+   to the oldest, and the older ones usually shrink less, so this
+   predicts the rest of the collection better than the average. */
+static double recent_generation_shrinkage = 0;
+
+/* How many pages the commit groups have taken since the latest major
+   collection was started, see `idle_major_gc_is_due'.  Not
+   recovered; it only advances idle-time collection. */
+static unsigned long number_of_pages_since_major_gc = 0;
+
+/* Fixed point scale of the above averages in the root block. */
+#define GC_STATISTICS_SCALE  65536.0
+
 
 /* Allocate or extend `generation_info' to contain at least
    `new_number_of_generations' generations. */
@@ -808,7 +1327,14 @@ static void allocate_generation(void)
   generation_info[to_gn].next_collected_twice = INVALID_GENERATION_NUMBER;
   generation_info[to_gn].younger = INVALID_GENERATION_NUMBER;
   generation_info[to_gn].older = INVALID_GENERATION_NUMBER;
-  generation_info[to_gn].shrinkage = 1;
+  generation_info[to_gn].shrinkage = 0;
+  generation_info[to_gn].number_of_skips = 0;
+  generation_info[to_gn].number_of_rewritten_pages = -1;
+#ifdef TIERED_STORAGE
+  generation_info[to_gn].last_touch = number_of_commits;
+  generation_info[to_gn].last_eviction = number_of_commits - 1;
+  generation_info[to_gn].last_sampling = number_of_commits - 1;
+#endif
 }
 
 
@@ -850,7 +1376,14 @@ static void rvy_allocate_generation(int npages)
   generation_info[to_gn].next_collected_twice = INVALID_GENERATION_NUMBER;
   generation_info[to_gn].younger = INVALID_GENERATION_NUMBER;
   generation_info[to_gn].older = INVALID_GENERATION_NUMBER;
-  generation_info[to_gn].shrinkage = 1;
+  generation_info[to_gn].shrinkage = 0;
+  generation_info[to_gn].number_of_skips = 0;
+  generation_info[to_gn].number_of_rewritten_pages = -1;
+#ifdef TIERED_STORAGE
+  generation_info[to_gn].last_touch = number_of_commits;
+  generation_info[to_gn].last_eviction = number_of_commits - 1;
+  generation_info[to_gn].last_sampling = number_of_commits - 1;
+#endif
 }
 
 
@@ -858,20 +1391,26 @@ static void rvy_allocate_generation(int npages)
    generation number, its `disk_pages' array, and particularly the
    disk pages that have until now been reserved in order to insure
    recoverability. */
-static void mark_twice_collected_generations_nonexistent(void)
+static void mark_generations_nonexistent(generation_number_t gn)
 {
   int i;
-  generation_number_t gn = generations_collected_twice;
 
   while (gn != INVALID_GENERATION_NUMBER) {
     generation_info[gn].status = NONEXISTENT;
     number_of_nonexistent_generations++;
     for (i = 0; i < generation_info[gn].npages; i++)
-      io_free_disk_page(generation_info[gn].disk_page[i]);
+      /* Unless a generation that passed over `gn' took it over. */
+      if (generation_info[gn].disk_page[i] != INVALID_DISK_PAGE_NUMBER)
+	io_free_disk_page(generation_info[gn].disk_page[i]);
     if (generation_info[gn].npages != 0)
       free(generation_info[gn].disk_page);
     gn = generation_info[gn].next_collected_twice;
   }
+}
+
+static void mark_twice_collected_generations_nonexistent(void)
+{
+  mark_generations_nonexistent(generations_collected_twice);
   generations_collected_twice = INVALID_GENERATION_NUMBER;
 }
 
@@ -884,17 +1423,9 @@ static void mark_generation_collected_twice(generation_number_t gn)
 }
 
 
-static void mark_generation_collected_once(generation_number_t gn)
+/* Unlink `gn' from the doubly linked list of generations. */
+static void unlink_generation(generation_number_t gn)
 {
-  int i;
-
-  generation_info[gn].status = COLLECTED_ONCE;
-  /* Free all memory pages in `gn'. */
-  for (i = 0; i < generation_info[gn].npages; i++)
-    free_page(generation_info[gn].page[i]);
-  if (generation_info[gn].npages != 0)
-    free(generation_info[gn].page);
-  /* Unlink `gn' from the doubly linked list of generations. */
   if (generation_info[gn].older != INVALID_GENERATION_NUMBER)
     generation_info[generation_info[gn].older].younger =
       generation_info[gn].younger;
@@ -905,6 +1436,20 @@ static void mark_generation_collected_once(generation_number_t gn)
     assert(gn == youngest_gn);
     youngest_gn = generation_info[gn].older;
   }
+}
+
+
+static void mark_generation_collected_once(generation_number_t gn)
+{
+  int i;
+
+  generation_info[gn].status = COLLECTED_ONCE;
+  /* Free all memory pages in `gn'. */
+  for (i = 0; i < generation_info[gn].npages; i++)
+    free_page(generation_info[gn].page[i]);
+  if (generation_info[gn].npages != 0)
+    free(generation_info[gn].page);
+  unlink_generation(gn);
   /* Mark all from-generations collected twice. */
   for (gn = generation_info[gn].from;
        gn != INVALID_GENERATION_NUMBER;
@@ -1020,69 +1565,135 @@ static void start_gc(void)
 }
 
 
-static void new_to_page(void)
+/* Append the page `pn' to the pages of `to_gn'. */
+static void append_to_page(page_number_t pn)
 {
   int npages;
 
-  /* Wrap up possible previous copy page. */
-  if (to_pn != INVALID_PAGE_NUMBER)
-    PAGE_SET_NUMBER_OF_WORDS_IN_USE(to_pn,
-				    to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn));
-  /* Allocate a new page and insert it into the `to_gn'. */
-  to_pn = allocate_page();
   npages = ++generation_info[to_gn].npages;
   generation_info[to_gn].page =
     realloc(generation_info[to_gn].page, npages * sizeof(page_number_t));
   if (generation_info[to_gn].page == NULL) {
-    fprintf(stderr, "new_to_page: `realloc' failed for %dth page.\n", npages);
+    fprintf(stderr, "append_to_page: `realloc' failed for %dth page.\n",
+	    npages);
     exit(1);
   }
-  generation_info[to_gn].page[npages - 1] = to_pn;
+  generation_info[to_gn].page[npages - 1] = pn;
   generation_info[to_gn].disk_page =
     realloc(generation_info[to_gn].disk_page,
 	    npages * sizeof(disk_page_number_t));
   if (generation_info[to_gn].disk_page == NULL) {
-    fprintf(stderr, "new_to_page: `realloc' failed for %dth disk page.\n",
+    fprintf(stderr, "append_to_page: `realloc' failed for %dth disk page.\n",
 	    npages);
     exit(1);
   }
-  page_info[to_pn].generation = &generation_info[to_gn];
-  /* As described in the page management section, the first word is
-     reserved for the PAGE_MAGIC_COOKIE and to dedicate `NULL_PTR' as
-     an invalid data.  The second word to store the number of words in
-     use. */
-  to_ptr = PAGE_NUMBER_TO_PAGE_PTR(to_pn) + 2;
-  to_end = PAGE_NUMBER_TO_PAGE_PTR(to_pn) + NUMBER_OF_WORDS_PER_PAGE;
+  page_info[pn].generation = &generation_info[to_gn];
 }
 
 
-static void finish_gc(void)
+/* Allocate a new page and append it to the pages of `to_gn'. */
+static page_number_t allocate_to_page(void)
 {
-  int i;
   page_number_t pn;
 
-  if (to_pn == INVALID_PAGE_NUMBER)
-    /* No gc actually commenced, nothing to finish. */
-    return;
-  /* Wrap up the previous to-page. */
-  PAGE_SET_NUMBER_OF_WORDS_IN_USE(to_pn,
-				  to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn));
-  /* Write the memory pages to disk. */
-  for (i = 0; i < generation_info[to_gn].npages; i++) {
-    pn = generation_info[to_gn].page[i];
-    generation_info[to_gn].disk_page[i] =
-      io_write_page(PAGE_NUMBER_TO_PAGE_PTR(pn),
-		    PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn) * sizeof(word_t));
-    /* Statistics. */
-    number_of_written_pages++;
-    number_of_major_gc_written_pages++;
-#ifdef GC_PROFILING
-    number_of_written_bytes +=
-      PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn) * sizeof(word_t);
+  pn = allocate_page();
+  append_to_page(pn);
+  return pn;
+}
+
+
+static void new_to_page(void)
+{
+  /* Wrap up possible previous copy page. */
+  if (to_pn != INVALID_PAGE_NUMBER)
+    PAGE_SET_NUMBER_OF_WORDS_IN_USE(to_pn,
+				    to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn));
+  to_pn = allocate_to_page();
+  /* As described in the page management section, the first word is
+     reserved for the PAGE_MAGIC_COOKIE and to dedicate `NULL_PTR' as
+     an invalid data.  The second word to store the number of words in
+     use, and the third for the checksum. */
+  to_ptr = PAGE_NUMBER_TO_PAGE_PTR(to_pn) + PAGE_HEADER_WORDS;
+  to_end = PAGE_NUMBER_TO_PAGE_PTR(to_pn) + NUMBER_OF_WORDS_PER_PAGE;
+}
+
+
+/* Buffers for passing the pages of a generation to `io_write_pages'.
+   Grown by `write_pages_of_to_gn' as needed. */
+static ptr_t *write_ptrs = NULL;
+static unsigned long *write_nbytes = NULL;
+static disk_page_number_t *write_disk_pages = NULL;
+static int *write_page_index = NULL;
+static int write_buffer_size = 0;
+
+/* Write the memory pages of `to_gn' to disk, or if `only_dirty', only
+   those that are dirty.  The others keep their disk pages. */
+static void write_pages_of_to_gn(int only_dirty)
+{
+  int i, n, npages = generation_info[to_gn].npages;
+  page_number_t pn;
+
+  ASSERT_PAGE_OWNER;
+  if (npages > write_buffer_size) {
+    write_buffer_size = 2 * npages;
+    write_ptrs = realloc(write_ptrs, write_buffer_size * sizeof(ptr_t));
+    write_nbytes =
+      realloc(write_nbytes, write_buffer_size * sizeof(unsigned long));
+    write_disk_pages =
+      realloc(write_disk_pages,
+	      write_buffer_size * sizeof(disk_page_number_t));
+    write_page_index =
+      realloc(write_page_index, write_buffer_size * sizeof(int));
+    if (write_ptrs == NULL || write_nbytes == NULL
+	|| write_disk_pages == NULL || write_page_index == NULL) {
+      fprintf(stderr, "write_pages_of_to_gn: `realloc' failed.\n");
+      exit(1);
+    }
+  }
+  for (i = n = 0; i < npages; i++) {
+    pn = generation_info[to_gn].page[i];
+    if (only_dirty && !page_info[pn].is_dirty)
+      continue;
+    write_ptrs[n] = PAGE_NUMBER_TO_PAGE_PTR(pn);
+    write_nbytes[n] = PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn) * sizeof(word_t);
+    write_page_index[n++] = i;
+    PAGE_SET_CHECKSUM(pn);
+  }
+  if (n == 0)
+    return;
+  io_write_pages(write_ptrs, write_nbytes, n, write_disk_pages);
+
+  for (i = 0; i < n; i++) {
+    generation_info[to_gn].disk_page[write_page_index[i]] =
+      write_disk_pages[i];
+    pn = generation_info[to_gn].page[write_page_index[i]];
+    page_info[pn].is_dirty = 0;
+    /* Statistics. */
+    number_of_written_pages++;
+    number_of_major_gc_written_pages++;
+#ifdef GC_PROFILING
+    number_of_written_bytes +=
+      PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn) * sizeof(word_t);
 #endif
   }
 }
 
+/* Write the memory pages of `to_gn' to disk. */
+#define write_to_generation()  write_pages_of_to_gn(0)
+
+
+static void finish_gc(void)
+{
+  /* Wrap up the previous to-page. */
+  if (to_pn != INVALID_PAGE_NUMBER)
+    PAGE_SET_NUMBER_OF_WORDS_IN_USE(to_pn,
+				    to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn));
+  /* Unless no gc actually commenced.  The pages of `to_gn' may also
+     be pretenured ones only, see `allocate_mature'. */
+  if (generation_info[to_gn].npages != 0)
+    write_to_generation();
+}
+
 
 /* The recursion in `copy_cell' and `drain_copy_stack' has been
    replaced by iteration and an auxiliary stack which is defined
@@ -1102,6 +1713,100 @@ static ptr_t *copy_stack_ptr;
 #define PUSH_TO_COPY_STACK(pp)  (*copy_stack_ptr++ = (pp))
 #define POP_FROM_COPY_STACK  (*--copy_stack_ptr)
 
+/* Popping a slot and immediately dereferencing it is nearly always a
+   cache miss in a large database.  Therefore the cell referred to by
+   the slot `COPY_PREFETCH_DISTANCE' entries below the top of the copy
+   stack is prefetched at each pop.  It will be popped no sooner than
+   that many pops later. */
+#define COPY_PREFETCH_DISTANCE  8
+
+#define PREFETCH_FROM_COPY_STACK					\
+  do {									\
+    if (COPY_STACK_DEPTH > COPY_PREFETCH_DISTANCE)			\
+      PREFETCH(WORD_TO_PTR(*copy_stack_ptr[-COPY_PREFETCH_DISTANCE]));	\
+  } while (0)
+
+
+#ifdef HIERARCHICAL_GC
+
+/* Hierarchical copying.  The depth-first order places a copied cell
+   next to only one of its children, the one whose slot was pushed
+   last.  With `HIERARCHICAL_GC', `drain_copy_stack' instead pushes the
+   slots of a cell popped from the copy stack to the `kid_stack', and
+   copies those children right after their parent.  The slots of the
+   children go to the copy stack as usual.  A parent and its
+   children, e.g. a trie node and its subtries, thus usually end up on
+   the same page.
+
+   Because the copy order determines where each cell is copied,
+   `rvy_drain_copy_stack' follows the same discipline.  A database
+   must therefore be recovered by Shades compiled with the same
+   setting, which `recover_db' checks from the `gc_copy_order' word
+   of the root block. */
+
+/* The `kid_stack' has room for the slots of one cell, i.e. at most a
+   page worth of them.  Allocated in `init_shades'. */
+static ptr_t *kid_stack = NULL;
+
+#define PUSH_TO_DRAIN_STACK(pp)  (*push_ptr++ = (pp))
+
+#else
+
+#define PUSH_TO_DRAIN_STACK(pp)  PUSH_TO_COPY_STACK(pp)
+
+#endif
+
+/* The header word of a cell that has been replaced by a forward
+   pointer. */
+#define FORWARD_POINTER_HEADER  CELL_HEADER(CELL_forward_pointer)
+
+
+#ifdef BACKGROUND_GC
+
+/* While a mature collection step runs in the background (see the
+   background mature collection below), the mutator may still read the
+   cells of the from-generations.  Their forward pointers are
+   therefore written to shadow pages instead.  Since every cell is at
+   least as large as a forward pointer, two words, the cell at offset
+   `k' of its page can be given the word `k / 2' of a shadow page of
+   half the size.  The word holds the new address of the cell or'ed
+   with `k & 1', or `NULL_WORD' if the cell has not been copied.
+
+   `shadow_page' is indexed by the page number.  A shadow page is
+   allocated only when a cell of a from-page is first reached, so
+   pages without live cells cost nothing. */
+static ptr_t *shadow_page = NULL;
+
+/* Non-zero while `copy_cell' and `drain_copy_stack' are called by the
+   background thread and must use the shadow pages. */
+static int is_shadow_forwarding = 0;
+
+#define NUMBER_OF_WORDS_PER_SHADOW_PAGE  (NUMBER_OF_WORDS_PER_PAGE / 2)
+
+#define PTR_TO_SHADOW_WORD(p, new_p)				\
+  (PTR_TO_WORD(new_p) | ((PTR_TO_WORD(p) / sizeof(word_t)) & 1))
+#define SHADOW_WORD_TO_WORD(w)  ((w) & ~(word_t) 1)
+
+
+/* Return the shadow word of the cell `p', allocating the shadow page
+   if needed. */
+static ptr_t ptr_to_shadow(ptr_t p)
+{
+  page_number_t pn = PTR_TO_PAGE_NUMBER(p);
+
+  if (shadow_page[pn] == NULL) {
+    shadow_page[pn] =
+      calloc(NUMBER_OF_WORDS_PER_SHADOW_PAGE, sizeof(word_t));
+    if (shadow_page[pn] == NULL) {
+      fprintf(stderr, "ptr_to_shadow: `calloc' failed.\n");
+      exit(1);
+    }
+  }
+  return shadow_page[pn] + (p - PAGE_NUMBER_TO_PAGE_PTR(pn)) / 2;
+}
+
+#endif
+
 
 /* Copy the cell referred to by `*pp', redirect `*pp' to refer to the
    copied cell, and put all references from `*pp' to the copy
@@ -1114,11 +1819,23 @@ static void copy_cell(ptr_t pp)
 {
   word_t p0, new_x;
   ptr_t p, new_p, new_px;
+#ifdef BACKGROUND_GC
+  ptr_t fw = NULL;
+#endif
 
   assert(pp != NULL_PTR);
   assert(*pp != NULL_WORD);
   p = WORD_TO_PTR(*pp);
 
+#ifdef BACKGROUND_GC
+  if (is_shadow_forwarding) {
+    fw = ptr_to_shadow(p);
+    if (*fw != NULL_WORD) {
+      *pp = SHADOW_WORD_TO_WORD(*fw);
+      return;
+    }
+  }
+#endif
   p0 = p[0];
   switch (CELL_TYPE(p)) {
     /* Note: The outermost if-statement for a forward-pointer
@@ -1184,8 +1901,16 @@ static void copy_cell(ptr_t pp)
 #endif
   }
   /* Set up a forward pointer. */
-  p[0] = CELL_forward_pointer << (32 - CELL_TYPE_BITS);
-  *pp = p[1] = PTR_TO_WORD(new_p);
+#ifdef BACKGROUND_GC
+  if (is_shadow_forwarding) {
+    *fw = PTR_TO_SHADOW_WORD(p, new_p);
+    *pp = PTR_TO_WORD(new_p);
+  } else
+#endif
+  {
+    p[0] = FORWARD_POINTER_HEADER;
+    *pp = p[1] = PTR_TO_WORD(new_p);
+  }
   assert(copy_stack_ptr < copy_stack + NUMBER_OF_WORDS_IN_FIRST_GENERATION);
 }
 
@@ -1195,9 +1920,30 @@ static void drain_copy_stack(void)
   word_t p0, new_x;
   ptr_t pp, p, new_p, new_px, reg_to_ptr = to_ptr, reg_to_end = to_end;
   generation_info_t *gni;
-
+#ifdef BACKGROUND_GC
+  ptr_t fw = NULL;
+#endif
+#ifdef HIERARCHICAL_GC
+  ptr_t *push_ptr, *kid_ptr = kid_stack;
+  int is_kid;
+
+  for (;;) {
+    if (kid_ptr != kid_stack) {
+      /* Copy the children of the previously copied cell first. */
+      pp = *--kid_ptr;
+      push_ptr = copy_stack_ptr;
+      is_kid = 1;
+    } else if (!COPY_STACK_IS_EMPTY) {
+      pp = POP_FROM_COPY_STACK;
+      push_ptr = kid_stack;
+      is_kid = 0;
+    } else
+      break;
+#else
   while (!COPY_STACK_IS_EMPTY) {
     pp = POP_FROM_COPY_STACK;
+#endif
+    PREFETCH_FROM_COPY_STACK;
     assert(*pp != NULL_WORD);
     p = WORD_TO_PTR(*pp);
 
@@ -1210,6 +1956,15 @@ static void drain_copy_stack(void)
 	continue;
       }
       assert(gni->status == BEING_COLLECTED);
+#ifdef BACKGROUND_GC
+      if (is_shadow_forwarding) {
+	fw = ptr_to_shadow(p);
+	if (*fw != NULL_WORD) {
+	  *pp = SHADOW_WORD_TO_WORD(*fw);
+	  continue;
+	}
+      }
+#endif
     }
 
     p0 = p[0];
@@ -1242,7 +1997,7 @@ static void drain_copy_stack(void)
         new_px = new_p + (&(x) - p);			\
         *new_px = new_x;				\
         if (new_x != NULL_WORD)				\
-          PUSH_TO_COPY_STACK(new_px);			\
+          PUSH_TO_DRAIN_STACK(new_px);			\
       } while (0)
 #define DECLARE_NONNULL_PTR(x)				\
       do {						\
@@ -1251,7 +2006,7 @@ static void drain_copy_stack(void)
         new_px = new_p + (&(x) - p);			\
         *new_px = new_x;				\
         assert(new_x != NULL_WORD);			\
-        PUSH_TO_COPY_STACK(new_px);			\
+        PUSH_TO_DRAIN_STACK(new_px);			\
       } while (0)
 #define DECLARE_TAGGED(x)				\
       do {						\
@@ -1259,7 +2014,7 @@ static void drain_copy_stack(void)
         new_px = new_p + (&(x) - p);			\
         *new_px = new_x;				\
         if (TAGGED_IS_PTR(new_x) && new_x != NULL_WORD)	\
-          PUSH_TO_COPY_STACK(new_px);			\
+          PUSH_TO_DRAIN_STACK(new_px);			\
       } while (0)
 
 #include "cells-def-prep.h"
@@ -1276,171 +2031,723 @@ static void drain_copy_stack(void)
 #endif
     }
     /* Set up a forward pointer. */
-    p[0] = CELL_forward_pointer << (32 - CELL_TYPE_BITS);
-    *pp = p[1] = PTR_TO_WORD(new_p);
+#ifdef BACKGROUND_GC
+    if (is_shadow_forwarding) {
+      *fw = PTR_TO_SHADOW_WORD(p, new_p);
+      *pp = PTR_TO_WORD(new_p);
+    } else
+#endif
+    {
+      p[0] = FORWARD_POINTER_HEADER;
+      *pp = p[1] = PTR_TO_WORD(new_p);
+    }
+#ifdef HIERARCHICAL_GC
+    if (is_kid)
+      copy_stack_ptr = push_ptr;
+    else {
+      /* The children are copied next, prefetch them all at once. */
+      for (kid_ptr = kid_stack; kid_ptr < push_ptr; kid_ptr++)
+	PREFETCH(WORD_TO_PTR(**kid_ptr));
+      assert(kid_ptr == push_ptr);
+    }
+#endif
     assert(copy_stack_ptr < copy_stack + NUMBER_OF_WORDS_IN_FIRST_GENERATION);
   }
   to_ptr = reg_to_ptr;
 }
 
 
-/* Recovery of cells in to_gn.  These routines assume `page_info's and
-   `generation_info's are all set, and all data pages are read into
-   memory.  Additionally the actual cell copying routines assume the
-   data has actually already been copied to the to generation.  But
-   otherwise these routines mimic the ones defined above.  */
+#ifdef PARALLEL_GC
+
+/* Parallel copying of the first generation.
+
+   If `gc_threads' is larger than one, `collect_first_generation'
+   evacuates the first generation with several threads instead of
+   `copy_cell' and `drain_copy_stack'.  The calling thread acts as the
+   worker number 0, the other workers are threads created in
+   `init_shades' that sleep between collections.
+
+   Each worker has a copy stack of its own, implemented as a
+   work-stealing deque: the owner pushes and pops at the `bottom' of
+   its stack, idle workers steal from the `top' of other workers'
+   stacks.  Each worker also copies to a to-page of its own.  It
+   takes new to-pages from a small cache of its own, which it refills
+   by popping a batch of pages from the list of free pages with a
+   compare-and-swap, and records them in a list of its own.  The lists
+   are appended to `to_gn' once the workers are done.  No pages are
+   freed during the collection, so a page popped from the list of
+   free pages never returns to its top meanwhile, and the
+   compare-and-swap can not be fooled by it.
+
+   A cell is claimed by first copying it speculatively to the worker's
+   to-page and then atomically replacing its header with
+   `BEING_FORWARDED_HEADER'.  The winner installs the forward pointer,
+   the loser rolls its copy back and follows the forward pointer.  No
+   remembered sets are touched while copying.  The order of the cells
+   in the new generation is therefore not deterministic, and
+   `rvy_new_generation' can not replay it.  Instead the remembered sets
+   of the older generations are constructed afterwards by
+   `scan_generation_to_rem_sets', both here and during recovery. */
+
+/* The header of a cell whose forward pointer is being installed.  The
+   type tag `CELL_bonk' never occurs in live cells, and it is not
+   `CELL_forward_pointer' so that cell declaration blocks that follow
+   forward pointers (such as `CELL_cont') don't read the unfinished
+   `p[1]'. */
+#define BEING_FORWARDED_HEADER  (CELL_HEADER(CELL_bonk) | 1)
+
+typedef struct gc_worker_t {
+  int id;
+  pthread_t thread;
+  /* The copy stack.  Entries `stack[top..bottom-1]' are visible to
+     thieves. */
+  ptr_t *stack;
+  volatile long top, bottom;
+  /* The worker's private equivalents of `to_pn', `to_ptr' and
+     `to_end'. */
+  page_number_t to_pn;
+  ptr_t to_ptr, to_end;
+  /* The cached free pages, linked through their `next_free_page'. */
+  page_number_t free_pages;
+  int number_of_free_pages;
+  /* The to-pages taken by the worker in this collection. */
+  page_number_t *pages;
+  int npages, max_npages;
+} gc_worker_t;
+
+static gc_worker_t *gc_worker = NULL;
+
+/* The number of workers, including the calling thread.  Computed in
+   `init_shades' from `gc_threads'. */
+static int number_of_gc_workers = 1;
+
+static pthread_mutex_t gc_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_workers_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gc_workers_done = PTHREAD_COND_INITIALIZER;
+/* Signalled when there is work to steal or all workers are idle. */
+static pthread_cond_t gc_workers_work = PTHREAD_COND_INITIALIZER;
+/* Incremented by each parallel collection in order to wake up the
+   workers. */
+static unsigned long gc_workers_round = 0;
+static int number_of_running_gc_workers = 0;
+static volatile int number_of_idle_gc_workers = 0;
+static volatile int number_of_sleeping_gc_workers = 0;
+
+/* How many free pages a worker pops at a time. */
+#define GC_WORKER_PAGE_BATCH  8
+
+/* How many times an idle worker looks for work to steal, with
+   exponentially growing pauses, before it sleeps on
+   `gc_workers_work'. */
+#define GC_WORKER_SPINS  16
+
+/* A worker wakes up a sleeping worker when its copy stack holds at
+   least this many entries. */
+#define GC_WORKER_WAKE_DEPTH  4
+
+
+static ptr_t gc_worker_pop(gc_worker_t *w)
+{
+  long b, t;
+  ptr_t pp;
+
+  b = w->bottom - 1;
+  w->bottom = b;
+  __sync_synchronize();
+  t = w->top;
+  if (t > b) {
+    /* The stack was empty. */
+    w->bottom = t;
+    return NULL;
+  }
+  pp = w->stack[b];
+  if (t == b) {
+    /* This was the last entry, race against the thieves for it. */
+    if (!__sync_bool_compare_and_swap(&w->top, t, t + 1))
+      pp = NULL;
+    w->bottom = t + 1;
+  }
+  return pp;
+}
 
-/* The index of the `to_pn' in the `generation_info[to_gn].page'-array. */
-static int rvy_to_pn_index;
 
-/* The pointer to the first word on the next page. */
-static ptr_t rvy_next_to_ptr;
+static ptr_t gc_worker_steal(gc_worker_t *victim)
+{
+  long b, t;
+  ptr_t pp;
+
+  t = victim->top;
+  __sync_synchronize();
+  b = victim->bottom;
+  if (t >= b)
+    return NULL;
+  pp = victim->stack[t];
+  if (!__sync_bool_compare_and_swap(&victim->top, t, t + 1))
+    /* Lost the race to another thief or the owner. */
+    return NULL;
+  return pp;
+}
 
-static void rvy_start_gc(void)
+
+/* Analogous to `allocate_to_page'. */
+static page_number_t par_take_to_page(gc_worker_t *w)
 {
-  to_ptr = to_end = NULL;
-  to_pn = INVALID_PAGE_NUMBER;
-  rvy_to_pn_index = 0;
-  if (generation_info[to_gn].npages != 0)
-    rvy_next_to_ptr =
-      PAGE_NUMBER_TO_PAGE_PTR(generation_info[to_gn].page[0]) + 2;
+  page_number_t pn, last;
+  int n, batch;
+
+  if (w->number_of_free_pages == 0) {
+    /* Pop a batch of pages from the list of free pages, or only one
+       when free pages are running out, lest they be left in the
+       caches of the other workers. */
+    batch = GC_WORKER_PAGE_BATCH;
+    if (number_of_free_pages
+	< 2 * GC_WORKER_PAGE_BATCH * (unsigned long) number_of_gc_workers)
+      batch = 1;
+    do {
+      pn = list_of_free_pages;
+      if (pn == INVALID_PAGE_NUMBER) {
+	fprintf(stderr, "par_take_to_page: Out of main memory\n");
+	exit(1);
+      }
+      for (last = pn, n = 1;
+	   n < batch
+	     && page_info[last].next_free_page != INVALID_PAGE_NUMBER;
+	   n++)
+	last = page_info[last].next_free_page;
+    } while (!__sync_bool_compare_and_swap(&list_of_free_pages, pn,
+					   page_info[last].next_free_page));
+    __sync_fetch_and_sub(&number_of_free_pages, n);
+    w->free_pages = pn;
+    w->number_of_free_pages = n;
+  }
+  pn = w->free_pages;
+  w->free_pages = page_info[pn].next_free_page;
+  w->number_of_free_pages--;
+  take_page(pn);
+  if (w->npages == w->max_npages) {
+    w->max_npages = 2 * w->max_npages + GC_WORKER_PAGE_BATCH;
+    w->pages = realloc(w->pages, w->max_npages * sizeof(page_number_t));
+    if (w->pages == NULL) {
+      fprintf(stderr, "par_take_to_page: `realloc' failed.\n");
+      exit(1);
+    }
+  }
+  w->pages[w->npages++] = pn;
+  page_info[pn].generation = &generation_info[to_gn];
+  return pn;
 }
 
 
-/* This is analogous to `new_to_page'. */
-static void rvy_next_to_page(void)
+/* Append the to-pages of the workers to `to_gn' and return their
+   unused cached pages to the list of free pages. */
+static void par_finish_to_pages(void)
 {
-  if (to_pn != INVALID_PAGE_NUMBER) {
-    assert(PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn)
-	   == (unsigned long) (to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn)));
-    /* Pick the next to page in the to generation. */
-    rvy_to_pn_index++;
+  int i, j;
+  page_number_t last;
+  gc_worker_t *w;
+
+  for (i = 0; i < number_of_gc_workers; i++) {
+    w = &gc_worker[i];
+    if (w->to_pn != INVALID_PAGE_NUMBER)
+      PAGE_SET_NUMBER_OF_WORDS_IN_USE(w->to_pn,
+				      w->to_ptr
+				      - PAGE_NUMBER_TO_PAGE_PTR(w->to_pn));
+    for (j = 0; j < w->npages; j++)
+      append_to_page(w->pages[j]);
+    if (w->number_of_free_pages != 0) {
+      for (last = w->free_pages, j = 1;
+	   j < w->number_of_free_pages;
+	   j++)
+	last = page_info[last].next_free_page;
+      page_info[last].next_free_page = list_of_free_pages;
+      list_of_free_pages = w->free_pages;
+      number_of_free_pages += w->number_of_free_pages;
+    }
   }
-  to_pn = generation_info[to_gn].page[rvy_to_pn_index];
-  to_ptr = rvy_next_to_ptr;
-  to_end = 
-    PAGE_NUMBER_TO_PAGE_PTR(to_pn) + PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn);
-  if (rvy_to_pn_index != generation_info[to_gn].npages - 1)
-    rvy_next_to_ptr =
-      PAGE_NUMBER_TO_PAGE_PTR(generation_info[to_gn].page[rvy_to_pn_index + 1])
-      + 2;
-  else
-    rvy_next_to_ptr = NULL;
 }
 
 
-static void rvy_finish_gc(void)
+/* Analogous to `new_to_page'. */
+static void par_new_to_page(gc_worker_t *w)
 {
-  if (to_pn != INVALID_PAGE_NUMBER) {
-    /* There's nothing particular to wrap up, but perform some
-       assertions. */
-    assert(PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn)
-	   == (unsigned long) (to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn)));
-    assert(rvy_to_pn_index == generation_info[to_gn].npages - 1);
+  if (w->to_pn != INVALID_PAGE_NUMBER)
+    PAGE_SET_NUMBER_OF_WORDS_IN_USE(w->to_pn,
+				    w->to_ptr
+				    - PAGE_NUMBER_TO_PAGE_PTR(w->to_pn));
+  w->to_pn = par_take_to_page(w);
+  w->to_ptr = PAGE_NUMBER_TO_PAGE_PTR(w->to_pn) + PAGE_HEADER_WORDS;
+  w->to_end = PAGE_NUMBER_TO_PAGE_PTR(w->to_pn) + NUMBER_OF_WORDS_PER_PAGE;
+}
+
+
+/* Wake up one sleeping worker, or all of them if `all' is non-zero. */
+static void wake_gc_workers(int all)
+{
+  if (pthread_mutex_lock(&gc_workers_lock)) {
+    perror("wake_gc_workers/pthread_mutex_lock");
+    exit(1);
+  }
+  if ((all
+       ? pthread_cond_broadcast(&gc_workers_work)
+       : pthread_cond_signal(&gc_workers_work))) {
+    perror("wake_gc_workers/pthread_cond_signal");
+    exit(1);
+  }
+  if (pthread_mutex_unlock(&gc_workers_lock)) {
+    perror("wake_gc_workers/pthread_mutex_unlock");
+    exit(1);
   }
 }
 
 
-static void rvy_copy_cell(ptr_t pp)
+/* The parallel equivalent of `copy_cell' and one iteration of
+   `drain_copy_stack'.  Pointers in the copied cell are first staged
+   above the `bottom' of the worker's copy stack and published only
+   once the cell has been successfully claimed. */
+static void par_copy_cell(gc_worker_t *w, ptr_t pp)
 {
-  word_t p0;
-  ptr_t p, old_p;		/* `old_p' is used only for asserts. */
-  generation_info_t *gni;
+  word_t p0, new_x;
+  ptr_t p, new_p, new_px, *staged;
+  long n;
 
-  assert(pp != NULL_PTR);
   assert(*pp != NULL_WORD);
   p = WORD_TO_PTR(*pp);
+  if (!is_in_first_generation(p)) {
+#ifdef BACKGROUND_GC
+    /* Follow the forward pointers installed by
+       `finish_background_gc_step'. */
+    if (PTR_TO_GENERATION_INFO(p)->status == BEING_COLLECTED) {
+      assert(p[0] == FORWARD_POINTER_HEADER);
+      *pp = p[1];
+    }
+#endif
+    /* Possible remembered set entries are made later by
+       `scan_generation_to_rem_sets'. */
+    return;
+  }
 
-  p0 = p[0];
-  switch (CELL_TYPE(p)) {
+ retry:
+  p0 = ((volatile word_t *) p)[0];
+  if (p0 == FORWARD_POINTER_HEADER) {
+    *pp = ((volatile word_t *) p)[1];
+    return;
+  }
+  if (p0 == BEING_FORWARDED_HEADER)
+    /* Another worker is just about to set the forward pointer. */
+    goto retry;
+  staged = w->stack + w->bottom;
+  n = 0;
+  switch ((cell_type_t) (p0 >> CELL_TYPE_SHIFT)) {
 #define CELL(name, number_of_words, field_definition_block)	\
   case CELL_ ## name:						\
-    if (CELL_ ## name == CELL_forward_pointer) {		\
-      *pp = p[1];						\
-      return;							\
-    } else {							\
-      if (to_ptr + (number_of_words) > to_end)			\
-        rvy_next_to_page();					\
-      old_p = p;						\
-      p = to_ptr;						\
-      to_ptr += (number_of_words);				\
-      assert(p[0] == p0);					\
-      field_definition_block;					\
+    new_p = w->to_ptr;						\
+    w->to_ptr += (number_of_words);				\
+    if (w->to_ptr > w->to_end) {				\
+      w->to_ptr = new_p;					\
+      par_new_to_page(w);					\
+      new_p = w->to_ptr;					\
+      w->to_ptr += (number_of_words);				\
     }								\
+    new_p[0] = p0;						\
+    field_definition_block;					\
     break;
 #define DECLARE_WORD(x)				\
-    do {					\
-      assert(old_p[&(x) - p] == (x)); 	\
-    } while (0)
+    new_p[&(x) - p] = (x)
 #define DECLARE_PTR(x)				\
     do {					\
-      if ((x) != NULL_WORD)			\
-	PUSH_TO_COPY_STACK(&(x));		\
+      assert((x) != FIRST_GENERATION_DEADBEEF);	\
+      new_x = (x);				\
+      new_px = new_p + (&(x) - p);		\
+      *new_px = new_x;				\
+      if (new_x != NULL_WORD)			\
+        staged[n++] = new_px;			\
     } while (0)
 #define DECLARE_NONNULL_PTR(x)			\
     do {					\
-      assert((x) != NULL_WORD);			\
-      PUSH_TO_COPY_STACK(&(x));			\
+      assert((x) != FIRST_GENERATION_DEADBEEF);	\
+      new_x = (x);				\
+      new_px = new_p + (&(x) - p);		\
+      *new_px = new_x;				\
+      assert(new_x != NULL_WORD);		\
+      staged[n++] = new_px;			\
     } while (0)
-#define DECLARE_TAGGED(x)			\
-    do {					\
-      if (TAGGED_IS_PTR(x)) {			\
-	if ((x) != NULL_WORD)			\
-          PUSH_TO_COPY_STACK(&(x));		\
-      } else {					\
-        assert(old_p[&(x) - p] == (x));		\
-      }						\
+#define DECLARE_TAGGED(x)				\
+    do {						\
+      new_x = (x);					\
+      new_px = new_p + (&(x) - p);			\
+      *new_px = new_x;					\
+      if (TAGGED_IS_PTR(new_x) && new_x != NULL_WORD)	\
+        staged[n++] = new_px;				\
     } while (0)
 
 #include "cells-def-prep.h"
 
 #undef CELL
-#undef DECLARE_TAGGED
 #undef DECLARE_PTR
 #undef DECLARE_NONNULL_PTR
 #undef DECLARE_WORD
+#undef DECLARE_TAGGED
 
 #ifndef NDEBUG
   default:
     abort();
 #endif
   }
-  if (PTR_TO_GENERATION_INFO(p) != PTR_TO_GENERATION_INFO(old_p)) {
-    /* Set up a forward pointer.  Since `rvy_copy_cell' may be called
-       to copy a cell on itself (in order to fill the copy stack as
-       not during recovery), we have to check we're not writing a
-       forward pointer on the cell itself. */
-    old_p[0] = CELL_forward_pointer << (32 - CELL_TYPE_BITS);
-    *pp = old_p[1] = PTR_TO_WORD(p);
+  if (!__sync_bool_compare_and_swap(&p[0], p0, BEING_FORWARDED_HEADER)) {
+    /* Another worker claimed the cell first.  Discard our copy. */
+    w->to_ptr = new_p;
+    goto retry;
   }
+  p[1] = PTR_TO_WORD(new_p);
+  __sync_synchronize();
+  p[0] = FORWARD_POINTER_HEADER;
+  *pp = PTR_TO_WORD(new_p);
+  /* Publish the staged pointers. */
+  __sync_synchronize();
+  w->bottom += n;
+  assert(w->bottom <= (long) NUMBER_OF_WORDS_IN_FIRST_GENERATION);
+  /* A worker that just fell asleep may be missed here, but then it
+     is woken by the next push, and the entries are popped by `w'
+     anyway. */
+  if (number_of_sleeping_gc_workers > 0
+      && w->bottom - w->top >= GC_WORKER_WAKE_DEPTH)
+    wake_gc_workers(0);
 }
 
 
-static void rvy_drain_copy_stack(void)
+/* Return non-zero if some other worker than `w' has entries in its
+   copy stack. */
+static int gc_worker_has_victim(gc_worker_t *w)
 {
-  word_t p0;
-  ptr_t pp, p;
-  generation_info_t *gni;
+  int i;
+  gc_worker_t *victim;
 
-  while (!COPY_STACK_IS_EMPTY) {
-    pp = POP_FROM_COPY_STACK;
-    assert(*pp != NULL_WORD);
-    p = WORD_TO_PTR(*pp);
+  for (i = 1; i < number_of_gc_workers; i++) {
+    victim = &gc_worker[(w->id + i) % number_of_gc_workers];
+    if (victim->top < victim->bottom)
+      return 1;
+  }
+  return 0;
+}
 
-    assert(!is_in_first_generation(p));
-    gni = PTR_TO_GENERATION_INFO(p);
-    if (gni->status == NORMAL)
-      continue;
-    if (gni->status == TO_BE_COLLECTED) {
-      PREPEND_TO_REM_SET(gni->rem_set, pp, gni->rem_set_allocation_ptr);
-      continue;
-    }
-    assert(gni->status == BEING_COLLECTED);
 
-    p0 = p[0];
-    switch (CELL_TYPE(p)) {
-#define CELL(name, number_of_words, field_definition_block)		\
-    case CELL_ ## name:							\
+/* Sleep until there may be work to steal or all workers are idle. */
+static void gc_worker_sleep(gc_worker_t *w)
+{
+  if (pthread_mutex_lock(&gc_workers_lock)) {
+    perror("gc_worker_sleep/pthread_mutex_lock");
+    exit(1);
+  }
+  __sync_fetch_and_add(&number_of_sleeping_gc_workers, 1);
+  if (number_of_idle_gc_workers != number_of_gc_workers
+      && !gc_worker_has_victim(w))
+    if (pthread_cond_wait(&gc_workers_work, &gc_workers_lock)) {
+      perror("gc_worker_sleep/pthread_cond_wait");
+      exit(1);
+    }
+  __sync_fetch_and_sub(&number_of_sleeping_gc_workers, 1);
+  if (pthread_mutex_unlock(&gc_workers_lock)) {
+    perror("gc_worker_sleep/pthread_mutex_unlock");
+    exit(1);
+  }
+}
+
+
+/* Copy until all workers are out of work. */
+static void gc_worker_drain(gc_worker_t *w)
+{
+  int i;
+  long j, pause;
+  ptr_t pp;
+
+  for (;;) {
+    while ((pp = gc_worker_pop(w)) != NULL)
+      par_copy_cell(w, pp);
+    /* Our own copy stack is empty, try stealing. */
+    for (i = 1; i < number_of_gc_workers; i++) {
+      pp = gc_worker_steal(&gc_worker[(w->id + i) % number_of_gc_workers]);
+      if (pp != NULL)
+	break;
+    }
+    if (pp != NULL) {
+      par_copy_cell(w, pp);
+      continue;
+    }
+    /* Nothing to steal.  We're done when all workers are idle, since
+       only busy workers can push new entries to their stacks.  The
+       last worker to become idle wakes up the sleeping ones. */
+    if (__sync_add_and_fetch(&number_of_idle_gc_workers, 1)
+	== number_of_gc_workers) {
+      wake_gc_workers(1);
+      return;
+    }
+    for (i = 0, pause = 1; ; i++) {
+      if (number_of_idle_gc_workers == number_of_gc_workers)
+	return;
+      if (gc_worker_has_victim(w)) {
+	__sync_fetch_and_sub(&number_of_idle_gc_workers, 1);
+	break;
+      }
+      if (i < GC_WORKER_SPINS) {
+	for (j = 0; j < pause; j++)
+	  (void) w->top;
+	pause *= 2;
+      } else
+	gc_worker_sleep(w);
+    }
+  }
+}
+
+
+static void *gc_worker_thread(void *arg)
+{
+  gc_worker_t *w = arg;
+  unsigned long round = 0;
+
+  while (1) {
+    if (pthread_mutex_lock(&gc_workers_lock)) {
+      perror("gc_worker_thread/pthread_mutex_lock");
+      exit(1);
+    }
+    while (gc_workers_round == round)
+      if (pthread_cond_wait(&gc_workers_wakeup, &gc_workers_lock)) {
+	perror("gc_worker_thread/pthread_cond_wait");
+	exit(1);
+      }
+    round = gc_workers_round;
+    if (pthread_mutex_unlock(&gc_workers_lock)) {
+      perror("gc_worker_thread/pthread_mutex_unlock");
+      exit(1);
+    }
+
+    gc_worker_drain(w);
+
+    if (pthread_mutex_lock(&gc_workers_lock)) {
+      perror("gc_worker_thread/pthread_mutex_lock");
+      exit(1);
+    }
+    if (--number_of_running_gc_workers == 0)
+      if (pthread_cond_signal(&gc_workers_done)) {
+	perror("gc_worker_thread/pthread_cond_signal");
+	exit(1);
+      }
+    if (pthread_mutex_unlock(&gc_workers_lock)) {
+      perror("gc_worker_thread/pthread_mutex_unlock");
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+
+static void init_gc_workers(void)
+{
+  int i;
+
+  gc_worker = malloc(number_of_gc_workers * sizeof(gc_worker_t));
+  if (gc_worker == NULL) {
+    fprintf(stderr, "init_gc_workers: malloc failed.\n");
+    exit(1);
+  }
+  for (i = 0; i < number_of_gc_workers; i++) {
+    gc_worker[i].id = i;
+    gc_worker[i].top = gc_worker[i].bottom = 0;
+    gc_worker[i].pages = NULL;
+    gc_worker[i].npages = gc_worker[i].max_npages = 0;
+    gc_worker[i].stack =
+      malloc(NUMBER_OF_WORDS_IN_FIRST_GENERATION * sizeof(ptr_t));
+    if (gc_worker[i].stack == NULL) {
+      fprintf(stderr, "init_gc_workers: malloc failed for copy stack.\n");
+      exit(1);
+    }
+    if (i != 0
+	&& pthread_create(&gc_worker[i].thread, NULL, 
+			  gc_worker_thread, &gc_worker[i]) != 0) {
+      perror("init_gc_workers/pthread_create");
+      exit(1);
+    }
+  }
+}
+
+#endif /* PARALLEL_GC */
+
+
+/* Recovery of cells in to_gn.  These routines assume `page_info's and
+   `generation_info's are all set, and all data pages are read into
+   memory.  Additionally the actual cell copying routines assume the
+   data has actually already been copied to the to generation.  But
+   otherwise these routines mimic the ones defined above.  */
+
+/* The index of the `to_pn' in the `generation_info[to_gn].page'-array. */
+static int rvy_to_pn_index;
+
+/* The pointer to the first word on the next page. */
+static ptr_t rvy_next_to_ptr;
+
+static void rvy_start_gc(void)
+{
+  to_ptr = to_end = NULL;
+  to_pn = INVALID_PAGE_NUMBER;
+  rvy_to_pn_index = 0;
+  if (generation_info[to_gn].npages != 0)
+    rvy_next_to_ptr =
+      PAGE_NUMBER_TO_PAGE_PTR(generation_info[to_gn].page[0])
+      + PAGE_HEADER_WORDS;
+}
+
+
+/* This is analogous to `new_to_page'. */
+static void rvy_next_to_page(void)
+{
+  if (to_pn != INVALID_PAGE_NUMBER) {
+    assert(PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn)
+	   == (unsigned long) (to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn)));
+    /* Pick the next to page in the to generation. */
+    rvy_to_pn_index++;
+  }
+  to_pn = generation_info[to_gn].page[rvy_to_pn_index];
+  to_ptr = rvy_next_to_ptr;
+  to_end = 
+    PAGE_NUMBER_TO_PAGE_PTR(to_pn) + PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn);
+  if (rvy_to_pn_index != generation_info[to_gn].npages - 1)
+    rvy_next_to_ptr =
+      PAGE_NUMBER_TO_PAGE_PTR(generation_info[to_gn].page[rvy_to_pn_index + 1])
+      + PAGE_HEADER_WORDS;
+  else
+    rvy_next_to_ptr = NULL;
+}
+
+
+static void rvy_finish_gc(void)
+{
+  if (to_pn != INVALID_PAGE_NUMBER) {
+    /* There's nothing particular to wrap up, but perform some
+       assertions. */
+    assert(PAGE_GET_NUMBER_OF_WORDS_IN_USE(to_pn)
+	   == (unsigned long) (to_ptr - PAGE_NUMBER_TO_PAGE_PTR(to_pn)));
+    assert(rvy_to_pn_index == generation_info[to_gn].npages - 1);
+  }
+}
+
+
+static void rvy_copy_cell(ptr_t pp)
+{
+  word_t p0;
+  ptr_t p, old_p;		/* `old_p' is used only for asserts. */
+  generation_info_t *gni;
+
+  assert(pp != NULL_PTR);
+  assert(*pp != NULL_WORD);
+  p = WORD_TO_PTR(*pp);
+
+  p0 = p[0];
+  switch (CELL_TYPE(p)) {
+#define CELL(name, number_of_words, field_definition_block)	\
+  case CELL_ ## name:						\
+    if (CELL_ ## name == CELL_forward_pointer) {		\
+      *pp = p[1];						\
+      return;							\
+    } else {							\
+      if (to_ptr + (number_of_words) > to_end)			\
+        rvy_next_to_page();					\
+      old_p = p;						\
+      p = to_ptr;						\
+      to_ptr += (number_of_words);				\
+      assert(p[0] == p0);					\
+      field_definition_block;					\
+    }								\
+    break;
+#define DECLARE_WORD(x)				\
+    do {					\
+      assert(old_p[&(x) - p] == (x)); 	\
+    } while (0)
+#define DECLARE_PTR(x)				\
+    do {					\
+      if ((x) != NULL_WORD)			\
+	PUSH_TO_COPY_STACK(&(x));		\
+    } while (0)
+#define DECLARE_NONNULL_PTR(x)			\
+    do {					\
+      assert((x) != NULL_WORD);			\
+      PUSH_TO_COPY_STACK(&(x));			\
+    } while (0)
+#define DECLARE_TAGGED(x)			\
+    do {					\
+      if (TAGGED_IS_PTR(x)) {			\
+	if ((x) != NULL_WORD)			\
+          PUSH_TO_COPY_STACK(&(x));		\
+      } else {					\
+        assert(old_p[&(x) - p] == (x));		\
+      }						\
+    } while (0)
+
+#include "cells-def-prep.h"
+
+#undef CELL
+#undef DECLARE_TAGGED
+#undef DECLARE_PTR
+#undef DECLARE_NONNULL_PTR
+#undef DECLARE_WORD
+
+#ifndef NDEBUG
+  default:
+    abort();
+#endif
+  }
+  if (PTR_TO_GENERATION_INFO(p) != PTR_TO_GENERATION_INFO(old_p)) {
+    /* Set up a forward pointer.  Since `rvy_copy_cell' may be called
+       to copy a cell on itself (in order to fill the copy stack as
+       not during recovery), we have to check we're not writing a
+       forward pointer on the cell itself. */
+    old_p[0] = FORWARD_POINTER_HEADER;
+    *pp = old_p[1] = PTR_TO_WORD(p);
+  }
+}
+
+
+static void rvy_drain_copy_stack(void)
+{
+  word_t p0;
+  ptr_t pp, p;
+  generation_info_t *gni;
+#ifdef HIERARCHICAL_GC
+  ptr_t *push_ptr, *kid_ptr = kid_stack;
+  int is_kid;
+
+  /* Pop in the same order as `drain_copy_stack'. */
+  for (;;) {
+    if (kid_ptr != kid_stack) {
+      pp = *--kid_ptr;
+      push_ptr = copy_stack_ptr;
+      is_kid = 1;
+    } else if (!COPY_STACK_IS_EMPTY) {
+      pp = POP_FROM_COPY_STACK;
+      push_ptr = kid_stack;
+      is_kid = 0;
+    } else
+      break;
+#else
+  while (!COPY_STACK_IS_EMPTY) {
+    pp = POP_FROM_COPY_STACK;
+#endif
+    PREFETCH_FROM_COPY_STACK;
+    assert(*pp != NULL_WORD);
+    p = WORD_TO_PTR(*pp);
+
+    assert(!is_in_first_generation(p));
+    gni = PTR_TO_GENERATION_INFO(p);
+    if (gni->status == NORMAL)
+      continue;
+    if (gni->status == TO_BE_COLLECTED) {
+      PREPEND_TO_REM_SET(gni->rem_set, pp, gni->rem_set_allocation_ptr);
+      continue;
+    }
+    assert(gni->status == BEING_COLLECTED);
+
+    p0 = p[0];
+    switch (CELL_TYPE(p)) {
+#define CELL(name, number_of_words, field_definition_block)		\
+    case CELL_ ## name:							\
       if (CELL_ ## name == CELL_forward_pointer) {			\
         assert(0);							\
       } else {								\
@@ -1467,17 +2774,17 @@ static void rvy_drain_copy_stack(void)
 #define DECLARE_PTR(x)				\
       do {					\
         if ((x) != NULL_WORD)			\
-	  PUSH_TO_COPY_STACK(&(x));		\
+	  PUSH_TO_DRAIN_STACK(&(x));		\
       } while (0)
 #define DECLARE_NONNULL_PTR(x)			\
       do {					\
         assert((x) != NULL_WORD);		\
-	PUSH_TO_COPY_STACK(&(x));		\
+	PUSH_TO_DRAIN_STACK(&(x));		\
       } while (0)
 #define DECLARE_TAGGED(x)				\
       do {						\
         if (TAGGED_IS_PTR(x) && (x) != NULL_WORD)	\
-	  PUSH_TO_COPY_STACK(&(x));			\
+	  PUSH_TO_DRAIN_STACK(&(x));			\
       } while (0)
 
 #include "cells-def-prep.h"
@@ -1493,44 +2800,216 @@ static void rvy_drain_copy_stack(void)
       abort();
 #endif
     }
+#ifdef HIERARCHICAL_GC
+    if (is_kid)
+      copy_stack_ptr = push_ptr;
+    else
+      kid_ptr = push_ptr;
+#endif
     assert(copy_stack_ptr < copy_stack + NUMBER_OF_WORDS_IN_FIRST_GENERATION);
   }
 }
 
 
+/* Generations whose cells were copied in parallel (see the parallel
+   copying above) are not in a deterministic depth-first order.  Their
+   number of referring pointers is flagged with
+   `GENERATION_WAS_COPIED_IN_PARALLEL', and the remembered sets of
+   older generations are constructed by scanning the new generation
+   linearly, page by page and cell by cell, both immediately after the
+   copying and during recovery.  This routine is available regardless
+   of `PARALLEL_GC' so that any database can be recovered. */
+
+#define GENERATION_WAS_COPIED_IN_PARALLEL  0x80000000UL
+
+static void scan_generation_to_rem_sets(generation_number_t gn)
+{
+  int i;
+  word_t p0;
+  ptr_t p, pp, end;
+  page_number_t pn;
+  generation_info_t *gni;
+
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    pn = generation_info[gn].page[i];
+    p = PAGE_NUMBER_TO_PAGE_PTR(pn) + PAGE_HEADER_WORDS;
+    end = PAGE_NUMBER_TO_PAGE_PTR(pn) + PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn);
+    while (p < end) {
+      p0 = p[0];
+      switch (CELL_TYPE(p)) {
+#define CELL(name, number_of_words, field_definition_block)	\
+      case CELL_ ## name:					\
+        field_definition_block;					\
+        p += (number_of_words);					\
+        break;
+      /* Note that `PREPEND_TO_REM_SET' shadows `p'. */
+#define REMEMBER(x)							\
+	do {								\
+	  gni = PTR_TO_GENERATION_INFO(WORD_TO_PTR(x));			\
+	  if (gni->status == TO_BE_COLLECTED) {				\
+	    pp = &(x);							\
+	    PREPEND_TO_REM_SET(gni->rem_set, pp,			\
+			       gni->rem_set_allocation_ptr);		\
+	  }								\
+	} while (0)
+#define DECLARE_WORD(x)				\
+        /* Do nothing. */
+#define DECLARE_PTR(x)				\
+        do {					\
+          if ((x) != NULL_WORD)			\
+	    REMEMBER(x);			\
+        } while (0)
+#define DECLARE_NONNULL_PTR(x)			\
+        do {					\
+          assert((x) != NULL_WORD);		\
+	  REMEMBER(x);				\
+        } while (0)
+#define DECLARE_TAGGED(x)				\
+        do {						\
+          if (TAGGED_IS_PTR(x) && (x) != NULL_WORD)	\
+	    REMEMBER(x);				\
+        } while (0)
+
+#include "cells-def-prep.h"
+
+#undef CELL
+#undef REMEMBER
+#undef DECLARE_TAGGED
+#undef DECLARE_PTR
+#undef DECLARE_NONNULL_PTR
+#undef DECLARE_WORD
+
+#ifndef NDEBUG
+      default:
+	abort();
+#endif
+      }
+    }
+    assert(p == end);
+  }
+}
+
+
 /* Mature generation garbage collection. */
 
 static int major_gc_was_started = 0;
 
-/* Mark the generations to be collected by the imminent major gc. */
-static void mark_major_gc_generations(void)
+/* The number of pages in the from-generations of all the major gc
+   steps logged so far, and in the generations passed over.  Used for
+   pacing in `major_gc'. */
+static unsigned long number_of_collected_pages = 0;
+
+/* The generation the current major collection passes over next if a
+   step left it for the following steps, see `pass_over_generations'. */
+static generation_number_t next_gn_to_pass_over = INVALID_GENERATION_NUMBER;
+
+/* The number of pages written when passing over generations in the
+   latest major gc step. */
+static unsigned long number_of_passed_over_pages = 0;
+
+/* The number of from-generations in the `generation_pinfo' of a
+   generation that a major collection passed over instead of
+   collecting it, see `log_major_gc_step'. */
+#define PASSED_OVER_GENERATION  0xFFF
+
+/* The fraction of the generation `gn' expected to be live if it were
+   collected now.  A generation that has been passed over `k' times is
+   expected to shrink as much as it did when it was copied, compounded
+   for `k + 1' rounds.  A generation that has not been copied is
+   assumed to be all garbage. */
+static double expected_live_fraction(generation_number_t gn)
 {
-  int number_of_generations_to_collect = 0;
-  unsigned long number_of_marked_pages = 0;
-  unsigned long number_of_pages_to_mark = 
-    /* XXX A crude heuristic! */
-    (sqrt(db_size) * sqrt(first_generation_size)) / PAGE_SIZE;
-  generation_number_t gn;
+  if (generation_info[gn].shrinkage == 0)
+    return 0;
+  return pow(generation_info[gn].shrinkage,
+	     -(generation_info[gn].number_of_skips + 1.0));
+}
 
+/* Is the generation `gn' expected to shrink so little if collected
+   now that the major gc should rather pass over it?  Small
+   generations are not passed over, so that they are still merged in
+   `start_major_gc_step'.  Neither is a generation whose dirty pages,
+   i.e. the pages where the major collection redirected referrers,
+   outnumbered its live pages when it was last passed over, since
+   passing over it would write more than copying. */
+static int generation_is_dense(generation_number_t gn)
+{
+  double live = expected_live_fraction(gn);
+
+  if (generation_info[gn].shrinkage == 0
+      || generation_info[gn].number_of_skips >= max_generation_skips
+      || (generation_info[gn].npages * PAGE_SIZE
+	  < first_generation_size * relative_mature_generation_size)
+      || (generation_info[gn].number_of_rewritten_pages
+	  > live * generation_info[gn].npages))
+    return 0;
+  return live * (1 + generation_shrinkage_margin) > 1;
+}
+
+static int compare_expected_live_fractions(const void *a, const void *b)
+{
+  double x = expected_live_fraction(*(const generation_number_t *) a);
+  double y = expected_live_fraction(*(const generation_number_t *) b);
+
+  return x < y ? -1 : x > y;
+}
+
+/* Mark the generations to be collected by the imminent major gc.
+   With `allow_additional_generationality', the generations are marked
+   in the order of their expected live fraction, sparsest first, and
+   once a crude limit of pages is marked, the dense ones are passed
+   over.  The youngest generation is always marked so that
+   `start_major_gc_step' can tell it from the generations that emerge
+   later. */
+static void mark_major_gc_generations(void)
+{
+  int number_of_generations_to_collect = 0;
+  int number_of_generations_to_skip = 0;
+  unsigned long i, n = 0;
+  unsigned long number_of_marked_pages = 0;
+  unsigned long number_of_pages_to_mark = 
+    /* XXX A crude heuristic! */
+    (sqrt(db_size) * sqrt(first_generation_size)) / PAGE_SIZE;
+  generation_number_t gn, *order;
+
+  order = malloc((number_of_generations + 1) * sizeof(generation_number_t));
+  if (order == NULL) {
+    fprintf(stderr, "mark_major_gc_generations: malloc failed.\n");
+    exit(1);
+  }
   for (gn = youngest_gn;
        gn != INVALID_GENERATION_NUMBER;
        gn = generation_info[gn].older) {
+    assert(generation_info[gn].status == NORMAL);
+    order[n++] = gn;
+  }
+  if (allow_additional_generationality)
+    qsort(order, n, sizeof(generation_number_t),
+	  compare_expected_live_fractions);
+  for (i = 0; i < n; i++) {
+    gn = order[i];
     if (allow_additional_generationality
+	&& gn != youngest_gn
 	&& number_of_marked_pages > number_of_pages_to_mark
-	&& generation_info[gn].shrinkage <
-	   avg_generation_shrinkage + generation_shrinkage_margin)
-      break;
-    assert(generation_info[gn].status == NORMAL);
+	&& generation_is_dense(gn)) {
+      generation_info[gn].number_of_skips++;
+      number_of_generations_to_skip++;
+      continue;
+    }
     generation_info[gn].status = TO_BE_COLLECTED;
     number_of_generations_to_collect++;
     number_of_marked_pages += generation_info[gn].npages;
   }
+  free(order);
 
   if (must_show_groups)
-    fprintf(stderr, "\n{Initiating major collection of %d generations}",
-	    number_of_generations_to_collect);
+    fprintf(stderr, "\n{Initiating major collection of %d generations, "
+	    "passing over %d}",
+	    number_of_generations_to_collect, number_of_generations_to_skip);
 
   major_gc_was_started = 1;
+  recent_generation_shrinkage = avg_generation_shrinkage;
+  number_of_pages_since_major_gc = 0;
 }
 
 
@@ -1551,18 +3030,15 @@ static void rvy_mark_major_gc_generations(generation_number_t start_gn)
    *major_gc_step*. */
 static generation_number_t prev_to_gn = INVALID_GENERATION_NUMBER;
 
-/* Do a unit of mature generation garbage collection.  Return 0 if the
-   major collection was finished, and otherwise an estimate of how
-   much gc effort was used. */
-static int major_gc_step(void)
+/* Start a unit of mature generation garbage collection: allocate
+   `to_gn' and choose the generations to collect in this step.  They
+   are marked BEING_COLLECTED and put on the from-list of `to_gn'.
+   Returns the first, i.e. the youngest, of them. */
+static generation_number_t start_major_gc_step(int *number_of_from_gns_ptr,
+					       int *number_of_from_pages_ptr)
 {
-  int i;
   int number_of_from_pages, number_of_from_gns;
-  unsigned long number_of_referring_ptrs;
-  generation_number_t first_from_gn, gn, tmp_gn;
-  rem_set_t *rem_set;
-  ptr_t p;
-  smart_ptr_t *sp;
+  generation_number_t first_from_gn, gn;
 
   if (must_show_groups)
     fprintf(stderr, "{");
@@ -1601,12 +3077,154 @@ static int major_gc_step(void)
     gn = generation_info[gn].older;
   } while (gn != INVALID_GENERATION_NUMBER
 	   && generation_info[gn].status == TO_BE_COLLECTED
-	   && number_of_from_gns < 0xFFF
+	   && number_of_from_gns < PASSED_OVER_GENERATION - 1
 	   && (generation_info[gn].npages +
 	       number_of_from_pages) * PAGE_SIZE
 	      < first_generation_size * relative_mature_generation_size);
-  /* Scan the remembered sets of the collected generations. */
-  CLEAR_COPY_STACK;
+  *number_of_from_gns_ptr = number_of_from_gns;
+  *number_of_from_pages_ptr = number_of_from_pages;
+  return first_from_gn;
+}
+
+
+/* Copy the cell referred to by the referrer `pp' found in a
+   remembered set. */
+static void copy_rem_set_referrer(ptr_t pp)
+{
+#ifdef BACKGROUND_GC
+  word_t w;
+
+  if (is_shadow_forwarding) {
+    /* The background thread must not redirect the referrer yet, see
+       `finish_background_gc_step'. */
+    w = *pp;
+    copy_cell(&w);
+    return;
+  }
+#endif
+  copy_cell(pp);
+  PTR_TO_PAGE_INFO(pp)->is_dirty = 1;
+}
+
+
+/* As above, but during recovery. */
+static void rvy_copy_rem_set_referrer(ptr_t pp)
+{
+  rvy_copy_cell(pp);
+  PTR_TO_PAGE_INFO(pp)->is_dirty = 1;
+}
+
+
+#ifdef REM_SET_BITMAP
+
+/* Call `copy_referrer' for each referrer in the remembered sets of the
+   `number_of_from_gns' generations starting from `first_from_gn', and
+   free them.  Only the pages marked in the generations' page bitmaps
+   are scanned, and of them only the referrers to the generations being
+   collected are copied and cleared. */
+static void scan_rem_sets(generation_number_t first_from_gn,
+			  int number_of_from_gns,
+			  void (*copy_referrer)(ptr_t))
+{
+  int i;
+  unsigned long j, k, pn;
+  word_t x, y, *bits;
+  rem_set_t *rem_set;
+  generation_number_t gn;
+  ptr_t pp;
+
+  memset(rem_set_page_union, 0, rem_set_page_bitmap_size * sizeof(word_t));
+  for (i = 0, gn = first_from_gn;
+       i < number_of_from_gns;
+       i++, gn = generation_info[gn].older) {
+    rem_set = generation_info[gn].rem_set;
+    if (rem_set != REM_SET_TAIL_COOKIE) {
+      for (j = 0; j < rem_set_page_bitmap_size; j++)
+	rem_set_page_union[j] |= rem_set[j];
+#ifdef BACKGROUND_GC
+      if (is_shadow_forwarding)
+	/* The remembered set is scanned again when the referrers are
+	   redirected. */
+	continue;
+#endif
+      free_rem_set(rem_set, generation_info[gn].rem_set_allocation_ptr);
+      generation_info[gn].rem_set = REM_SET_TAIL_COOKIE;
+    }
+  }
+  for (j = 0; j < rem_set_page_bitmap_size; j++)
+    for (x = rem_set_page_union[j]; x != 0; x &= x - 1) {
+      pn = j * REM_SET_BITS_PER_WORD + LOWEST_BIT(x);
+      bits = rem_set_bitmap
+	+ pn * (NUMBER_OF_WORDS_PER_PAGE / REM_SET_BITS_PER_WORD);
+      for (k = 0; k < NUMBER_OF_WORDS_PER_PAGE / REM_SET_BITS_PER_WORD; k++)
+	for (y = bits[k]; y != 0; y &= y - 1) {
+	  pp = PAGE_NUMBER_TO_PAGE_PTR(pn)
+	    + k * REM_SET_BITS_PER_WORD + LOWEST_BIT(y);
+	  /* The page may also contain referrers to generations
+	     collected in later steps. */
+	  if (PTR_TO_GENERATION_INFO(WORD_TO_PTR(*pp))->status
+	      != BEING_COLLECTED)
+	    continue;
+	  copy_referrer(pp);
+#ifdef BACKGROUND_GC
+	  if (is_shadow_forwarding)
+	    continue;
+#endif
+	  bits[k] &= ~((word_t) 1 << LOWEST_BIT(y));
+#ifdef GC_PROFILING
+	  current_rem_set_size--;
+#endif
+	}
+    }
+}
+
+/* Drop the remembered set of `gn' without visiting its referrers, and
+   clear their bits. */
+static void forget_rem_set(generation_number_t gn)
+{
+  unsigned long j, k, pn;
+  word_t x, y, *bits;
+  rem_set_t *rem_set;
+  ptr_t pp;
+
+  rem_set = generation_info[gn].rem_set;
+  if (rem_set == REM_SET_TAIL_COOKIE)
+    return;
+  for (j = 0; j < rem_set_page_bitmap_size; j++)
+    for (x = rem_set[j]; x != 0; x &= x - 1) {
+      pn = j * REM_SET_BITS_PER_WORD + LOWEST_BIT(x);
+      bits = rem_set_bitmap
+	+ pn * (NUMBER_OF_WORDS_PER_PAGE / REM_SET_BITS_PER_WORD);
+      for (k = 0; k < NUMBER_OF_WORDS_PER_PAGE / REM_SET_BITS_PER_WORD; k++)
+	for (y = bits[k]; y != 0; y &= y - 1) {
+	  pp = PAGE_NUMBER_TO_PAGE_PTR(pn)
+	    + k * REM_SET_BITS_PER_WORD + LOWEST_BIT(y);
+	  if (PTR_TO_GENERATION_INFO(WORD_TO_PTR(*pp)) != &generation_info[gn])
+	    continue;
+	  bits[k] &= ~((word_t) 1 << LOWEST_BIT(y));
+#ifdef GC_PROFILING
+	  current_rem_set_size--;
+#endif
+	}
+    }
+  free_rem_set(rem_set, generation_info[gn].rem_set_allocation_ptr);
+  generation_info[gn].rem_set = REM_SET_TAIL_COOKIE;
+}
+
+#else /* not REM_SET_BITMAP */
+
+/* Call `copy_referrer' for each referrer in the remembered sets of the
+   `number_of_from_gns' generations starting from `first_from_gn', and
+   free them. */
+static void scan_rem_sets(generation_number_t first_from_gn,
+			  int number_of_from_gns,
+			  void (*copy_referrer)(ptr_t))
+{
+  int i;
+  ptr_t p;
+  rem_set_t *rem_set;
+  generation_number_t gn;
+
   for (i = 0, gn = first_from_gn;
        i < number_of_from_gns;
        i++, gn = generation_info[gn].older) {
@@ -1619,7 +3237,7 @@ static int major_gc_step(void)
 	   `**p' necessarily has to be a pointer to a cell in `gn'. */
 	assert(PTR_TO_GENERATION_INFO(WORD_TO_PTR(*WORD_TO_PTR(*p))) ==
 	       &generation_info[gn]);
-	copy_cell(WORD_TO_PTR(*p));
+	copy_referrer(WORD_TO_PTR(*p));
       }
       for (rem_set = rem_set->next;
 	   rem_set != REM_SET_TAIL_COOKIE;
@@ -1629,15 +3247,43 @@ static int major_gc_step(void)
 	     p++) {
 	  assert(PTR_TO_GENERATION_INFO(WORD_TO_PTR(*WORD_TO_PTR(*p))) ==
 		 &generation_info[gn]);
-	  copy_cell(WORD_TO_PTR(*p));
+	  copy_referrer(WORD_TO_PTR(*p));
 	}
+#ifdef BACKGROUND_GC
+      if (is_shadow_forwarding)
+	/* The remembered set is scanned again when the referrers are
+	   redirected. */
+	continue;
+#endif
       free_rem_set(generation_info[gn].rem_set,
 		   generation_info[gn].rem_set_allocation_ptr);
       generation_info[gn].rem_set = REM_SET_TAIL_COOKIE;
       generation_info[gn].rem_set_allocation_ptr = NULL;
     }
   }
-  /* Scan the root set, first accu then others. */
+}
+
+
+/* Drop the remembered set of `gn' without visiting its referrers. */
+static void forget_rem_set(generation_number_t gn)
+{
+  free_rem_set(generation_info[gn].rem_set,
+	       generation_info[gn].rem_set_allocation_ptr);
+  generation_info[gn].rem_set = REM_SET_TAIL_COOKIE;
+  generation_info[gn].rem_set_allocation_ptr = NULL;
+}
+
+#endif /* not REM_SET_BITMAP */
+
+
+/* Call `copy_root' for each pointer in the root set, first accu then
+   others, and in the smart pointers that refers to a generation being
+   collected. */
+static void scan_major_gc_roots(void (*copy_root)(ptr_t))
+{
+  int i;
+  smart_ptr_t *sp;
+
   if ((GET_ROOT_WORD(suspended_accu_type) == PTR
        || GET_ROOT_WORD(suspended_accu_type) == NONNULL_PTR
        || (GET_ROOT_WORD(suspended_accu_type) == TAGGED
@@ -1646,14 +3292,14 @@ static int major_gc_step(void)
       && !is_in_first_generation(GET_ROOT_PTR(suspended_accu))
       && PTR_TO_GENERATION_INFO(GET_ROOT_PTR(suspended_accu))->status 
            == BEING_COLLECTED)
-    copy_cell(&root[ROOT_IX_suspended_accu]);
+    copy_root(&root[ROOT_IX_suspended_accu]);
   for (i = 0; i < NUMBER_OF_ROOT_IXS; i++)
     if (root_ix_is_ptr(i)
 	&& root[i] != NULL_WORD
 	&& !is_in_first_generation(WORD_TO_PTR(root[i]))
 	&& PTR_TO_GENERATION_INFO(WORD_TO_PTR(root[i]))->status
 	     == BEING_COLLECTED)
-      copy_cell(&root[i]);
+      copy_root(&root[i]);
   /* Scan the smart pointers. */
   for (sp = first_smart_ptr.next; sp != &first_smart_ptr; sp = sp->next) {
     assert(sp->next->prev == sp);
@@ -1661,23 +3307,225 @@ static int major_gc_step(void)
 	&& !is_in_first_generation(WORD_TO_PTR(sp->ptr))
 	&& PTR_TO_GENERATION_INFO(WORD_TO_PTR(sp->ptr))->status
 	     == BEING_COLLECTED)
-      copy_cell(&sp->ptr);
+      copy_root(&sp->ptr);
   }
-  /* Memorize the number of immediately copied cells.  It will later
-     be logged in the generation description. */
-  number_of_referring_ptrs = COPY_STACK_DEPTH;
-  /* Finally drain the copy stack. */
-  drain_copy_stack();
-  /* Finishing liturgy of garbage collections. */
-  finish_gc();
+}
+
+
+/* Let the generation `to_gn' take the place of the NORMAL generation
+   `gn', which the major collection passes over, in the list of
+   generations.  `to_gn' has the same memory pages, and `gn' is left
+   as if it had been collected to `to_gn'. */
+static void replace_passed_over_generation(generation_number_t gn)
+{
+  int i;
+  generation_number_t from_gn;
+
+  assert(generation_info[to_gn].npages == generation_info[gn].npages);
+  insert_generation_after(generation_info[gn].younger);
+  unlink_generation(gn);
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    assert(generation_info[to_gn].page[i] == generation_info[gn].page[i]);
+    page_info[generation_info[gn].page[i]].generation =
+      &generation_info[to_gn];
+    /* `to_gn' takes over the disk pages that were not rewritten. */
+    if (generation_info[to_gn].disk_page[i]
+	== generation_info[gn].disk_page[i])
+      generation_info[gn].disk_page[i] = INVALID_DISK_PAGE_NUMBER;
+  }
+  if (generation_info[gn].npages != 0)
+    free(generation_info[gn].page);
+  /* As in `mark_generation_collected_once'. */
+  generation_info[gn].status = COLLECTED_ONCE;
+  for (from_gn = generation_info[gn].from;
+       from_gn != INVALID_GENERATION_NUMBER;
+       from_gn = generation_info[from_gn].next_from)
+    mark_generation_collected_twice(from_gn);
+  generation_info[gn].next_from = INVALID_GENERATION_NUMBER;
+  generation_info[to_gn].from = gn;
+  generation_info[to_gn].shrinkage = generation_info[gn].shrinkage;
+  generation_info[to_gn].number_of_skips = generation_info[gn].number_of_skips;
+#ifdef TIERED_STORAGE
+  generation_info[to_gn].last_touch = generation_info[gn].last_touch;
+  generation_info[to_gn].last_eviction = generation_info[gn].last_eviction;
+  generation_info[to_gn].last_sampling = generation_info[gn].last_sampling;
+#endif
+}
+
+
+/* The number of dirty pages in the generation `gn'. */
+static int number_of_dirty_pages(generation_number_t gn)
+{
+  int i, n = 0;
+
+  for (i = 0; i < generation_info[gn].npages; i++)
+    if (page_info[generation_info[gn].page[i]].is_dirty)
+      n++;
+  return n;
+}
+
+
+/* Pass over the NORMAL generation `gn' in the major collection.
+   Instead of copying its cells, its pages are moved as such to a new
+   generation.  The dirty pages are written to disk again, because
+   recovery can not redo the redirections of the referrers in them if
+   they were last written before the previous round.  The new
+   generation takes over the disk pages of the other pages.  The
+   references to the older generations yet to be collected are
+   remembered as if it had been copied.  Returns the new
+   generation. */
+static generation_number_t pass_over_generation(generation_number_t gn)
+{
+  int i, npages = generation_info[gn].npages;
+  generation_number_t new_gn, saved_to_gn = to_gn;
+
+  allocate_generation();	/* Sets `to_gn'. */
+  new_gn = to_gn;
+  generation_info[new_gn].npages = npages;
+  if (npages != 0) {
+    generation_info[new_gn].page = malloc(npages * sizeof(page_number_t));
+    generation_info[new_gn].disk_page =
+      malloc(npages * sizeof(disk_page_number_t));
+    if (generation_info[new_gn].page == NULL
+	|| generation_info[new_gn].disk_page == NULL) {
+      fprintf(stderr,
+	      "pass_over_generation: malloc failed for %d pages.\n", npages);
+      exit(1);
+    }
+    memcpy(generation_info[new_gn].page, generation_info[gn].page,
+	   npages * sizeof(page_number_t));
+    for (i = 0; i < npages; i++)
+      generation_info[new_gn].disk_page[i] =
+	page_info[generation_info[gn].page[i]].is_dirty
+	? INVALID_DISK_PAGE_NUMBER : generation_info[gn].disk_page[i];
+  }
+  replace_passed_over_generation(gn);
+  /* This also reads back the evicted pages, which are never dirty. */
+  scan_generation_to_rem_sets(new_gn);
+  generation_info[new_gn].number_of_rewritten_pages =
+    number_of_dirty_pages(new_gn);
+  write_pages_of_to_gn(1);
+  /* The old generation number tells recovery which generation was
+     replaced. */
+  log_to_generation_pinfo_list(PASSED_OVER_GENERATION, gn);
+  to_gn = saved_to_gn;
+  return new_gn;
+}
+
+
+/* The first of the generations the current major gc step passes over,
+   i.e. the generation after its from-generations.  The step passes
+   over it and the following ones as long as they are NORMAL. */
+static generation_number_t first_generation_to_pass_over(void)
+{
+  generation_number_t gn;
+
+  for (gn = generation_info[to_gn].older;
+       gn != INVALID_GENERATION_NUMBER
+	 && generation_info[gn].status == BEING_COLLECTED;
+       gn = generation_info[gn].older)
+    ;
+  return gn;
+}
+
+
+/* Pass over the NORMAL generations from `gn' on as long as their
+   dirty pages, together with the `number_of_written_pages' the step
+   has already written, fit in what a step copies, and their
+   `generation_pinfo's fit in the first generation.  The rest are left
+   to the following steps in `next_gn_to_pass_over'.  At least one
+   generation is passed over if the step has written nothing else. */
+static void pass_over_generations(generation_number_t gn,
+				  unsigned long number_of_written_pages)
+{
+  unsigned long n = 0, ndirty;
+
+  next_gn_to_pass_over = INVALID_GENERATION_NUMBER;
+  number_of_passed_over_pages = 0;
+  for (;
+       gn != INVALID_GENERATION_NUMBER
+	 && generation_info[gn].status == NORMAL;
+       gn = generation_info[gn].older) {
+    ndirty = number_of_dirty_pages(gn);
+    if ((number_of_written_pages + number_of_passed_over_pages > 0
+	 && ((number_of_written_pages + number_of_passed_over_pages + ndirty)
+	     * PAGE_SIZE
+	     > first_generation_size * relative_mature_generation_size))
+	|| !can_allocate(4 + 2 * generation_info[gn].npages)) {
+      next_gn_to_pass_over = gn;
+      break;
+    }
+    n += generation_info[gn].npages;
+    number_of_passed_over_pages += ndirty;
+    gn = pass_over_generation(gn);
+  }
+  number_of_collected_pages += n;
+}
+
+
+/* Log the copied `to_gn', pass over the generations that follow its
+   from-generations but were not marked to be collected, and maintain
+   statistics.  The passed over generations are logged right after
+   `to_gn' so that recovery passes over them at the same point. */
+static void log_major_gc_step(int number_of_from_gns,
+			      int number_of_from_pages,
+			      unsigned long number_of_referring_ptrs)
+{
+  double shrinkage;
+
   log_to_generation_pinfo_list(number_of_from_gns, number_of_referring_ptrs);
+  pass_over_generations(first_generation_to_pass_over(),
+			generation_info[to_gn].npages);
   /* Maintain statistics. */
+  number_of_collected_pages += number_of_from_pages;
+  shrinkage = number_of_from_pages / (generation_info[to_gn].npages + 0.5);
+  generation_info[to_gn].shrinkage = shrinkage;
   {
     double ngens = db_size / (double) first_generation_size;
     avg_generation_shrinkage =
-      ((number_of_from_pages / (generation_info[to_gn].npages + 0.5))
-       + avg_generation_shrinkage * ngens) / (ngens + 1);
+      (shrinkage + avg_generation_shrinkage * ngens) / (ngens + 1);
+    recent_generation_shrinkage =
+      0.5 * recent_generation_shrinkage + 0.5 * shrinkage;
+  }
+}
+
+
+/* Peek a little ahead from `gn', the last generation a step copied or
+   passed over, past the generations that were passed over, to see
+   whether the major collection is finished.  Return 0 if it was, and
+   otherwise memorize where to continue from and return `effort'. */
+static int peek_major_gc(generation_number_t gn, int effort)
+{
+  prev_to_gn = gn;
+  for (gn = generation_info[gn].older;
+       gn != INVALID_GENERATION_NUMBER
+	 && gn != next_gn_to_pass_over
+	 && generation_info[gn].status == NORMAL;
+       gn = generation_info[gn].older)
+    prev_to_gn = gn;
+  if (gn == INVALID_GENERATION_NUMBER) {
+    /* Major collection is finished. */
+    prev_to_gn = INVALID_GENERATION_NUMBER;
+    if (must_show_groups)
+      fprintf(stderr, "{major gc done}");
+    return 0;
   }
+  assert(generation_info[gn].status == TO_BE_COLLECTED
+	 || gn == next_gn_to_pass_over);
+  return effort;
+}
+
+
+/* Free the from-generations of the step that copied them to
+   `step_to_gn'.  Return 0 if the major collection was finished, and
+   otherwise an estimate of how much gc effort was used. */
+static int end_major_gc_step(generation_number_t first_from_gn,
+			     int number_of_from_gns,
+			     generation_number_t step_to_gn)
+{
+  int i;
+  generation_number_t gn, tmp_gn;
+
   /* Free the old generations and their pages.  We couldn't do this
      earlier because it could have resulted in a non-recoverable page
      reuse pattern. */
@@ -1687,7 +3535,7 @@ static int major_gc_step(void)
   }
   /* Statistics. */
   if (must_show_groups) {
-    fprintf(stderr, "%d", generation_info[to_gn].npages);
+    fprintf(stderr, "%d", generation_info[step_to_gn].npages);
 #if 0
 #ifdef GC_PROFILING
     fprintf(stderr, ",\n  rem_set size is %d of top %d", 
@@ -1696,32 +3544,58 @@ static int major_gc_step(void)
 #endif
     fprintf(stderr, "}");
   }
-  /* Finally peek a little ahead to see whether we finished the major
-     collection. */
-  gn = generation_info[to_gn].older;
-  if (gn == INVALID_GENERATION_NUMBER
-      || generation_info[gn].status != TO_BE_COLLECTED) {
-    /* Major collection is finished. */
-    prev_to_gn = INVALID_GENERATION_NUMBER;
+  /* Finally see whether we finished the major collection, and if not,
+     return a guesstimate of how much work we did, the pages passed
+     over included. */
+  return peek_major_gc(step_to_gn,
+		       generation_info[step_to_gn].npages
+		       + number_of_passed_over_pages + 1);
+}
+
+
+/* Do a unit of mature generation garbage collection.  Return 0 if the
+   major collection was finished, and otherwise an estimate of how
+   much gc effort was used. */
+static int major_gc_step(void)
+{
+  int number_of_from_pages, number_of_from_gns;
+  unsigned long number_of_referring_ptrs;
+  generation_number_t first_from_gn;
+
+  if (next_gn_to_pass_over != INVALID_GENERATION_NUMBER) {
+    /* Only pass over the generations the previous step left.  They
+       must be done before older generations are collected, so that
+       recovery meets them in the same order. */
+    pass_over_generations(next_gn_to_pass_over, 0);
     if (must_show_groups)
-      fprintf(stderr, "{major gc done}");
-    return 0;
-  } else {
-    /* Major collection will continue, memorize where should continue
-       from and return an guesstimate of how much work we did. */
-    prev_to_gn = to_gn;
-    return generation_info[to_gn].npages + 1;
+      fprintf(stderr, "{passed over %lu}", number_of_passed_over_pages);
+    return peek_major_gc(prev_to_gn, number_of_passed_over_pages + 1);
   }
+  first_from_gn = start_major_gc_step(&number_of_from_gns,
+				      &number_of_from_pages);
+  /* Scan the remembered sets of the collected generations and the
+     root set. */
+  CLEAR_COPY_STACK;
+  scan_rem_sets(first_from_gn, number_of_from_gns, copy_rem_set_referrer);
+  scan_major_gc_roots(copy_cell);
+  /* Memorize the number of immediately copied cells.  It will later
+     be logged in the generation description. */
+  number_of_referring_ptrs = COPY_STACK_DEPTH;
+  /* Finally drain the copy stack. */
+  drain_copy_stack();
+  /* Finishing liturgy of garbage collections. */
+  finish_gc();
+  log_major_gc_step(number_of_from_gns, number_of_from_pages,
+		    number_of_referring_ptrs);
+  return end_major_gc_step(first_from_gn, number_of_from_gns, to_gn);
 }
 
 
 static int rvy_major_gc_step(int number_of_from_generations,
 			     unsigned long number_of_referring_ptrs)
 {
-  int i;
-  ptr_t p;
+  int i, number_of_from_pages;
   word_t w;
-  rem_set_t *rem_set;
   generation_number_t first_from_gn, gn, tmp_gn;
 
   /* Choose first generation to collect. */
@@ -1736,45 +3610,21 @@ static int rvy_major_gc_step(int number_of_from_generations,
   insert_generation_after(generation_info[first_from_gn].younger);
   /* Mark the from-generations to be collected. */
   gn = first_from_gn;
+  number_of_from_pages = 0;
   for (i = 0; i < number_of_from_generations; i++) {
     assert(generation_info[gn].status == TO_BE_COLLECTED);
     generation_info[gn].status = BEING_COLLECTED;
     generation_info[gn].next_from = generation_info[to_gn].from;
     generation_info[to_gn].from = gn;
+    number_of_from_pages += generation_info[gn].npages;
     gn = generation_info[gn].older;
   }
   /* `to_gn' actually behaves also as if it were being collected. */
   generation_info[to_gn].status = BEING_COLLECTED;
   /* Scan the remembered sets of the collected generations. */
   CLEAR_COPY_STACK;
-  for (i = 0, gn = first_from_gn;
-       i < number_of_from_generations;
-       i++, gn = generation_info[gn].older) {
-    rem_set = generation_info[gn].rem_set;
-    if (rem_set != REM_SET_TAIL_COOKIE) {
-      for (p = generation_info[gn].rem_set_allocation_ptr + 1;
-	   p < &rem_set->referrer[REM_SET_SIZE];
-	   p++) {
-	assert(PTR_TO_GENERATION_INFO(WORD_TO_PTR(*WORD_TO_PTR(*p))) ==
-	       &generation_info[gn]);
-	rvy_copy_cell(WORD_TO_PTR(*p));
-      }
-      for (rem_set = rem_set->next;
-	   rem_set != REM_SET_TAIL_COOKIE;
-	   rem_set = rem_set->next)
-	for (p = &rem_set->referrer[0];
-	     p < &rem_set->referrer[REM_SET_SIZE];
-	     p++) {
-	  assert(PTR_TO_GENERATION_INFO(WORD_TO_PTR(*WORD_TO_PTR(*p))) ==
-		 &generation_info[gn]);
-	  rvy_copy_cell(WORD_TO_PTR(*p));
-	}
-      free_rem_set(generation_info[gn].rem_set,
-		   generation_info[gn].rem_set_allocation_ptr);
-      generation_info[gn].rem_set = REM_SET_TAIL_COOKIE;
-      generation_info[gn].rem_set_allocation_ptr = NULL;
-    }
-  }
+  scan_rem_sets(first_from_gn, number_of_from_generations,
+		rvy_copy_rem_set_referrer);
   assert(COPY_STACK_DEPTH <= (signed) number_of_referring_ptrs);
   /* During recovery, this is equivalent to scanning the root block
      and the smart pointers. */
@@ -1791,6 +3641,8 @@ static int rvy_major_gc_step(int number_of_from_generations,
   /* Finish the gc. */
   rvy_finish_gc();
   generation_info[to_gn].status = NORMAL;
+  generation_info[to_gn].shrinkage =
+    number_of_from_pages / (generation_info[to_gn].npages + 0.5);
   /* Free old generations.  Identical to `major_gc_step'. */
   for (i = 0, gn = first_from_gn;
        i < number_of_from_generations; 
@@ -1799,7 +3651,9 @@ static int rvy_major_gc_step(int number_of_from_generations,
     mark_generation_collected_once(gn);
   }
   /* As in `major_gc_step', peek a little forward and return non-zero
-     if there's still major collection to do. */
+     if there's still major collection to do.  The generations that
+     were passed over are still marked here, see
+     `rvy_pass_over_generation'. */
   gn = generation_info[to_gn].older;
   if (gn == INVALID_GENERATION_NUMBER
       || generation_info[gn].status != TO_BE_COLLECTED) {
@@ -1812,123 +3666,1653 @@ static int rvy_major_gc_step(int number_of_from_generations,
 }
 
 
-/* Is the major collection currently active? */
-static int is_collecting = 0;
+/* Is the major collection currently active? */
+static int is_collecting = 0;
+
+
+#ifdef BACKGROUND_GC
+
+/* Background mature collection.
+
+   If `background_gc' is non-zero, `major_gc' leaves the mature
+   collection step to a background thread instead of doing it within
+   `flush_batch', unless memory is about to exhaust.  The step is
+   started at the end of one commit group and finished at the
+   beginning of the next one, before the first generation is
+   collected.  The generation log is thus the same as if
+   `major_gc_step' had been called at the end of the former commit
+   group, and `rvy_major_gc_step' recovers it as usual.
+
+   Meanwhile the mutator may read the cells of the from-generations,
+   and it changes the root block and the smart pointers.  Therefore
+   the background thread writes only to `to_gn', to remembered sets,
+   to the shadow pages (see `copy_cell') and to a snapshot of the
+   references from the root set that was taken when the step was
+   started.  `finish_background_gc_step' then installs the forward
+   pointers in the from-generations and redirects the referrers in
+   the remembered sets, the root block and the smart pointers.
+   References from the first generation are redirected while it is
+   collected, after which `retire_background_gc_step' can free the
+   from-generations.
+
+   The background thread reads `first_generation_allocation_ptr' in
+   `is_in_first_generation' while the mutator allocates.  This is
+   harmless, since none of the cells it copies is in the first
+   generation. */
+
+static pthread_mutex_t background_gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_gc_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t background_gc_done = PTHREAD_COND_INITIALIZER;
+/* Non-zero from `start_background_gc_step' to
+   `retire_background_gc_step'. */
+static int background_gc_step_is_pending = 0;
+
+/* The step being done in the background. */
+static generation_number_t background_gc_first_from_gn;
+static generation_number_t background_gc_to_gn;
+static int background_gc_number_of_from_gns;
+static int background_gc_number_of_from_pages;
+static unsigned long background_gc_number_of_referring_ptrs;
+
+/* The snapshot of the references from the root set to the
+   from-generations, in the order of `scan_major_gc_roots'. */
+static word_t *background_gc_root = NULL;
+static int number_of_background_gc_roots = 0;
+static int max_number_of_background_gc_roots = 0;
+
+/* The amount of words reserved from the first generation for the
+   `generation_pinfo' of the step, including red zones, and in
+   `background_gc_pinfo_reserve' also for the generations the step
+   passes over. */
+#define BACKGROUND_GC_PINFO_RESERVE  (2 * (4 + 2 * MAX_GENERATION_SIZE))
+static unsigned long background_gc_pinfo_reserve;
+
+#ifdef USE_REGS
+/* Global register variables are private to each thread. */
+static ptr_as_scalar_t background_gc_mem_base;
+#endif
+
+
+static void snapshot_background_gc_root(ptr_t pp)
+{
+  if (number_of_background_gc_roots == max_number_of_background_gc_roots) {
+    max_number_of_background_gc_roots =
+      2 * max_number_of_background_gc_roots + 64;
+    background_gc_root = 
+      realloc(background_gc_root,
+	      max_number_of_background_gc_roots * sizeof(word_t));
+    if (background_gc_root == NULL) {
+      fprintf(stderr, "snapshot_background_gc_root: `realloc' failed.\n");
+      exit(1);
+    }
+  }
+  background_gc_root[number_of_background_gc_roots++] = *pp;
+}
+
+
+#ifdef LAZY_RECOVERY
+
+/* Read the lazy pages that the background step will touch: those of
+   the generations it collects and those holding the referrers in
+   their remembered sets.  The other pages may stay lazy, since the
+   background thread copies only the cells of the collected
+   generations. */
+static void load_background_gc_pages(void)
+{
+  int i, j;
+  generation_number_t gn;
+  rem_set_t *rem_set;
+#ifdef REM_SET_BITMAP
+  unsigned long k;
+  word_t x;
+#else
+  ptr_t p;
+#endif
+
+  if (number_of_lazy_pages == 0)
+    return;
+  for (i = 0, gn = background_gc_first_from_gn;
+       i < background_gc_number_of_from_gns;
+       i++, gn = generation_info[gn].older) {
+    for (j = 0; j < generation_info[gn].npages; j++)
+      load_lazy_page(generation_info[gn].page[j]);
+    rem_set = generation_info[gn].rem_set;
+    if (rem_set == REM_SET_TAIL_COOKIE)
+      continue;
+#ifdef REM_SET_BITMAP
+    for (k = 0; k < rem_set_page_bitmap_size; k++)
+      for (x = rem_set[k]; x != 0; x &= x - 1)
+	load_lazy_page(k * REM_SET_BITS_PER_WORD + LOWEST_BIT(x));
+#else
+    for (p = generation_info[gn].rem_set_allocation_ptr + 1;
+	 p < &rem_set->referrer[REM_SET_SIZE];
+	 p++)
+      load_lazy_page(PTR_TO_PAGE_NUMBER(WORD_TO_PTR(*p)));
+    for (rem_set = rem_set->next;
+	 rem_set != REM_SET_TAIL_COOKIE;
+	 rem_set = rem_set->next)
+      for (p = &rem_set->referrer[0];
+	   p < &rem_set->referrer[REM_SET_SIZE];
+	   p++)
+	load_lazy_page(PTR_TO_PAGE_NUMBER(WORD_TO_PTR(*p)));
+#endif
+  }
+}
+
+#endif /* LAZY_RECOVERY */
+
+
+/* The equivalent of `major_gc_step' between `start_major_gc_step' and
+   `log_major_gc_step', called in the background thread. */
+static void copy_background_gc_step(void)
+{
+  int i;
+
+  /* Copy as in `major_gc_step'.  The shadow pages are allocated as
+     the cells are copied. */
+  CLEAR_COPY_STACK;
+  scan_rem_sets(background_gc_first_from_gn,
+		background_gc_number_of_from_gns,
+		copy_rem_set_referrer);
+  for (i = 0; i < number_of_background_gc_roots; i++)
+    copy_cell(&background_gc_root[i]);
+  background_gc_number_of_referring_ptrs = COPY_STACK_DEPTH;
+  drain_copy_stack();
+  finish_gc();
+}
+
+
+static void *background_gc_thread_main(void *arg)
+{
+#ifdef USE_REGS
+  mem_base = background_gc_mem_base;
+  /* No cell copied by the background thread is in the first
+     generation. */
+  first_generation_allocation_ptr = first_generation_start;
+  first_generation_end = first_generation_start;
+#endif
+  while (1) {
+    if (pthread_mutex_lock(&background_gc_lock)) {
+      perror("background_gc_thread_main/pthread_mutex_lock");
+      exit(1);
+    }
+    while (!background_gc_is_copying)
+      if (pthread_cond_wait(&background_gc_wakeup, &background_gc_lock)) {
+	perror("background_gc_thread_main/pthread_cond_wait");
+	exit(1);
+      }
+    if (pthread_mutex_unlock(&background_gc_lock)) {
+      perror("background_gc_thread_main/pthread_mutex_unlock");
+      exit(1);
+    }
+
+    copy_background_gc_step();
+
+    if (pthread_mutex_lock(&background_gc_lock)) {
+      perror("background_gc_thread_main/pthread_mutex_lock");
+      exit(1);
+    }
+    background_gc_is_copying = 0;
+    if (pthread_cond_signal(&background_gc_done)) {
+      perror("background_gc_thread_main/pthread_cond_signal");
+      exit(1);
+    }
+    if (pthread_mutex_unlock(&background_gc_lock)) {
+      perror("background_gc_thread_main/pthread_mutex_unlock");
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+
+/* Start a step of the major collection in the background.  Called at
+   the end of `flush_batch'. */
+static void start_background_gc_step(void)
+{
+  generation_number_t gn;
+  unsigned long npages;
+
+  assert(!background_gc_step_is_pending);
+  background_gc_first_from_gn =
+    start_major_gc_step(&background_gc_number_of_from_gns,
+			&background_gc_number_of_from_pages);
+#ifdef LAZY_RECOVERY
+  /* The background thread must not fault on lazy pages. */
+  load_background_gc_pages();
+#endif
+  background_gc_to_gn = to_gn;
+  number_of_background_gc_roots = 0;
+  scan_major_gc_roots(snapshot_background_gc_root);
+  /* Make sure the `generation_pinfo's of the step fit in the first
+     generation when the step is finished. */
+  background_gc_pinfo_reserve = BACKGROUND_GC_PINFO_RESERVE;
+  for (gn = first_generation_to_pass_over(), npages = 0;
+       gn != INVALID_GENERATION_NUMBER
+	 && generation_info[gn].status == NORMAL
+	 && npages * PAGE_SIZE
+	    <= first_generation_size * relative_mature_generation_size;
+       gn = generation_info[gn].older) {
+    /* At most one more generation than `pass_over_generations' does. */
+    npages += generation_info[gn].npages;
+    background_gc_pinfo_reserve += 2 * (4 + 2 * generation_info[gn].npages);
+  }
+  assert(first_generation_allocation_ptr - background_gc_pinfo_reserve
+	 >= first_generation_end);
+  first_generation_end += background_gc_pinfo_reserve;
+  is_shadow_forwarding = 1;
+  background_gc_step_is_pending = 1;
+  if (pthread_mutex_lock(&background_gc_lock)) {
+    perror("start_background_gc_step/pthread_mutex_lock");
+    exit(1);
+  }
+  background_gc_is_copying = 1;
+  if (pthread_cond_signal(&background_gc_wakeup)) {
+    perror("start_background_gc_step/pthread_cond_signal");
+    exit(1);
+  }
+  if (pthread_mutex_unlock(&background_gc_lock)) {
+    perror("start_background_gc_step/pthread_mutex_unlock");
+    exit(1);
+  }
+}
+
+
+/* Wait for the background thread to copy the step.  The thread also
+   writes the pages of the step to disk. */
+static void wait_for_background_gc_copy(void)
+{
+  if (pthread_mutex_lock(&background_gc_lock)) {
+    perror("wait_for_background_gc_copy/pthread_mutex_lock");
+    exit(1);
+  }
+  while (background_gc_is_copying)
+    if (pthread_cond_wait(&background_gc_done, &background_gc_lock)) {
+      perror("wait_for_background_gc_copy/pthread_cond_wait");
+      exit(1);
+    }
+  if (pthread_mutex_unlock(&background_gc_lock)) {
+    perror("wait_for_background_gc_copy/pthread_mutex_unlock");
+    exit(1);
+  }
+}
+
+
+/* Wait for the background thread to copy the step, then publish the
+   copied generation and log it.  Called at the beginning of
+   `flush_batch' before the first generation is collected. */
+static void finish_background_gc_step(void)
+{
+  int i, j;
+  unsigned long k, m, n;
+  ptr_t p, shadow;
+  page_number_t pn;
+  generation_number_t gn;
+
+  assert(background_gc_step_is_pending);
+  wait_for_background_gc_copy();
+  /* The forward pointers go to pages the commit thread may be
+     writing. */
+  wait_for_commit();
+  is_shadow_forwarding = 0;
+  assert(to_gn == background_gc_to_gn);
+  /* Install the forward pointers from the shadow pages, and free
+     them. */
+  for (i = 0, gn = background_gc_first_from_gn;
+       i < background_gc_number_of_from_gns;
+       i++, gn = generation_info[gn].older)
+    for (j = 0; j < generation_info[gn].npages; j++) {
+      pn = generation_info[gn].page[j];
+      shadow = shadow_page[pn];
+      if (shadow == NULL)
+	/* No cell of the page was copied. */
+	continue;
+      p = PAGE_NUMBER_TO_PAGE_PTR(pn);
+      n = PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn);
+      for (k = 1; k < (n + 1) / 2; k++)
+	if (shadow[k] != NULL_WORD) {
+	  m = 2 * k + (shadow[k] & 1);
+	  p[m] = FORWARD_POINTER_HEADER;
+	  p[m + 1] = SHADOW_WORD_TO_WORD(shadow[k]);
+	}
+      free(shadow);
+      shadow_page[pn] = NULL;
+    }
+  /* Redirect the referrers, now simply by following the forward
+     pointers.  The pages of the younger generations they reside in
+     were written before the previous root block. */
+  CLEAR_COPY_STACK;
+  scan_rem_sets(background_gc_first_from_gn,
+		background_gc_number_of_from_gns,
+		copy_rem_set_referrer);
+  scan_major_gc_roots(copy_cell);
+  assert(COPY_STACK_IS_EMPTY);
+  /* Release the reservation and log the step. */
+  first_generation_end -= background_gc_pinfo_reserve;
+  log_major_gc_step(background_gc_number_of_from_gns,
+		    background_gc_number_of_from_pages,
+		    background_gc_number_of_referring_ptrs);
+}
+
+
+/* Free the from-generations of the step.  Called in `flush_batch'
+   after the first generation has been collected. */
+static void retire_background_gc_step(void)
+{
+  assert(background_gc_step_is_pending);
+  if (end_major_gc_step(background_gc_first_from_gn,
+			background_gc_number_of_from_gns,
+			background_gc_to_gn) == 0)
+    /* Finished major gc. */
+    is_collecting = 0;
+  background_gc_step_is_pending = 0;
+}
+
+
+static void init_background_gc(void)
+{
+  shadow_page = calloc(number_of_pages, sizeof(ptr_t));
+  if (shadow_page == NULL) {
+    fprintf(stderr, "init_background_gc: `calloc' failed.\n");
+    exit(1);
+  }
+#ifdef USE_REGS
+  background_gc_mem_base = mem_base;
+#endif
+  if (pthread_create(&background_gc_thread, NULL, 
+		     background_gc_thread_main, NULL) != 0) {
+    perror("init_background_gc/pthread_create");
+    exit(1);
+  }
+}
+
+#endif /* BACKGROUND_GC */
+
+/* Pacing of the major collection.
+
+   `major_gc' schedules to each commit group just enough major gc
+   work for the collection to keep ahead of the allocation.  Each
+   commit group is expected to take `a' pages, the larger of the
+   previous commit group and the average, and each collected page to
+   free `g = 1 - 1 / s' pages, where `s' is the average shrinkage of
+   the generations or, during a collection, their recent shrinkage.
+   Collecting the remaining `w' pages of the collection at `q' pages
+   per commit group then leaves `f - (a - g q) w / q' of the `f' free
+   pages.  The quota
+   `q' is the least that keeps this above the `r' pages of
+   `max_gc_limit', i.e. `q = a w / (f - r + g w)'.  A collection is
+   started when its quota exceeds what half of `max_gc_effort'
+   achieves, or anyway when less than `start_gc_limit' bytes are
+   free. */
+
+/* Called in `flush_batch' with the number of pages of the new
+   generation. */
+static void note_pages_in_commit(unsigned long npages)
+{
+  pages_in_previous_commit = npages;
+  number_of_pages_since_major_gc += npages;
+  avg_pages_per_commit = 0.875 * avg_pages_per_commit + 0.125 * npages;
+}
+
+
+/* Store the statistics in the root block, and restore them from it
+   during recovery. */
+static void save_gc_statistics(void)
+{
+  SET_ROOT_WORD(avg_generation_shrinkage,
+		avg_generation_shrinkage * GC_STATISTICS_SCALE);
+  SET_ROOT_WORD(avg_pages_per_commit,
+		avg_pages_per_commit * GC_STATISTICS_SCALE);
+}
+
+static void restore_gc_statistics(void)
+{
+  avg_generation_shrinkage =
+    GET_ROOT_WORD(avg_generation_shrinkage) / GC_STATISTICS_SCALE;
+  avg_pages_per_commit =
+    GET_ROOT_WORD(avg_pages_per_commit) / GC_STATISTICS_SCALE;
+  pages_in_previous_commit = 0;
+  recent_generation_shrinkage = avg_generation_shrinkage;
+}
+
+
+/* The number of pages the next commit group is expected to take. */
+static double pages_per_commit(void)
+{
+  if (pages_in_previous_commit > avg_pages_per_commit)
+    return pages_in_previous_commit;
+  return avg_pages_per_commit > 1 ? avg_pages_per_commit : 1;
+}
+
+
+/* The number of pages still to be collected or passed over in the
+   current major collection, or if there is none, in the next one. */
+static unsigned long number_of_pages_to_collect(void)
+{
+  unsigned long n = 0;
+  generation_number_t gn = youngest_gn;
+
+  if (is_collecting)
+    /* Skip the generations committed, copied or passed over since the
+       collection started.  The NORMAL generations after them are yet
+       to be passed over. */
+    while (gn != INVALID_GENERATION_NUMBER
+	   && generation_info[gn].status != TO_BE_COLLECTED
+	   && gn != next_gn_to_pass_over)
+      gn = generation_info[gn].older;
+  for (; gn != INVALID_GENERATION_NUMBER; gn = generation_info[gn].older)
+    if (generation_info[gn].status == NORMAL
+	|| generation_info[gn].status == TO_BE_COLLECTED)
+      n += generation_info[gn].npages;
+  return n;
+}
+
+
+/* The number of pages to collect in each commit group for the
+   collection of `number_of_pages' more pages, expected to shrink by
+   `shrinkage', to complete before free memory runs out. */
+static double major_gc_quota(unsigned long number_of_pages, double shrinkage)
+{
+  double gain, room;
+
+  gain = shrinkage > 1 ? 1 - 1 / shrinkage : 0;
+  room = number_of_free_pages - max_gc_limit / (double) PAGE_SIZE
+    + gain * number_of_pages;
+  if (room <= pages_per_commit())
+    return number_of_pages;
+  return pages_per_commit() * number_of_pages / room;
+}
+
+
+/* Should a major collection be started? */
+static int major_gc_is_due(void)
+{
+  double shrinkage;
+
+  if (number_of_free_pages * PAGE_SIZE <= (unsigned) start_gc_limit)
+    return 1;
+  /* The gc effort is counted in written, i.e. copied pages. */
+  shrinkage = avg_generation_shrinkage > 1 ? avg_generation_shrinkage : 1;
+  return (major_gc_quota(number_of_pages_to_collect(), shrinkage)
+	  >= max_gc_effort / (2.0 * PAGE_SIZE) * shrinkage);
+}
+
+
+/* Should a major collection be started while the server is idle?
+   Besides when `major_gc_is_due', when the generations committed
+   since the previous collection started amount to the first
+   generation. */
+static int idle_major_gc_is_due(void)
+{
+  return (major_gc_is_due()
+	  || number_of_pages_since_major_gc * PAGE_SIZE
+	     >= (unsigned long) first_generation_size);
+}
+
+
+/* A driver-loop for the major collector.  If `is_idle', the
+   collection is started regardless of whether it is due, and only
+   one step is done in the foreground. */
+static void major_gc(int is_idle)
+{
+  unsigned long number_of_collected_pages_at_start;
+  double quota;
+  int effort = 0, effort_step, already_major_gc_stepped = 0;
+
+  if (!is_collecting) {
+    if (!is_idle && !major_gc_is_due())
+      return;
+    mark_major_gc_generations();
+    is_collecting = 1;
+    /* We just started the major collection.  Wait a little before
+       actually starting the work.  (The newest generation was just
+       collected, collecting it immediately again would be a wasted
+       effort.) */
+    return;
+  }
+
+  quota = major_gc_quota(number_of_pages_to_collect(),
+			 recent_generation_shrinkage);
+  number_of_collected_pages_at_start = number_of_collected_pages;
+  do {
+#ifdef BACKGROUND_GC
+    /* Unless the quota needs more than one step, leave the step to
+       the background thread. */
+    if (background_gc
+	&& !is_idle
+	&& !already_major_gc_stepped
+	&& next_gn_to_pass_over == INVALID_GENERATION_NUMBER
+	&& quota * PAGE_SIZE
+	   <= first_generation_size * relative_mature_generation_size
+	&& number_of_free_pages * PAGE_SIZE > (unsigned) max_gc_limit) {
+      start_background_gc_step();
+      return;
+    }
+#endif
+    /* If doing a second `major_gc_step' during the same commit batch,
+       we must somehow stabilize or copy for queueing those pages that
+       we wrote in the previous `major_gc_step' because we are going
+       to redirect some pointers (mutate) in those pages.  When idle,
+       the previous step may have been done in the latest commit
+       group after its root block was written. */
+    if (already_major_gc_stepped || is_idle)
+      io_allow_page_changes();
+    /* Likewise, the pages of the commit group may be still being
+       written. */
+    wait_for_commit();
+    already_major_gc_stepped = 1;
+    /* Now perform the `major_gc_step'. */
+    effort_step = major_gc_step();
+    if (effort_step == 0)
+      /* Finished major gc. */
+      is_collecting = 0;
+    effort += PAGE_SIZE * effort_step;
+  } while (is_collecting
+	   && !is_idle
+	   && effort < max_gc_effort
+	   && number_of_collected_pages - number_of_collected_pages_at_start
+	      < quota);
+
+  if (is_collecting
+      && !is_idle
+      && number_of_collected_pages - number_of_collected_pages_at_start
+	 < quota)
+    fprintf(stderr, "\n{Maximum GC speed reached.  Memory about to exhaust!}");
+}
+
+
+/* Collecting and committing the first generation; recovering new
+   generations. */
+
+/* Pretenuring.
+
+   The cells allocated with `allocate_mature' are placed on the pages
+   of `pretenured_gn', a generation that is not yet in the list of
+   generations.  `collect_first_generation' takes it as the new
+   generation and copies the survivors of the first generation to the
+   pages after the pretenured ones.  Each pretenured page is taken
+   from the first generation by moving `first_generation_end' until
+   the commit, so that the new generation still fits in
+   `MAX_GENERATION_SIZE' pages.
+
+   The pointers in the pretenured cells act as roots of the
+   collection of the first generation.  They are pushed to the copy
+   stack before the root block is scanned, in the order in which
+   `rvy_copy_cell' pushes them when `rvy_new_generation' replays the
+   pretenured cells as if copying them onto themselves.  The number
+   of pretenured pages is therefore stored above
+   `PRETENURED_PAGES_SHIFT' in the number of referring pointers of the
+   new generation. */
+
+static generation_number_t pretenured_gn = INVALID_GENERATION_NUMBER;
+
+/* The page pretenured cells are allocated from, the next free word in
+   it, and its end. */
+static page_number_t pretenured_pn;
+static ptr_t pretenured_ptr, pretenured_end;
+
+#define PRETENURED_PAGES_SHIFT  24
+#define PRETENURED_PAGES_MASK   0x7FUL
+
+
+/* Allocate a new page for pretenured cells, and `pretenured_gn' if
+   necessary. */
+static void new_pretenured_page(void)
+{
+  generation_number_t saved_to_gn = to_gn;
+
+#ifdef BACKGROUND_GC
+  /* The background thread allocates pages too, and reads the
+     `generation_info' that `allocate_generation' may move. */
+  if (background_gc_step_is_pending)
+    wait_for_background_gc_copy();
+#endif
+  if (pretenured_gn == INVALID_GENERATION_NUMBER) {
+    allocate_generation();
+    pretenured_gn = to_gn;
+  } else
+    PAGE_SET_NUMBER_OF_WORDS_IN_USE(pretenured_pn,
+				    pretenured_ptr
+				    - PAGE_NUMBER_TO_PAGE_PTR(pretenured_pn));
+  to_gn = pretenured_gn;
+  pretenured_pn = allocate_to_page();
+  to_gn = saved_to_gn;
+  pretenured_ptr = PAGE_NUMBER_TO_PAGE_PTR(pretenured_pn) + PAGE_HEADER_WORDS;
+  pretenured_end = PAGE_NUMBER_TO_PAGE_PTR(pretenured_pn)
+    + NUMBER_OF_WORDS_PER_PAGE;
+  first_generation_end += NUMBER_OF_WORDS_PER_PAGE;
+}
+
+
+int can_allocate_mature(int number_of_words)
+{
+  assert(number_of_words >= 2);
+  assert(number_of_words
+	 <= (signed) (NUMBER_OF_WORDS_PER_PAGE - PAGE_HEADER_WORDS));
+  if (pretenured_gn != INVALID_GENERATION_NUMBER
+      && pretenured_ptr + number_of_words <= pretenured_end)
+    return 1;
+  if (first_generation_allocation_ptr - NUMBER_OF_WORDS_PER_PAGE
+      < first_generation_end
+      || (pretenured_gn != INVALID_GENERATION_NUMBER
+	  && (generation_info[pretenured_gn].npages
+	      >= (signed) PRETENURED_PAGES_MASK)))
+    return 0;
+  new_pretenured_page();
+  return 1;
+}
+
+
+ptr_t allocate_mature(int number_of_words, cell_type_t type)
+{
+  ptr_t p = pretenured_ptr;
+
+  assert(pretenured_gn != INVALID_GENERATION_NUMBER);
+  assert(p + number_of_words <= pretenured_end);
+#ifdef ENABLE_BCPROF
+  number_of_words_allocated += number_of_words;
+#endif
+  pretenured_ptr += number_of_words;
+  *p = CELL_HEADER(type);
+  return p;
+}
+
+
+/* Call `copy_slot' for each pointer in the cells on the first
+   `npages' pages of `to_gn', i.e. on the pretenured pages, in the
+   order `rvy_copy_cell' pushes them. */
+static void scan_pretenured_cells(unsigned long npages,
+				  void (*copy_slot)(ptr_t))
+{
+  unsigned long i;
+  word_t p0;
+  ptr_t p, end;
+  page_number_t pn;
+
+  for (i = 0; i < npages; i++) {
+    pn = generation_info[to_gn].page[i];
+    p = PAGE_NUMBER_TO_PAGE_PTR(pn) + PAGE_HEADER_WORDS;
+    end = PAGE_NUMBER_TO_PAGE_PTR(pn) + PAGE_GET_NUMBER_OF_WORDS_IN_USE(pn);
+    while (p < end) {
+      p0 = p[0];
+      switch (CELL_TYPE(p)) {
+#define CELL(name, number_of_words, field_definition_block)	\
+      case CELL_ ## name:					\
+        field_definition_block;					\
+        p += (number_of_words);					\
+        break;
+#define DECLARE_WORD(x)				\
+        /* Do nothing. */
+#define DECLARE_PTR(x)				\
+        do {					\
+          if ((x) != NULL_WORD)			\
+	    copy_slot(&(x));			\
+        } while (0)
+#define DECLARE_NONNULL_PTR(x)			\
+        do {					\
+          assert((x) != NULL_WORD);		\
+	  copy_slot(&(x));			\
+        } while (0)
+#define DECLARE_TAGGED(x)				\
+        do {						\
+          if (TAGGED_IS_PTR(x) && (x) != NULL_WORD)	\
+	    copy_slot(&(x));				\
+        } while (0)
+
+#include "cells-def-prep.h"
+
+#undef CELL
+#undef DECLARE_TAGGED
+#undef DECLARE_PTR
+#undef DECLARE_NONNULL_PTR
+#undef DECLARE_WORD
+
+#ifndef NDEBUG
+      default:
+	abort();
+#endif
+      }
+    }
+    assert(p == end);
+  }
+}
+
+
+static void push_to_copy_stack(ptr_t pp)
+{
+  PUSH_TO_COPY_STACK(pp);
+}
+
+
+/* Start the collection of the first generation to a new `to_gn'.  If
+   cells have been pretenured, `to_gn' is `pretenured_gn'.  Returns
+   the number of pretenured pages. */
+static unsigned long start_new_generation(void)
+{
+  unsigned long npages = 0;
+
+  start_gc();
+  if (pretenured_gn == INVALID_GENERATION_NUMBER)
+    allocate_generation();
+  else {
+    to_gn = pretenured_gn;
+    pretenured_gn = INVALID_GENERATION_NUMBER;
+    npages = generation_info[to_gn].npages;
+    first_generation_end -= npages * NUMBER_OF_WORDS_PER_PAGE;
+    if (pretenured_ptr
+	== PAGE_NUMBER_TO_PAGE_PTR(pretenured_pn) + PAGE_HEADER_WORDS) {
+      /* `can_allocate_mature' took a page that was never used. */
+      free_page(pretenured_pn);
+      npages = --generation_info[to_gn].npages;
+      if (npages == 0) {
+	free(generation_info[to_gn].page);
+	free(generation_info[to_gn].disk_page);
+	generation_info[to_gn].page = NULL;
+	generation_info[to_gn].disk_page = NULL;
+      }
+    } else
+      PAGE_SET_NUMBER_OF_WORDS_IN_USE(pretenured_pn,
+				      pretenured_ptr
+				      - PAGE_NUMBER_TO_PAGE_PTR(pretenured_pn));
+    assert(npages <= PRETENURED_PAGES_MASK);
+  }
+  insert_generation_after(INVALID_GENERATION_NUMBER);
+  return npages;
+}
+
+#ifdef PARALLEL_GC
+
+static void par_copy_pretenured_slot(ptr_t pp)
+{
+  par_copy_cell(&gc_worker[0], pp);
+}
+
+
+/* The parallel version of `collect_first_generation'. */
+static unsigned long par_collect_first_generation(void)
+{
+  int i;
+  unsigned long number_of_pretenured_pages;
+  smart_ptr_t *sp;
+  gc_worker_t *w = &gc_worker[0];
+
+  number_of_pretenured_pages = start_new_generation();
+  for (i = 0; i < number_of_gc_workers; i++) {
+    gc_worker[i].top = gc_worker[i].bottom = 0;
+    gc_worker[i].to_pn = INVALID_PAGE_NUMBER;
+    gc_worker[i].to_ptr = gc_worker[i].to_end = NULL;
+    gc_worker[i].number_of_free_pages = 0;
+    gc_worker[i].npages = 0;
+  }
+  number_of_idle_gc_workers = 0;
+  /* Wake up the other workers.  They start stealing as soon as the
+     root set scanning below gives them something to steal. */
+  if (pthread_mutex_lock(&gc_workers_lock)) {
+    perror("par_collect_first_generation/pthread_mutex_lock");
+    exit(1);
+  }
+  number_of_running_gc_workers = number_of_gc_workers - 1;
+  gc_workers_round++;
+  if (pthread_cond_broadcast(&gc_workers_wakeup)) {
+    perror("par_collect_first_generation/pthread_cond_broadcast");
+    exit(1);
+  }
+  if (pthread_mutex_unlock(&gc_workers_lock)) {
+    perror("par_collect_first_generation/pthread_mutex_unlock");
+    exit(1);
+  }
+  /* Scan the pretenured cells and the root set as in
+     `collect_first_generation'. */
+  scan_pretenured_cells(number_of_pretenured_pages,
+			par_copy_pretenured_slot);
+  if ((GET_ROOT_WORD(suspended_accu_type) == PTR
+       || GET_ROOT_WORD(suspended_accu_type) == NONNULL_PTR
+       || (GET_ROOT_WORD(suspended_accu_type) == TAGGED
+	   && TAGGED_IS_PTR(GET_ROOT_WORD(suspended_accu))))
+      && GET_ROOT_WORD(suspended_accu) != NULL_WORD
+      && is_in_first_generation(GET_ROOT_PTR(suspended_accu)))
+    par_copy_cell(w, &root[ROOT_IX_suspended_accu]);
+  for (i = 0; i < NUMBER_OF_ROOT_IXS; i++)
+    if (root_ix_is_ptr(i)
+	&& root[i] != NULL_WORD
+	&& is_in_first_generation(WORD_TO_PTR(root[i])))
+      par_copy_cell(w, &root[i]);
+  for (sp = first_smart_ptr.next; sp != &first_smart_ptr; sp = sp->next) {
+    assert(sp->next->prev == sp);
+    if (sp->ptr != NULL_WORD
+	&& is_in_first_generation(WORD_TO_PTR(sp->ptr)))
+      par_copy_cell(w, &sp->ptr);
+  }
+  gc_worker_drain(w);
+  /* Wait for the other workers to notice the termination. */
+  if (pthread_mutex_lock(&gc_workers_lock)) {
+    perror("par_collect_first_generation/pthread_mutex_lock");
+    exit(1);
+  }
+  while (number_of_running_gc_workers > 0)
+    if (pthread_cond_wait(&gc_workers_done, &gc_workers_lock)) {
+      perror("par_collect_first_generation/pthread_cond_wait");
+      exit(1);
+    }
+  if (pthread_mutex_unlock(&gc_workers_lock)) {
+    perror("par_collect_first_generation/pthread_mutex_unlock");
+    exit(1);
+  }
+  /* Wrap up the to-pages of all workers. */
+  par_finish_to_pages();
+  if (is_collecting)
+    scan_generation_to_rem_sets(to_gn);
+  write_to_generation();
+  return GENERATION_WAS_COPIED_IN_PARALLEL;
+}
+
+#endif
+
+
+/* Collect the first generation and put the surviving cells in a new
+   mature generation, which is naturally assiged to `youngest_gn'.
+   Returns the number of pointers in the root block that refer to the
+   new generation. */
+static unsigned long collect_first_generation(void)
+{
+  int i;
+  unsigned long number_of_referring_ptrs, number_of_pretenured_pages;
+  smart_ptr_t *sp;
+
+#ifdef PARALLEL_GC
+  if (number_of_gc_workers > 1)
+    return par_collect_first_generation();
+#endif
+  number_of_pretenured_pages = start_new_generation();
+  /* Copy everything reachable from the pretenured cells and the root
+     set.  Naturally, there's no remembered set for the first
+     generation. */
+  CLEAR_COPY_STACK;
+  scan_pretenured_cells(number_of_pretenured_pages, push_to_copy_stack);
+  if ((GET_ROOT_WORD(suspended_accu_type) == PTR
+       || GET_ROOT_WORD(suspended_accu_type) == NONNULL_PTR
+       || (GET_ROOT_WORD(suspended_accu_type) == TAGGED
+	   && TAGGED_IS_PTR(GET_ROOT_WORD(suspended_accu))))
+      && GET_ROOT_WORD(suspended_accu) != NULL_WORD
+      && is_in_first_generation(GET_ROOT_PTR(suspended_accu)))
+    copy_cell(&root[ROOT_IX_suspended_accu]);
+  for (i = 0; i < NUMBER_OF_ROOT_IXS; i++)
+    if (root_ix_is_ptr(i)
+	&& root[i] != NULL_WORD
+	&& is_in_first_generation(WORD_TO_PTR(root[i])))
+      copy_cell(&root[i]);
+  /* Scan the smart ptr ring. */
+  for (sp = first_smart_ptr.next; sp != &first_smart_ptr; sp = sp->next) {
+    assert(sp->next->prev == sp);
+    if (sp->ptr != NULL_WORD
+	&& is_in_first_generation(WORD_TO_PTR(sp->ptr)))
+      copy_cell(&sp->ptr);
+  }
+  number_of_referring_ptrs = COPY_STACK_DEPTH;
+  drain_copy_stack();
+  finish_gc();
+  assert(number_of_referring_ptrs < 1UL << PRETENURED_PAGES_SHIFT);
+  return number_of_referring_ptrs
+    | number_of_pretenured_pages << PRETENURED_PAGES_SHIFT;
+}
+
+
+/* This is called for new mature generations (collected from first
+   generations instead of other mature generations) during recovery.  Its
+   main purpose is to construct the remembered sets of older mature
+   generations. */
+static void rvy_new_generation(unsigned long number_of_referring_ptrs)
+{
+  word_t w;
+  unsigned long i, number_of_pretenured_pages;
+
+  if (number_of_referring_ptrs & GENERATION_WAS_COPIED_IN_PARALLEL) {
+    scan_generation_to_rem_sets(to_gn);
+    return;
+  }
+  number_of_pretenured_pages =
+    number_of_referring_ptrs >> PRETENURED_PAGES_SHIFT
+    & PRETENURED_PAGES_MASK;
+  number_of_referring_ptrs &= (1UL << PRETENURED_PAGES_SHIFT) - 1;
+  rvy_start_gc();
+  /* Distinct from above, `to_gn' has already been allocated. */
+  generation_info[to_gn].status = BEING_COLLECTED;
+  CLEAR_COPY_STACK;
+  /* Push the pointers in the pretenured cells by copying the cells
+     onto themselves. */
+  for (i = 0; i < number_of_pretenured_pages; i++) {
+    rvy_next_to_page();
+    while (to_ptr < to_end) {
+      w = PTR_TO_WORD(to_ptr);
+      rvy_copy_cell(&w);
+    }
+  }
+  while (COPY_STACK_DEPTH < (signed) number_of_referring_ptrs) {
+    assert(to_ptr <= to_end);
+    if (to_ptr == to_end)
+      rvy_next_to_page();
+    w = PTR_TO_WORD(to_ptr);
+    rvy_copy_cell(&w);
+  }
+  rvy_drain_copy_stack();
+  rvy_finish_gc();
+  generation_info[to_gn].status = NORMAL;
+}
+
+
+/* Commit scheduling.
+
+   Unless the application closes the commit batch earlier, it is
+   closed when the first generation is full.  `commit_is_due' tells
+   when it should be closed earlier, and the interpreter asks it at
+   every context switch.  The batch is closed on either of two
+   grounds.  First, when it has been open for the commit deadline,
+   which bounds the latency of the transactions in it.  The batch is
+   regarded as opened at the end of the previous `flush_batch', or
+   after an idle period at the last call of `commit_is_due' that saw
+   no allocation in it.  Second, when its survivors are estimated
+   to exceed `commit_survivor_limit', which bounds the time
+   `flush_batch' spends in copying and writing them.  The survivors are
+   estimated from the words allocated in the batch and the survival
+   rate of the previous batches.
+
+   The commit latency of a batch is the time from its opening to the
+   end of its `flush_batch'.  If `commit_latency_target_usecs' is set,
+   the 99th percentile of the latency is computed over a window of
+   `COMMIT_LATENCY_WINDOW' batches, and the deadline is moved by half
+   of its difference to the target, within zero and
+   `commit_deadline_usecs'. */
+
+#define COMMIT_LATENCY_WINDOW  128
+
+static struct timeval commit_batch_opened;
+/* The allocation pointer at the end of the previous `flush_batch',
+   which leaves some metadata in the first generation. */
+static ptr_t commit_batch_start = NULL;
+static long commit_latency_usecs[COMMIT_LATENCY_WINDOW];
+static int number_of_commit_latencies = 0;
+static long commit_deadline = -1;
+/* The ratio of the survivors to the allocated words, averaged
+   exponentially over the previous batches. */
+static double commit_survival_rate = 1.0;
+
+
+static long usecs_since(struct timeval *tv)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - tv->tv_sec) * 1000000L + now.tv_usec - tv->tv_usec;
+}
+
+
+int commit_is_due(void)
+{
+  unsigned long number_of_allocated_words;
+
+  if (commit_batch_start == NULL
+      || commit_batch_start < first_generation_allocation_ptr) {
+    /* No `flush_batch' since the first generation was initialized or
+       recovered. */
+    commit_batch_start = first_generation_start;
+    gettimeofday(&commit_batch_opened, NULL);
+  }
+  number_of_allocated_words =
+    commit_batch_start - first_generation_allocation_ptr;
+  if (number_of_allocated_words == 0) {
+    if (commit_deadline_usecs > 0 || commit_latency_target_usecs > 0)
+      gettimeofday(&commit_batch_opened, NULL);
+    return 0;
+  }
+  if (commit_survivor_limit > 0
+      && number_of_allocated_words * sizeof(word_t) * commit_survival_rate
+         > commit_survivor_limit)
+    return 1;
+  if (commit_deadline_usecs > 0) {
+    if (commit_deadline == -1)
+      commit_deadline = commit_deadline_usecs;
+    if (usecs_since(&commit_batch_opened) >= commit_deadline)
+      return 1;
+  }
+  return 0;
+}
+
+
+static int compare_longs(const void *a, const void *b)
+{
+  return *(const long *) a < *(const long *) b ? -1
+    : *(const long *) a > *(const long *) b;
+}
+
+
+/* Maintain the commit statistics and tune the deadline after a batch
+   was committed by writing `number_of_written_words' words. */
+static void end_commit(unsigned long number_of_written_words)
+{
+  long latency, sorted[COMMIT_LATENCY_WINDOW];
+
+  number_of_commits++;
+  number_of_committed_words += number_of_written_words;
+  commit_batch_start = first_generation_allocation_ptr;
+  if (commit_deadline_usecs <= 0 && commit_latency_target_usecs <= 0)
+    return;
+
+  if (commit_batch_opened.tv_sec == 0)
+    /* The opening of the batch is not known. */
+    latency = -1;
+  else
+    latency = usecs_since(&commit_batch_opened);
+  /* The next batch is opened now, see `commit_is_due'. */
+  gettimeofday(&commit_batch_opened, NULL);
+  if (latency == -1)
+    return;
+  if (latency > max_commit_latency_usecs)
+    max_commit_latency_usecs = latency;
+  if (must_show_groups)
+    fprintf(stderr, "[%ld usecs latency] ", latency);
+  commit_latency_usecs[number_of_commit_latencies++] = latency;
+  if (number_of_commit_latencies < COMMIT_LATENCY_WINDOW)
+    return;
+  number_of_commit_latencies = 0;
+  memcpy(sorted, commit_latency_usecs, sizeof(sorted));
+  qsort(sorted, COMMIT_LATENCY_WINDOW, sizeof(long), compare_longs);
+  commit_latency_p99_usecs = sorted[COMMIT_LATENCY_WINDOW * 99 / 100];
+  if (commit_latency_target_usecs > 0 && commit_deadline_usecs > 0) {
+    commit_deadline += 
+      (commit_latency_target_usecs - commit_latency_p99_usecs) / 2;
+    if (commit_deadline < 0)
+      commit_deadline = 0;
+    if (commit_deadline > commit_deadline_usecs)
+      commit_deadline = commit_deadline_usecs;
+    if (must_show_groups)
+      fprintf(stderr, "[p99 %ld usecs, deadline now %ld usecs] ",
+	      commit_latency_p99_usecs, commit_deadline);
+  }
+}
+
+
+#ifdef PIPELINED_COMMIT
+/* The generations collected twice whose disk pages can be freed once
+   the commit group being written by the commit thread is on disk. */
+static generation_number_t generations_freed_after_commit =
+  INVALID_GENERATION_NUMBER;
+#endif
+
+/* Set if the root block written last is to be shipped to the hot
+   standbys once it is on disk, see `replica.h'. */
+static int commit_is_unshipped = 0;
+
+/* Ship the root block written last.  The disk pages it uses may not
+   be freed before, since the standbys still use the root block
+   shipped before it.  As in `start_backup', the background thread is
+   waited for first. */
+static void ship_commit(void)
+{
+  commit_is_unshipped = 0;
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    wait_for_background_gc_copy();
+#endif
+  replica_ship_commit();
+}
+
+/* Freeing the previous root block and the disk pages of the freed
+   generations would race with the background thread allocating disk
+   pages for its step, so it is waited for first. */
+void wait_for_commit(void)
+{
+#if defined(BACKGROUND_GC) && defined(PIPELINED_COMMIT)
+  if (background_gc_step_is_pending)
+    wait_for_background_gc_copy();
+#endif
+  io_wait_for_commit();
+  if (commit_is_unshipped)
+    ship_commit();
+#ifdef PIPELINED_COMMIT
+  mark_generations_nonexistent(generations_freed_after_commit);
+  generations_freed_after_commit = INVALID_GENERATION_NUMBER;
+#endif
+}
+
+
+/* The backup is of the root block written by `flush_batch'.  The
+   disk page allocation must not change under the IO system while it
+   pins or copies the pages, so the background thread, which writes
+   its pages to disk, is waited for first. */
+void start_backup(int fd, int is_incremental)
+{
+  flush_batch();
+  wait_for_commit();
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    wait_for_background_gc_copy();
+#endif
+  io_start_backup(fd, is_incremental);
+}
+
+
+int backup_step(unsigned long number_of_pages)
+{
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    wait_for_background_gc_copy();
+#endif
+  return io_backup_step(number_of_pages);
+}
+
+
+/* The backup read by `restore_backup'. */
+static int restored_backup_fd;
+
+static int read_restored_backup(void *ptr, unsigned long number_of_bytes)
+{
+  long n;
+
+  while (number_of_bytes > 0) {
+    n = read(restored_backup_fd, ptr, number_of_bytes);
+    if (n == -1) {
+      perror("read_restored_backup/read");
+      exit(1);
+    }
+    if (n == 0)
+      return 0;
+    ptr = (char *) ptr + n;
+    number_of_bytes -= n;
+  }
+  return 1;
+}
+
+void restore_backup(int fd)
+{
+  restored_backup_fd = fd;
+  if (!io_restore_backup(read_restored_backup)) {
+    fprintf(stderr, "restore_backup: The backup is truncated.\n");
+    exit(1);
+  }
+}
+
+
+/* Start a new pinfo list after a major gc round was started. */
+static void start_generation_pinfo_list(void)
+{
+  SET_ROOT_PTR(prev_prev_generation_pinfo_list,
+	       GET_ROOT_PTR(prev_generation_pinfo_list));
+  SET_ROOT_PTR(prev_generation_pinfo_list, 
+	       GET_ROOT_PTR(generation_pinfo_list));
+  SET_ROOT_PTR(generation_pinfo_list, NULL_PTR);
+}
+
+
+/* The delta log.
+
+   If `delta_log_filename' is given, `commit_batch' commits a batch by
+   appending a record to the delta log instead of collecting the first
+   generation.  The record contains the cells allocated in the first
+   generation since the previous commit, and the root block.  The
+   first generation thus stays in memory over several commits, until
+   `delta_log_checkpoint_size' bytes of it are in use.  Then
+   `commit_batch' does a normal `flush_batch', a checkpoint, and the
+   log is written again from its beginning.
+
+   The header of a record tells the time stamp of the root block of
+   the checkpoint, the sequence number of the record after the
+   checkpoint, and the extent of the cells as distances in words from
+   `first_generation_start'.  Recovery first recovers the checkpoint as
+   usual, and then replays the records of the checkpoint in sequence
+   until one is missing, torn, or of another checkpoint.  Replaying a
+   record copies the cells to their places and the root block over
+   `root'.
+
+   The records refer to the memory image left by the checkpoint, so
+   recovery must reproduce it exactly.  Recovery would not redo a
+   major gc step after the root block the same way, so a checkpoint
+   that did one does not start the log, and the next commit is a
+   checkpoint too.  A checkpoint that left the step to the background
+   thread does start the log: until the next checkpoint finishes the
+   step, the thread changes nothing the mutator or the records see
+   (see the background mature collection above), and recovery does
+   the step anew.  The first record
+   tells whether the checkpoint started a new pinfo list, which
+   recovery does not do on its own, and the checksum of the first
+   generation after the checkpoint, which recovery verifies.  Cells
+   must not be changed in place once they are in the log, see
+   `first_generation_logged_ptr'.  The records are in the byte order
+   of the machine. */
+
+#define DELTA_COOKIE			0
+#define DELTA_TIME_STAMP_HI		1
+#define DELTA_TIME_STAMP_LO		2
+#define DELTA_SEQUENCE			3
+#define DELTA_TOP			4
+#define DELTA_BOTTOM			5
+#define DELTA_FLAGS			6
+#define DELTA_CHECKPOINT_CHECKSUM	7
+#define DELTA_CHECKSUM			8
+#define DELTA_LOG_HEADER_WORDS		9
+
+/* Flags in the first record. */
+#define DELTA_MAJOR_GC_WAS_STARTED	1
+
+#define ROOT_BLOCK_WORDS  (DISK_BLOCK_SIZE / sizeof(word_t))
+
+static int delta_log_is_open = 0;
+/* The header of the next record, as far as it is known. */
+static word_t delta_log_header[DELTA_LOG_HEADER_WORDS];
+/* The offset of the next record in the log. */
+static unsigned long delta_log_offset;
+
+
+/* Start a new delta log after a checkpoint.  `flags' tells what the
+   checkpoint did.  The caller moves the offset of the log. */
+static void start_delta_log(word_t flags)
+{
+  delta_log_header[DELTA_COOKIE] = DELTA_LOG_COOKIE;
+  delta_log_header[DELTA_TIME_STAMP_HI] = GET_ROOT_WORD(time_stamp_hi);
+  delta_log_header[DELTA_TIME_STAMP_LO] = GET_ROOT_WORD(time_stamp_lo);
+  delta_log_header[DELTA_SEQUENCE] = 0;
+  delta_log_header[DELTA_FLAGS] = flags;
+  delta_log_header[DELTA_CHECKPOINT_CHECKSUM] =
+    crc32c(0, first_generation_allocation_ptr,
+	   first_generation_start - first_generation_allocation_ptr);
+  delta_log_offset = 0;
+  first_generation_logged_ptr = first_generation_allocation_ptr;
+}
+
+
+static word_t delta_log_record_checksum(ptr_t header, ptr_t cells,
+					ptr_t root_block)
+{
+  word_t crc;
+
+  crc = crc32c(0, header, DELTA_CHECKSUM);
+  crc = crc32c(crc, cells, header[DELTA_BOTTOM] - header[DELTA_TOP]);
+  return crc32c(crc, root_block, ROOT_BLOCK_WORDS);
+}
+
+
+/* Read the next record of the current checkpoint from the delta log.
+   Returns zero if there is none. */
+static int read_delta_log_record(ptr_t header, ptr_t *cells,
+				 ptr_t root_block)
+{
+  unsigned long n;
+
+  if (io_read_delta_log(header, DELTA_LOG_HEADER_WORDS * sizeof(word_t))
+      != DELTA_LOG_HEADER_WORDS * sizeof(word_t)
+      || header[DELTA_COOKIE] != DELTA_LOG_COOKIE
+      || header[DELTA_TIME_STAMP_HI] != delta_log_header[DELTA_TIME_STAMP_HI]
+      || header[DELTA_TIME_STAMP_LO] != delta_log_header[DELTA_TIME_STAMP_LO]
+      || header[DELTA_SEQUENCE] != delta_log_header[DELTA_SEQUENCE]
+      || header[DELTA_TOP] >= header[DELTA_BOTTOM]
+      || header[DELTA_BOTTOM] > NUMBER_OF_WORDS_IN_FIRST_GENERATION)
+    return 0;
+  n = header[DELTA_BOTTOM] - header[DELTA_TOP];
+  *cells = realloc(*cells, n * sizeof(word_t));
+  if (*cells == NULL) {
+    fprintf(stderr, "read_delta_log_record: `realloc' failed.\n");
+    exit(1);
+  }
+  if (io_read_delta_log(*cells, n * sizeof(word_t)) != n * sizeof(word_t)
+      || io_read_delta_log(root_block, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE
+      || header[DELTA_CHECKSUM]
+         != delta_log_record_checksum(header, *cells, root_block))
+    return 0;
+  return 1;
+}
+
+
+/* Finish the recovery of the checkpoint and replay the delta log.
+   Called at the end of `recover_db' instead of doing what
+   `flush_batch' does after writing the root block. */
+static void rvy_delta_log(unsigned long number_of_referring_ptrs)
+{
+  word_t header[DELTA_LOG_HEADER_WORDS];
+  word_t root_block[ROOT_BLOCK_WORDS];
+  ptr_t cells = NULL;
+  int has_record;
+  unsigned long number_of_records = 0;
+
+  delta_log_header[DELTA_TIME_STAMP_HI] = GET_ROOT_WORD(time_stamp_hi);
+  delta_log_header[DELTA_TIME_STAMP_LO] = GET_ROOT_WORD(time_stamp_lo);
+  delta_log_header[DELTA_SEQUENCE] = 0;
+  io_seek_delta_log(0);
+  has_record = read_delta_log_record(header, &cells, root_block);
+  /* Do as the checkpoint did. */
+  clear_first_generation();
+  if (has_record && (header[DELTA_FLAGS] & DELTA_MAJOR_GC_WAS_STARTED)) {
+    major_gc_was_started = 0;
+    mark_twice_collected_generations_nonexistent();
+    start_generation_pinfo_list();
+  }
+  log_to_generation_pinfo_list(0, number_of_referring_ptrs);
+  /* The checkpoint did no major gc step, and starting one here could
+     move cells the records refer to.  The next commit does the rest. */
+  start_delta_log(has_record ? header[DELTA_FLAGS] : 0);
+  if (has_record
+      && (first_generation_start - header[DELTA_TOP]
+	    != first_generation_allocation_ptr
+	  || header[DELTA_CHECKPOINT_CHECKSUM]
+	     != delta_log_header[DELTA_CHECKPOINT_CHECKSUM])) {
+    fprintf(stderr,
+	    "rvy_delta_log: The delta log does not match the checkpoint.\n");
+    exit(1);
+  }
+
+  while (has_record
+	 && first_generation_start - header[DELTA_TOP]
+	    == first_generation_logged_ptr) {
+    first_generation_allocation_ptr =
+      first_generation_start - header[DELTA_BOTTOM];
+    memcpy(first_generation_allocation_ptr, cells,
+	   (header[DELTA_BOTTOM] - header[DELTA_TOP]) * sizeof(word_t));
+    memcpy(root, root_block, DISK_BLOCK_SIZE);
+    first_generation_logged_ptr = first_generation_allocation_ptr;
+    delta_log_offset +=
+      (DELTA_LOG_HEADER_WORDS + header[DELTA_BOTTOM] - header[DELTA_TOP]
+       + ROOT_BLOCK_WORDS) * sizeof(word_t);
+    delta_log_header[DELTA_SEQUENCE]++;
+    number_of_records++;
+    has_record = read_delta_log_record(header, &cells, root_block);
+  }
+#ifndef NDEBUG
+  first_generation_can_allocate_ptr = first_generation_allocation_ptr;
+#endif
+  /* Append after the last record replayed. */
+  io_seek_delta_log(delta_log_offset);
+  free(cells);
+  if (be_verbose)
+    fprintf(stderr, "rvy_delta_log: Replayed %lu commits.\n",
+	    number_of_records);
+}
+
+
+void commit_batch(void)
+{
+  ptr_t ptrs[3];
+  unsigned long number_of_bytes[3], n;
+
+  /* The header is valid only after a checkpoint that started the
+     log. */
+  if (!delta_log_is_open
+      || delta_log_header[DELTA_COOKIE] != DELTA_LOG_COOKIE
+      /* Pretenured cells are only in the next checkpoint. */
+      || pretenured_gn != INVALID_GENERATION_NUMBER
+      || ((first_generation_start - first_generation_allocation_ptr)
+	  * sizeof(word_t)
+	  >= (unsigned long) delta_log_checkpoint_size)) {
+    flush_batch();
+    return;
+  }
+  n = first_generation_logged_ptr - first_generation_allocation_ptr;
+  if (n == 0)
+    /* Nothing has been allocated, as in `flush_batch'. */
+    return;
+  /* The record refers to the checkpoint, so that must be on disk. */
+  wait_for_commit();
+  delta_log_header[DELTA_TOP] =
+    first_generation_start - first_generation_logged_ptr;
+  delta_log_header[DELTA_BOTTOM] =
+    first_generation_start - first_generation_allocation_ptr;
+  delta_log_header[DELTA_CHECKSUM] =
+    delta_log_record_checksum(delta_log_header,
+			      first_generation_allocation_ptr, root);
+  ptrs[0] = delta_log_header;
+  number_of_bytes[0] = DELTA_LOG_HEADER_WORDS * sizeof(word_t);
+  ptrs[1] = first_generation_allocation_ptr;
+  number_of_bytes[1] = n * sizeof(word_t);
+  ptrs[2] = root;
+  number_of_bytes[2] = DISK_BLOCK_SIZE;
+  io_write_delta_log(ptrs, number_of_bytes, 3);
+  delta_log_offset +=
+    number_of_bytes[0] + number_of_bytes[1] + number_of_bytes[2];
+  delta_log_header[DELTA_SEQUENCE]++;
+  first_generation_logged_ptr = first_generation_allocation_ptr;
+  if (must_show_groups)
+    fprintf(stderr, "[%lu words logged] ", n);
+  end_commit(n);
+  if (must_show_groups)
+    fprintf(stderr, "\n");
+}
 
-/* A driver-loop for the major collector. */
-static void major_gc(int is_idle)
+
+#ifdef TIERED_STORAGE
+
+/* Tiered storage.
+
+   If `max_resident_size' is set, `flush_batch' keeps the pages of the
+   NORMAL mature generations resident in memory to at most about that
+   many bytes.  The pages least recently touched are evicted: their
+   memory is given back to the system and they are left lazy as in
+   lazy recovery, to be read back from their disk pages when next
+   touched.  `db_size' then only bounds the address space of the
+   database, not the memory it needs.
+
+   Touches of resident pages are not seen as such, so they are
+   sampled as in the clock algorithm.  When too much is resident,
+   `sample_generation' protects the clean resident pages of the
+   generations touched longest ago but keeps their contents.  The
+   next touch of such a page only lifts the protection and marks its
+   generation touched.  In a later commit, the pages that are still
+   protected are evicted.  Pages that are touched between every two
+   commits are thus never evicted, even if they need more than
+   `max_resident_size', since they would only be read straight back.
+
+   A page is sampled, and so evicted, only if it is still as it was
+   written to disk, i.e. it is not dirty.  The major gc redirects
+   referrers in pages written earlier, and those pages stay resident
+   until their generation is collected or passed over again.  As in
+   lazy recovery, the background gc thread must not fault, so nothing
+   is evicted or sampled while it collects, and the lazy pages that a
+   background step touches are read back when it starts. */
+
+/* Called when an evicted or sampled page of the generation is
+   touched. */
+static void touch_generation(page_number_t pn)
 {
-  unsigned long free_mem;
-  int effort = 0, effort_step, already_major_gc_stepped = 0;
+  if (page_info[pn].generation != NULL)
+    page_info[pn].generation->last_touch = number_of_commits;
+}
 
-  if (!is_idle 
-      && !is_collecting
-      && number_of_free_pages * PAGE_SIZE > (unsigned) start_gc_limit)
-    return;
 
-  do {
-    if (!is_collecting) {
-      mark_major_gc_generations();
-      is_collecting = 1;
-      /* We just started the major collection.  Wait a little before
-	 actually starting the work.  (The newest generation was just
-	 collected, collecting it immediately again would be a wasted
-	 effort.) */
-      return;
-    }
-    /* If doing a second `major_gc_step' during the same commit batch,
-       we must somehow stabilize or copy for queueing those pages that
-       we wrote in the previous `major_gc_step' because we are going
-       to redirect some pointers (mutate) in those pages. */
-    if (already_major_gc_stepped)
-      io_allow_page_changes();
-    already_major_gc_stepped = 1;
-    /* Now perform the `major_gc_step'. */
-    effort_step = major_gc_step();
-    if (effort_step == 0)
-      /* Finished major gc. */
-      is_collecting = 0;
-    /* The six lines below implement a heuristic for scheduling major
-       gc work.  These may be subject to frequent changes and tweaking. */
-    effort += PAGE_SIZE * effort_step;
-    free_mem = number_of_free_pages * PAGE_SIZE;
-  } while (effort < max_gc_effort
-	   && free_mem < (unsigned long) start_gc_limit
-	   && (effort * (double) (start_gc_limit - max_gc_limit) 
-	         < max_gc_effort * (double) (start_gc_limit - free_mem)));
+/* Protect the clean resident pages of `gn' so that the next touch of
+   any of them is noticed.  Return the number of pages protected. */
+static unsigned long sample_generation(generation_number_t gn)
+{
+  int i;
+  unsigned long n = 0;
+  page_number_t pn;
 
-  if (effort >= max_gc_effort)
-    fprintf(stderr, "\n{Maximum GC speed reached.  Memory about to exhaust!}");
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    pn = generation_info[gn].page[i];
+    if (page_info[pn].is_dirty
+	|| lazy_disk_page[pn] != INVALID_DISK_PAGE_NUMBER)
+      continue;
+    lock_lazy_pages();
+    protect_page(pn, PROT_NONE);
+    lazy_disk_page[pn] = generation_info[gn].disk_page[i];
+    page_info[pn].is_sampled = 1;
+    number_of_lazy_pages++;
+    unlock_lazy_pages();
+    n++;
+  }
+  generation_info[gn].last_sampling = number_of_commits;
+  return n;
 }
 
-
-/* Collecting and committing the first generation; recovering new
-   generations. */
 
-/* Collect the first generation and put the surviving cells in a new
-   mature generation, which is naturally assiged to `youngest_gn'.
-   Returns the number of pointers in the root block that refer to the
-   new generation. */
-static unsigned long collect_first_generation(void)
+/* Evict the pages of `gn' that were sampled and have not been touched
+   since.  Return the number of pages evicted. */
+static unsigned long evict_generation(generation_number_t gn)
 {
   int i;
-  unsigned long number_of_referring_ptrs;
-  smart_ptr_t *sp;
+  unsigned long n = 0;
+  page_number_t pn;
 
-  start_gc();
-  allocate_generation();
-  insert_generation_after(INVALID_GENERATION_NUMBER);
-  /* Copy everything reachable from the root set.  Naturally, there's
-     no remembered set for the first generation. */
-  CLEAR_COPY_STACK;
-  if ((GET_ROOT_WORD(suspended_accu_type) == PTR
-       || GET_ROOT_WORD(suspended_accu_type) == NONNULL_PTR
-       || (GET_ROOT_WORD(suspended_accu_type) == TAGGED
-	   && TAGGED_IS_PTR(GET_ROOT_WORD(suspended_accu))))
-      && GET_ROOT_WORD(suspended_accu) != NULL_WORD
-      && is_in_first_generation(GET_ROOT_PTR(suspended_accu)))
-    copy_cell(&root[ROOT_IX_suspended_accu]);
-  for (i = 0; i < NUMBER_OF_ROOT_IXS; i++)
-    if (root_ix_is_ptr(i)
-	&& root[i] != NULL_WORD
-	&& is_in_first_generation(WORD_TO_PTR(root[i])))
-      copy_cell(&root[i]);
-  /* Scan the smart ptr ring. */
-  for (sp = first_smart_ptr.next; sp != &first_smart_ptr; sp = sp->next) {
-    assert(sp->next->prev == sp);
-    if (sp->ptr != NULL_WORD
-	&& is_in_first_generation(WORD_TO_PTR(sp->ptr)))
-      copy_cell(&sp->ptr);
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    pn = generation_info[gn].page[i];
+    if (!page_info[pn].is_sampled)
+      continue;
+    lock_lazy_pages();
+    /* The page reader may have lifted the protection meanwhile. */
+    if (!page_info[pn].is_sampled) {
+      unlock_lazy_pages();
+      continue;
+    }
+    page_info[pn].is_sampled = 0;
+    unlock_lazy_pages();
+    if (madvise((void *) PAGE_NUMBER_TO_PAGE_PTR(pn), PAGE_SIZE,
+		MADV_DONTNEED)) {
+      perror("evict_generation/madvise");
+      exit(1);
+    }
+    n++;
   }
-  number_of_referring_ptrs = COPY_STACK_DEPTH;
-  drain_copy_stack();
-  finish_gc();
-  return number_of_referring_ptrs;
+  return n;
 }
 
 
-/* This is called for new mature generations (collected from first
-   generations instead of other mature generations) during recovery.  Its
-   main purpose is to construct the remembered sets of older mature
-   generations. */
-static void rvy_new_generation(unsigned long number_of_referring_ptrs)
+/* Evict the pages sampled in earlier commits and not touched since,
+   from the generations least recently touched first, until at most
+   `max_resident_size' bytes of the NORMAL generations are resident.
+   If that is not enough, sample the generations least recently
+   touched until the rest could be evicted at a later commit. */
+static void evict_cold_generations(void)
 {
-  word_t w;
+  unsigned long n, number_of_resident_pages = 0, number_of_sampled_pages = 0,
+    number_of_evicted_pages = 0, number_of_newly_sampled_pages = 0;
+  generation_number_t gn, coldest_gn;
+  page_number_t pn;
+  int i;
 
-  rvy_start_gc();
-  /* Distinct from above, `to_gn' has already been allocated. */
-  generation_info[to_gn].status = BEING_COLLECTED;
-  CLEAR_COPY_STACK;
-  while (COPY_STACK_DEPTH < (signed) number_of_referring_ptrs) {
-    assert(to_ptr <= to_end);
-    if (to_ptr == to_end)
-      rvy_next_to_page();
-    w = PTR_TO_WORD(to_ptr);
-    rvy_copy_cell(&w);
+#ifdef BACKGROUND_GC
+  if (background_gc && is_collecting)
+    return;
+#endif
+  for (gn = youngest_gn;
+       gn != INVALID_GENERATION_NUMBER;
+       gn = generation_info[gn].older)
+    if (generation_info[gn].status == NORMAL)
+      for (i = 0; i < generation_info[gn].npages; i++) {
+	pn = generation_info[gn].page[i];
+	if (lazy_disk_page[pn] == INVALID_DISK_PAGE_NUMBER)
+	  number_of_resident_pages++;
+	else if (page_info[pn].is_sampled) {
+	  number_of_resident_pages++;
+	  number_of_sampled_pages++;
+	}
+      }
+  if (number_of_resident_pages * PAGE_SIZE <= (unsigned) max_resident_size)
+    return;
+
+  /* The pages to evict must be readable from disk. */
+  io_allow_page_changes();
+  while (number_of_resident_pages * PAGE_SIZE > (unsigned) max_resident_size) {
+    coldest_gn = INVALID_GENERATION_NUMBER;
+    for (gn = youngest_gn;
+	 gn != INVALID_GENERATION_NUMBER;
+	 gn = generation_info[gn].older)
+      if (generation_info[gn].status == NORMAL
+	  && generation_info[gn].last_sampling < number_of_commits
+	  && generation_info[gn].last_eviction != number_of_commits
+	  && (coldest_gn == INVALID_GENERATION_NUMBER
+	      || generation_info[gn].last_touch
+	         < generation_info[coldest_gn].last_touch))
+	coldest_gn = gn;
+    if (coldest_gn == INVALID_GENERATION_NUMBER)
+      break;
+    generation_info[coldest_gn].last_eviction = number_of_commits;
+    n = evict_generation(coldest_gn);
+    number_of_resident_pages -= n;
+    number_of_sampled_pages -= n;
+    number_of_evicted_pages += n;
   }
-  rvy_drain_copy_stack();
-  rvy_finish_gc();
-  generation_info[to_gn].status = NORMAL;
+
+  while ((number_of_resident_pages - number_of_sampled_pages) * PAGE_SIZE
+	 > (unsigned) max_resident_size) {
+    coldest_gn = INVALID_GENERATION_NUMBER;
+    for (gn = youngest_gn;
+	 gn != INVALID_GENERATION_NUMBER;
+	 gn = generation_info[gn].older)
+      if (generation_info[gn].status == NORMAL
+	  && generation_info[gn].last_sampling != number_of_commits
+	  && (coldest_gn == INVALID_GENERATION_NUMBER
+	      || generation_info[gn].last_touch
+	         < generation_info[coldest_gn].last_touch))
+	coldest_gn = gn;
+    if (coldest_gn == INVALID_GENERATION_NUMBER)
+      break;
+    n = sample_generation(coldest_gn);
+    number_of_sampled_pages += n;
+    number_of_newly_sampled_pages += n;
+  }
+  if (must_show_groups
+      && number_of_evicted_pages + number_of_newly_sampled_pages > 0)
+    fprintf(stderr, "[%lu pages evicted, %lu sampled] ",
+	    number_of_evicted_pages, number_of_newly_sampled_pages);
+}
+
+#endif /* TIERED_STORAGE */
+
+
+/* Idle-time mature garbage collection.
+
+   The interpreter calls `idle_gc_step' when it has no runnable
+   threads, and calls it again only after polling for work without
+   waiting, so that arriving work preempts the collection after at
+   most one step.  A step redirects only the pointers in the
+   remembered sets and the root block, so it is done right after a
+   commit, when the first generation holds at most the metadata of
+   the previous idle step.  Committing that metadata adds no data to
+   the database, and it is therefore not counted in
+   `number_of_pages_since_major_gc', lest an idle server keep
+   collecting its own commits.
+
+   The first generation is at `idle_gc_flush_ptr' right after a
+   `flush_batch', and at `idle_gc_step_ptr' right after an idle step
+   or the start of a collection. */
+static ptr_t idle_gc_flush_ptr = NULL;
+static ptr_t idle_gc_step_ptr = NULL;
+
+int idle_gc_step(void)
+{
+  unsigned long npages;
+
+  if (!idle_gc || (!is_collecting && !idle_major_gc_is_due()))
+    return 0;
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending && background_gc_is_copying)
+    /* Don't block waiting for the background thread.  A stale value
+       only delays the step or makes `flush_batch' wait briefly. */
+    return 0;
+#endif
+  if (first_generation_allocation_ptr == idle_gc_step_ptr) {
+    npages = number_of_pages_since_major_gc;
+    flush_batch();
+    number_of_pages_since_major_gc = npages;
+  } else if (first_generation_allocation_ptr != idle_gc_flush_ptr
+	     || pretenured_gn != INVALID_GENERATION_NUMBER
+#ifdef BACKGROUND_GC
+	     || background_gc_step_is_pending
+#endif
+	     )
+    flush_batch();
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    /* The commit left a step to the background thread. */
+    return 1;
+#endif
+  if (!is_collecting && !idle_major_gc_is_due())
+    /* The commit finished the collection. */
+    return 1;
+  /* Starting the collection only marks the generations.  Its steps
+     must be logged after the next commit, which starts a new list of
+     generation pinfos for them. */
+  major_gc(1);
+  if (delta_log_is_open)
+    /* The step moved cells, see the delta log above. */
+    delta_log_header[DELTA_COOKIE] = 0;
+  idle_gc_step_ptr = first_generation_allocation_ptr;
+  return 1;
 }
 
 
@@ -1938,9 +5322,11 @@ static void rvy_new_generation(unsigned long number_of_referring_ptrs)
 void flush_batch(void)
 {
   int i;
-  ptr_t p;
+  ptr_t p, pinfo_ptr;
   disk_page_number_t last_dpn;
   unsigned long number_of_referring_ptrs;
+  unsigned long number_of_allocated_words, number_of_survivor_words;
+  word_t checkpoint_flags = 0;
 #ifdef GC_PROFILING
   /* Initialize to 1 instead of 0 to prevent division by zero. */
   static unsigned long data_kbytes = 1;
@@ -1948,34 +5334,76 @@ void flush_batch(void)
 
   number_of_written_bytes = 0;
 #endif
-  if (first_generation_allocation_ptr == first_generation_start)
+  if (first_generation_allocation_ptr == first_generation_start
+      && pretenured_gn == INVALID_GENERATION_NUMBER)
     /* Nothing has been allocated; no commit processing needed. */
     return;
   /* Clear the oid freelist, see `oid.c'. */
   SET_ROOT_WORD(oid_freelist, NULL_WORD);
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    finish_background_gc_step();
+#endif
+  /* The pages of the previous commit group may be mutated below. */
+  wait_for_commit();
+#ifdef TIERED_STORAGE
+  if (lazy_disk_page != NULL && max_resident_size > 0)
+    evict_cold_generations();
+#endif
+  io_begin_commit();
+  number_of_allocated_words =
+    first_generation_start - first_generation_allocation_ptr;
+  if (pretenured_gn != INVALID_GENERATION_NUMBER)
+    number_of_allocated_words +=
+      generation_info[pretenured_gn].npages * NUMBER_OF_WORDS_PER_PAGE;
   number_of_referring_ptrs = collect_first_generation();
+  /* The words actually copied, not the pages written for them. */
+  number_of_survivor_words = 0;
+  for (i = 0; i < generation_info[youngest_gn].npages; i++)
+    number_of_survivor_words +=
+      PAGE_GET_NUMBER_OF_WORDS_IN_USE(generation_info[youngest_gn].page[i])
+      - PAGE_HEADER_WORDS;
+  note_pages_in_commit(generation_info[youngest_gn].npages);
+#ifdef BACKGROUND_GC
+  if (background_gc_step_is_pending)
+    retire_background_gc_step();
+#endif
   /* Wrap up some metadata. */
   cache_generation_pinfo_to_root(number_of_referring_ptrs);
+  save_gc_statistics();
   /* Finish the commit group in writing the root block. */
   io_write_root();
+  if (replication_port != 0) {
+    commit_is_unshipped = 1;
+#ifdef PIPELINED_COMMIT
+    /* With a pipelined commit, only once it is on disk. */
+    if (!pipelined_commit)
+#endif
+      ship_commit();
+  }
   /* Start a new commit group by clearing the root block and copying
      the metadata that was cached in the root block into the actual
      database image. */
   clear_first_generation();
   if (major_gc_was_started) {
     major_gc_was_started = 0;
+    checkpoint_flags |= DELTA_MAJOR_GC_WAS_STARTED;
     /* Now that the commit group that finalized the previous major gc
        round has been successfully finished we can free some old disk
        pages. */
-    mark_twice_collected_generations_nonexistent();
-    /* Start a new pinfo list. */
-    SET_ROOT_PTR(prev_prev_generation_pinfo_list,
-		 GET_ROOT_PTR(prev_generation_pinfo_list));
-    SET_ROOT_PTR(prev_generation_pinfo_list, 
-		 GET_ROOT_PTR(generation_pinfo_list));
-    SET_ROOT_PTR(generation_pinfo_list, NULL_PTR);
+#ifdef PIPELINED_COMMIT
+    if (pipelined_commit) {
+      /* With a pipelined commit, only once it is on disk. */
+      assert(generations_freed_after_commit == INVALID_GENERATION_NUMBER);
+      generations_freed_after_commit = generations_collected_twice;
+      generations_collected_twice = INVALID_GENERATION_NUMBER;
+    } else
+#endif
+      mark_twice_collected_generations_nonexistent();
+    start_generation_pinfo_list();
   }
   log_to_generation_pinfo_list(0, number_of_referring_ptrs);
+  pinfo_ptr = first_generation_allocation_ptr;
 #ifdef GC_PROFILING
   /* Statistics. */
   data_kbytes += number_of_written_bytes / 1024;
@@ -1995,13 +5423,113 @@ void flush_batch(void)
   /* More statistics. */
   total_kbytes += number_of_written_bytes / 1024;
 #endif
+  /* E.g. a batch of only empty pretenured pages allocates nothing. */
+  if (number_of_allocated_words > 0)
+    commit_survival_rate =
+      0.75 * commit_survival_rate
+      + 0.25 * number_of_survivor_words / (double) number_of_allocated_words;
+  end_commit(number_of_survivor_words);
   if (must_show_groups)
     fprintf(stderr, "\n");
+  if (delta_log_is_open) {
+    /* A step left to the background is logged only by the next
+       checkpoint. */
+    if (first_generation_allocation_ptr == pinfo_ptr) {
+      start_delta_log(checkpoint_flags);
+      io_seek_delta_log(0);
+    } else
+      /* A major gc step moved cells, see the delta log above. */
+      delta_log_header[DELTA_COOKIE] = 0;
+  }
+  idle_gc_flush_ptr = first_generation_allocation_ptr;
+  idle_gc_step_ptr = NULL;
 }
 
 
 /* Recovery and initialization routines. */
 
+#ifdef HAVE_MMAP
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE  0
+#endif
+
+/* The mapping is aligned to this if `huge_pages' is set, so that the
+   kernel can use huge pages from the very beginning of it. */
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+/* Map `size' bytes of anonymous memory starting at a multiple of
+   `alignment'.  Return zero if `mmap' fails. */
+static ptr_as_scalar_t map_aligned(unsigned long size,
+				   unsigned long alignment,
+				   int flags)
+{
+  char *p;
+  unsigned long head;
+
+  p = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED)
+    return 0;
+  head = (alignment - (ptr_as_scalar_t) p % alignment) % alignment;
+  if (head > 0)
+    munmap(p, head);
+  munmap(p + head + size, alignment - head);
+  return (ptr_as_scalar_t) (p + head);
+}
+
+#endif
+
+
+/* Reserve `size' bytes of page-aligned memory for the main memory
+   image of the database.  If `mmap' is available, the memory is only
+   populated as it is touched, so that starting up a large database
+   does not have to wait for all of its memory.  Return zero on
+   failure. */
+static ptr_as_scalar_t allocate_db_memory(unsigned long size)
+{
+  ptr_as_scalar_t base = 0;
+#ifdef HAVE_MMAP
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  unsigned long alignment = PAGE_SIZE;
+
+  if (huge_pages) {
+    if (alignment < HUGE_PAGE_SIZE)
+      alignment = HUGE_PAGE_SIZE;
+    size = (size + alignment - 1) / alignment * alignment;
+  }
+#ifdef MAP_HUGETLB
+  if (huge_pages == 2) {
+    /* Without MAP_NORESERVE the mapping fails instead of causing a
+       SIGBUS later if the pool is too small. */
+    base = map_aligned(size, alignment,
+		       (flags & ~MAP_NORESERVE) | MAP_HUGETLB);
+    if (base == 0 && be_verbose)
+      fprintf(stderr,
+	      "allocate_db_memory: Huge page pool too small, "
+	      "using transparent huge pages.\n");
+  }
+#endif
+  if (base == 0) {
+    base = map_aligned(size, alignment, flags);
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+    if (base != 0 && huge_pages)
+      madvise((void *) base, size, MADV_HUGEPAGE);
+#endif
+  }
+#else /* not HAVE_MMAP */
+#ifdef HAVE_MEMALIGN
+  base = (ptr_as_scalar_t) memalign(PAGE_SIZE, size);
+  assert(base % PAGE_SIZE == 0);
+#else
+  base = (ptr_as_scalar_t) malloc(size + PAGE_SIZE);
+  if (base % PAGE_SIZE != 0)
+    base += PAGE_SIZE - (base % PAGE_SIZE);
+#endif
+#endif /* not HAVE_MMAP */
+  return base;
+}
+
+
 int init_shades(int argc, char **argv)
 {
   int i;
@@ -2038,7 +5566,21 @@ int init_shades(int argc, char **argv)
 	    "  This will waste memory.\n",
 	    PAGE_SIZE / 1024, first_generation_size / 1024);
   }
+#ifdef PARALLEL_GC
+  if (gc_threads > 0)
+    number_of_gc_workers = gc_threads;
+  else {
+    number_of_gc_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (number_of_gc_workers < 1)
+      number_of_gc_workers = 1;
+  }
+#endif
   if ((unsigned long) (first_generation_size + PAGE_SIZE - 1) / PAGE_SIZE 
+#ifdef PARALLEL_GC
+      /* Each parallel gc worker may leave one to-page partially
+	 filled. */
+      + number_of_gc_workers - 1
+#endif
       > MAX_GENERATION_SIZE) {
     fprintf(stderr, 
 	    "Fatal: Page size (%d kB) so small and first generation so large\n"
@@ -2080,24 +5622,20 @@ int init_shades(int argc, char **argv)
 
   /* Allocate page-aligned memory for the main memory image of the
      database. */
-#ifdef HAVE_MEMALIGN
-  mem_base = (ptr_as_scalar_t)
-    memalign(PAGE_SIZE, db_size + first_generation_size);
-  assert(mem_base % PAGE_SIZE == 0);
-#else
-  mem_base = (ptr_as_scalar_t)
-    malloc(PAGE_SIZE * (number_of_pages + 1) + first_generation_size);
-  if (mem_base % PAGE_SIZE != 0)
-    mem_base += PAGE_SIZE - (mem_base % PAGE_SIZE);
-#endif
+  mem_base = allocate_db_memory(PAGE_SIZE * number_of_pages
+				+ first_generation_size);
   if (mem_base == 0) {
     fprintf(stderr, "shades_init: Failed to malloc the database.\n");
     exit(1);
   }
 
-  /* Initialize the magic cookie of each page. */
+#ifndef NDEBUG
+  /* Initialize the magic cookie of each page for the assertions in
+     `free_page' and `rvy_allocate_page'.  Otherwise it is written by
+     `allocate_page' or read from the disk. */
   for (pn = 0; pn < number_of_pages; pn++)
     PAGE_NUMBER_TO_PAGE_PTR(pn)[0] = PAGE_MAGIC_COOKIE;
+#endif
 
   /* Cut out the first generation's part of the memory area, and
      initialize it. */
@@ -2113,6 +5651,32 @@ int init_shades(int argc, char **argv)
     fprintf(stderr, "shades_init: Failed to malloc `copy_stack'.\n");
     exit(1);
   }
+#ifdef HIERARCHICAL_GC
+  assert(kid_stack == NULL);
+  kid_stack = malloc(NUMBER_OF_WORDS_PER_PAGE * sizeof(ptr_t));
+  if (kid_stack == NULL) {
+    fprintf(stderr, "shades_init: Failed to malloc `kid_stack'.\n");
+    exit(1);
+  }
+#endif
+#ifdef REM_SET_BITMAP
+  assert(rem_set_bitmap == NULL);
+  rem_set_page_bitmap_size =
+    (number_of_pages + REM_SET_BITS_PER_WORD - 1) / REM_SET_BITS_PER_WORD;
+  rem_set_bitmap =
+    calloc(number_of_pages * (NUMBER_OF_WORDS_PER_PAGE
+			      / REM_SET_BITS_PER_WORD),
+	   sizeof(word_t));
+  rem_set_page_union = malloc(rem_set_page_bitmap_size * sizeof(word_t));
+  if (rem_set_bitmap == NULL || rem_set_page_union == NULL) {
+    fprintf(stderr, "shades_init: Failed to malloc the remembered sets.\n");
+    exit(1);
+  }
+#endif
+#ifdef PARALLEL_GC
+  if (number_of_gc_workers > 1)
+    init_gc_workers();
+#endif
 
   assert(page_info == NULL);
   page_info = malloc(number_of_pages * sizeof(page_info_t));
@@ -2126,6 +5690,11 @@ int init_shades(int argc, char **argv)
      pages. */
   generation_info_grow(32 + number_of_pages / 4);
 
+#ifdef BACKGROUND_GC
+  if (background_gc)
+    init_background_gc();
+#endif
+
   return 0;
 }
 
@@ -2145,6 +5714,11 @@ void create_db(void)
     page_info[pn].is_allocated = 1;
     free_page(pn);
   }
+#ifdef TIERED_STORAGE
+  if (max_resident_size > 0)
+    init_lazy_pages();
+#endif
+  delta_log_is_open = io_open_delta_log(1);
 
   flush_batch();		/* XXX Is this needed? */
 }
@@ -2155,20 +5729,45 @@ void create_db(void)
 static disk_page_number_t *rvy_disk_page;
 
 
+/* Tell the IO that the pages of the given generation will be read.
+   Recovery reads a generation only when the `generation_pinfo' cells
+   read before it describe it, and then waits for the reads, so the
+   reads of the generations would go one after another.  The pages of
+   the generations to be read later are therefore announced as soon
+   as they are known, and `rvy_read_generation' starts reading all
+   announced pages in the background. */
+static void rvy_read_generation_ahead(generation_number_t gn)
+{
+  int i;
+
+  for (i = 0; i < generation_info[gn].npages; i++)
+    if (rvy_disk_page[generation_info[gn].page[i]]
+	!= generation_info[gn].disk_page[i])
+      io_read_page_ahead(generation_info[gn].disk_page[i]);
+}
+
+
 /* Based on the existsing meta-data, read the data pages of the
    specified generation into memory.  `read_generation' might be
    called several times for the same generation, subsequent calls read
-   only those pages which really do need to be reread. */
+   only those pages which really do need to be reread.  The pages are
+   checked only after all reads have been started, so that checking
+   does not delay issuing the reads. */
 static void rvy_read_generation(generation_number_t gn)
 {
   int i;
   page_number_t pn;
   disk_page_number_t dpn;
   
+  rvy_read_generation_ahead(gn);
+  io_start_read_ahead();
   for (i = 0; i < generation_info[gn].npages; i++) {
     pn = generation_info[gn].page[i];
     dpn = generation_info[gn].disk_page[i];
     if (rvy_disk_page[pn] != dpn) {
+#ifdef LAZY_RECOVERY
+      forget_lazy_page(pn);
+#endif
       rvy_allocate_page(pn);
       page_info[pn].generation = &generation_info[gn];
       io_declare_disk_page_allocated(dpn);
@@ -2177,14 +5776,57 @@ static void rvy_read_generation(generation_number_t gn)
 #else
       io_read_page(PAGE_NUMBER_TO_PAGE_PTR(pn), PAGE_SIZE, dpn);
 #endif
-      rvy_disk_page[pn] = dpn;
     }
   }
 #ifdef ASYNC_IO
   io_read_page_wait();
 #endif
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    pn = generation_info[gn].page[i];
+    dpn = generation_info[gn].disk_page[i];
+    if (rvy_disk_page[pn] != dpn) {
+      check_page(pn, dpn);
+      rvy_disk_page[pn] = dpn;
+      page_info[pn].is_dirty = 0;
+    }
+  }
+}
+
+
+#ifdef LAZY_RECOVERY
+
+/* As `rvy_read_generation', but if lazy recovery is in use, leave
+   the pages to be read when they are first touched. */
+static void rvy_read_generation_lazily(generation_number_t gn)
+{
+  int i;
+  page_number_t pn;
+  disk_page_number_t dpn;
+
+  if (lazy_disk_page == NULL) {
+    rvy_read_generation(gn);
+    return;
+  }
+  for (i = 0; i < generation_info[gn].npages; i++) {
+    pn = generation_info[gn].page[i];
+    dpn = generation_info[gn].disk_page[i];
+    if (rvy_disk_page[pn] != dpn) {
+      forget_lazy_page(pn);
+      rvy_allocate_page(pn);
+      page_info[pn].generation = &generation_info[gn];
+      io_declare_disk_page_allocated(dpn);
+      make_page_lazy(pn, dpn);
+      rvy_disk_page[pn] = dpn;
+    }
+  }
 }
 
+#else
+
+#define rvy_read_generation_lazily(gn)  rvy_read_generation(gn)
+
+#endif
+
 
 /* Read in the generations listed in `generations' and tuck them as
    older generations of `younger_gn'.  This routune performs no
@@ -2226,7 +5868,36 @@ static void rvy_base_major_gc_round(generation_number_t younger_gn,
       generation_info[gn].page[i] = p[4 + 2*i];
       generation_info[gn].disk_page[i] = p[4 + 2*i + 1];
     }
-    rvy_read_generation(gn);
+    /* These generations are not collected during this round, so
+       they can be read later when needed. */
+    rvy_read_generation_lazily(gn);
+  }
+}
+
+
+/* Recover the passing over of the generation `gn' by the major
+   collection to `to_gn', see `pass_over_generation'.  Return 0 if the
+   major collection was then finished. */
+static int rvy_pass_over_generation(generation_number_t gn)
+{
+  /* All older generations were marked when the major collection was
+     started, so `gn' has remembered the references to it since. */
+  assert(generation_info[gn].status == TO_BE_COLLECTED);
+  forget_rem_set(gn);
+  replace_passed_over_generation(gn);
+  /* If `gn' was read in `rvy_base_major_gc_round', the referrers in
+     it may have been redirected since. */
+  rvy_read_generation(to_gn);
+  scan_generation_to_rem_sets(to_gn);
+  /* Peek forward as in `rvy_major_gc_step'. */
+  gn = generation_info[to_gn].older;
+  if (gn == INVALID_GENERATION_NUMBER
+      || generation_info[gn].status != TO_BE_COLLECTED) {
+    prev_to_gn = INVALID_GENERATION_NUMBER;
+    return 0;
+  } else {
+    prev_to_gn = to_gn;
+    return 1;
   }
 }
 
@@ -2299,15 +5970,24 @@ static void rvy_batch(generation_number_t younger_gn,
       rvy_new_generation(number_of_referring_ptrs);
   } else {
     assert(next_p != NULL_PTR);
+    /* Read only after the recursion, see `rvy_read_generation_ahead'. */
+    rvy_read_generation_ahead(gn);
     rvy_batch(younger_gn,
 	      next_p,
 	      prev_generation_pinfo_list,
 	      prev_prev_generation_pinfo_list);
     to_gn = gn;
-    rvy_read_generation(gn);
-    if (!rvy_major_gc_step(number_of_from_generations,
-			   number_of_referring_ptrs))
-      is_collecting = 0;
+    if (number_of_from_generations == PASSED_OVER_GENERATION) {
+      /* The number of referring pointers is the generation replaced
+	 by `gn'. */
+      if (!rvy_pass_over_generation(number_of_referring_ptrs))
+	is_collecting = 0;
+    } else {
+      rvy_read_generation(gn);
+      if (!rvy_major_gc_step(number_of_from_generations,
+			     number_of_referring_ptrs))
+	is_collecting = 0;
+    }
   }
 }
 
@@ -2325,6 +6005,10 @@ void recover_db(void)
   assert(mem_base != 0);
 
   is_recovering = 1;
+#ifdef LAZY_RECOVERY
+  if (lazy_recovery)
+    init_lazy_pages();
+#endif
   rvy_disk_page = malloc(number_of_pages * sizeof(disk_page_number_t));
   if (rvy_disk_page == NULL) {
     fprintf(stderr, "Fatal: malloc failed for `rvy_disk_page'.\n");
@@ -2336,8 +6020,23 @@ void recover_db(void)
     free_page(pn);
   }
 
+  if (standby_of[0] != '\0')
+    replica_standby();
   io_open_file();
   io_read_root();
+  /* Recovery redoes the copying of the major collection, which goes
+     astray if this build copies in a different order. */
+  if (GET_ROOT_WORD(gc_copy_order) != GC_COPY_ORDER) {
+    fprintf(stderr,
+	    "Fatal: the database was written with copy order %lu, "
+	    "this build uses %lu.\n"
+	    "  Recover it with the same `--enable-rem-set-bitmap' and\n"
+	    "  `--enable-hierarchical-gc' configure options.\n",
+	    (unsigned long) GET_ROOT_WORD(gc_copy_order),
+	    (unsigned long) GC_COPY_ORDER);
+    exit(2);
+  }
+  restore_gc_statistics();
 
   /* Read in the very youngest generation using the information in the
      root block. */
@@ -2372,6 +6071,21 @@ void recover_db(void)
   io_declare_unallocated_pages_free();
   free(rvy_disk_page);
   is_recovering = 0;
+#ifdef TIERED_STORAGE
+  if (max_resident_size > 0)
+    init_lazy_pages();
+#endif
+#ifdef LAZY_RECOVERY
+  if (be_verbose && lazy_disk_page != NULL)
+    fprintf(stderr, "recover_db: %lu pages left to be read on demand.\n",
+	    number_of_lazy_pages);
+#endif
+
+  delta_log_is_open = io_open_delta_log(0);
+  if (delta_log_is_open) {
+    rvy_delta_log(number_of_referring_ptrs);
+    return;
+  }
 
   /* Now do what we would have done at the end of a normal commit
      group.  See `flush_batch' for comparison. */
@@ -147,7 +147,7 @@ extern inline ptr_t allocate(int number_of_words, cell_type_t type)
   number_of_words_allocated += number_of_words;
 #endif
   first_generation_allocation_ptr -= number_of_words;
-  *first_generation_allocation_ptr = type << (32 - CELL_TYPE_BITS);
+  *first_generation_allocation_ptr = CELL_HEADER(type);
   return first_generation_allocation_ptr;
 }
 
@@ -178,6 +178,27 @@ extern inline int is_in_first_generation(ptr_t p)
 #endif /* else __GNUC__ && !NDEBUG */
 
 
+/* Pretenuring.  `allocate_mature' allocates the cell directly to a
+   page of the mature generation that the next commit creates, so
+   that the commit needn't copy it out of the first generation.  This
+   suits cells that are known to survive the commit, e.g. the records
+   of a bulk load or large values.  The cell is kept until the next
+   major collection even if it dies meanwhile.
+
+   A pretenured cell is not in the first generation, and it should be
+   initialized before the commit and not changed after it.  Its
+   pointers may refer to cells in the first generation, which the
+   commit then copies as if they were referred to by the root block.
+
+   `allocate_mature' requires a prior `can_allocate_mature' for the
+   same number of words, as `allocate' requires `can_allocate'.
+   `can_allocate_mature' may take a page worth of the first
+   generation for the pretenured cells, so it must be called before
+   `can_allocate'.  If it returns zero, one should `flush_batch'. */
+int can_allocate_mature(int number_of_words);
+ptr_t allocate_mature(int number_of_words, cell_type_t type);
+
+
 #ifdef ENABLE_RED_ZONES
 
 /* Check the consistency and surrounding red zones of the `heaviness'
@@ -201,6 +222,50 @@ void first_generation_fprint(FILE *fp, unsigned int heaviness);
    block. */
 void flush_batch(void);
 
+/* Returns non-zero if the current commit batch should be closed with
+   `flush_batch' before the first generation is full, because it has
+   been open for `commit_deadline_usecs' or because its survivors are
+   estimated to exceed `commit_survivor_limit'. */
+int commit_is_due(void);
+
+/* Called when the application has nothing else to do, e.g. by the
+   interpreter when it has no runnable threads.  Commits the current
+   batch if needed and does at most one step of mature garbage
+   collection, if a collection is under way or due.  Returns non-zero
+   if it did something and should be called again, after checking for
+   new work.  It may move data like `flush_batch'. */
+int idle_gc_step(void);
+
+/* Like `flush_batch', but if `delta_log_filename' is given and less
+   than `delta_log_checkpoint_size' bytes of the first generation are
+   in use, only appends the cells allocated in the batch and the root
+   block to the delta log.  Nothing is moved then. */
+void commit_batch(void);
+
+/* The cells at and above this in the first generation are in the
+   delta log, and must not be changed in place. */
+extern ptr_t first_generation_logged_ptr;
+
+/* With `pipelined_commit', `flush_batch' returns before the commit
+   batch is on disk.  `wait_for_commit' waits until it is, e.g. before
+   acknowledging the transactions of the batch to the client. */
+void wait_for_commit(void);
+
+/* Online backups.  `start_backup' commits the current batch like
+   `flush_batch' and starts writing a backup of the database as of
+   that commit to `fd', which may be a file or a pipe.  If
+   `is_incremental', the backup contains only what has changed since
+   the previous backup.  The disk pages of the backup are then copied
+   by calling `backup_step' between the transactions until it returns
+   non-zero.  Meanwhile the disk space of the pages is not reused. */
+void start_backup(int fd, int is_incremental);
+int backup_step(unsigned long number_of_pages);
+
+/* Instead of `create_db', restore the database files from a full
+   backup and each incremental backup taken after it in turn, and
+   then call `recover_db'. */
+void restore_backup(int fd);
+
 /* The initialization sequence should be as follows:
 
      1. The main program reads its command line arguments, and
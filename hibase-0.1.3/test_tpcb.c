@@ -13,6 +13,7 @@
 #include "trie.h"
 #include "root.h"
 #include "test_aux.h"
+#include "replica.h"
 #include <time.h>
 
 
@@ -64,11 +65,29 @@ int duration_in_seconds = 0;
 int show_progress = 0;
 int scatter_key = 0;
 
+/* With `--backup=FILE' a backup is taken to FILE halfway through the
+   run, and with `--restore=FILE' the database is restored from it
+   instead of created.  Both print a digest of the balances, which
+   should then be the same.  Likewise a primary run with
+   `--replication_port' prints the digest when it stops, and so does
+   its standby run with `--standby_of' when it has taken over. */
+char *backup_filename = NULL;
+char *restore_filename = NULL;
+int backup_fd = -1;
+
 int *latency_table = NULL;
 double latency_time_interval = 0;
 
+extern unsigned long number_of_commits;
+extern long commit_latency_p99_usecs;
+extern long max_commit_latency_usecs;
+
 static void tpcb_create(void);
+static void tpcb_restore(void);
+static void tpcb_standby(void);
 static void tpcb_run(void);
+static void step_backup(void);
+static word_t check_balances(void);
 static void tpcb_do_one_transaction(word_t, word_t, word_t, word_t);
 static void insert_records(void);
 static void print_table(char *);
@@ -81,7 +100,8 @@ int main(int argc, char *argv[])
   
   if (argc < 3) {
     fprintf(stderr,
-	    "Usage: %s tpcb-size seconds [--show-progress] [--scatter-key] [params]\n",
+	    "Usage: %s tpcb-size seconds [--show-progress] [--scatter-key]\n"
+	    "  [--backup=FILE] [--restore=FILE] [params]\n",
 	    argv[0]);
     exit(1);
   }
@@ -102,6 +122,12 @@ int main(int argc, char *argv[])
     } else if (strcmp("--scatter-key", argv[i]) == 0) {
       scatter_key = 1;
       argv[i] = NULL;
+    } else if (strncmp("--backup=", argv[i], 9) == 0) {
+      backup_filename = argv[i] + 9;
+      argv[i] = NULL;
+    } else if (strncmp("--restore=", argv[i], 10) == 0) {
+      restore_filename = argv[i] + 10;
+      argv[i] = NULL;
     }
   }
 
@@ -113,16 +139,31 @@ int main(int argc, char *argv[])
 	&& strcmp(argv[i], "-v")
 	&& strcmp(argv[i], "--verbose")) {
       fprintf(stderr,
-	      "Usage: %s tpcb-size seconds [--show-progress] [--scatter-key] [params]\n",
+	      "Usage: %s tpcb-size seconds [--show-progress] [--scatter-key]\n"
+	      "  [--backup=FILE] [--restore=FILE] [params]\n",
 	      argv[0]);
       exit(1);
     }
 
-  tpcb_create();
+  if (restore_filename != NULL)
+    tpcb_restore();
+  else if (standby_of[0] != '\0')
+    tpcb_standby();
+  else
+    tpcb_create();
   if (duration_in_seconds > 0) {
     tpcb_run();
     flush_batch();
   }
+  /* A backup started near the end of the run is completed here. */
+  while (backup_fd != -1)
+    step_backup();
+  if (replication_port != 0) {
+    wait_for_commit();
+    replica_close();
+    fprintf(stdout, "Final balance digest: 0x%08lX\n",
+	    (unsigned long) check_balances());
+  }
 #if 0
   print_table(TABLE_NAME_TELLER);
 #endif
@@ -139,6 +180,64 @@ static void tpcb_create()
   flush_batch();
 }
 
+/* Restore the database from `restore_filename' and check that the
+   balances of the restored tables agree. */
+static void tpcb_restore()
+{
+  int fd;
+
+  if (be_verbose)
+    fprintf(stdout, "Restoring database \"%s\" from \"%s\"...\n",
+	    disk_filename, restore_filename);
+  fd = open(restore_filename, O_RDONLY);
+  if (fd == -1) {
+    perror("tpcb_restore/open");
+    exit(1);
+  }
+  restore_backup(fd);
+  close(fd);
+  recover_db();
+  fprintf(stdout, "Restored balance digest: 0x%08lX\n",
+	  (unsigned long) check_balances());
+}
+
+/* Take over from the primary named by `standby_of' when it is gone,
+   and check that the balances agree. */
+static void tpcb_standby()
+{
+  recover_db();
+  fprintf(stdout, "Standby balance digest: 0x%08lX\n",
+	  (unsigned long) check_balances());
+}
+
+/* Start a backup to `backup_filename'. */
+static void start_tpcb_backup(long number_of_transactions)
+{
+  backup_fd = open(backup_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (backup_fd == -1) {
+    perror("start_tpcb_backup/open");
+    exit(1);
+  }
+  start_backup(backup_fd, 0);
+  /* `start_backup' committed the batch, so this is what the backup
+     contains. */
+  fprintf(stdout,
+	  "Backup after %ld transactions, balance digest: 0x%08lX\n",
+	  number_of_transactions, (unsigned long) check_balances());
+}
+
+/* Copy a page of the backup, and close the file when done. */
+static void step_backup()
+{
+  if (!backup_step(1))
+    return;
+  if (close(backup_fd)) {
+    perror("step_backup/close");
+    exit(1);
+  }
+  backup_fd = -1;
+}
+
 #define TRANSACTION_SET_SIZE    2048
 
 static word_t balance;
@@ -192,10 +291,20 @@ static void tpcb_run()
       trans_set[i][3] = delta;
     }
 
+    if (backup_filename != NULL
+	&& backup_fd == -1
+	&& 2 * total_runtime >= duration_in_seconds) {
+      start_tpcb_backup(number_of_transactions);
+      backup_filename = NULL;
+    }
+
     start_time = give_time();
-    for (i = 0; i < TRANSACTION_SET_SIZE; i++) 
+    for (i = 0; i < TRANSACTION_SET_SIZE; i++) {
       tpcb_do_one_transaction(trans_set[i][0], trans_set[i][1], 
 			      trans_set[i][2], trans_set[i][3]);
+      if (backup_fd != -1)
+	step_backup();
+    }
     end_time = give_time();
 
     trans_set_runtime = end_time - start_time;
@@ -244,6 +353,13 @@ static void tpcb_run()
     fprintf(stdout, "\n");
   }
 
+  if (commit_deadline_usecs > 0 || commit_latency_target_usecs > 0)
+    fprintf(stdout, 
+	    "Commits: %lu, p99 latency: %ld usecs, max latency: %ld usecs\n",
+	    number_of_commits,
+	    commit_latency_p99_usecs,
+	    max_commit_latency_usecs);
+
   fprintf(stdout, "@@@ Total transactions: %ld & TPS: %.2f @@@\n", 
 	  number_of_transactions,
 	  (float) number_of_transactions / total_runtime);
@@ -293,6 +409,8 @@ static void tpcb_do_one_transaction(word_t bid, word_t tid, word_t aid,
   double flush_batch_time_current = 0;
   static double flush_batch_time_prev = 0;
 
+  if (commit_is_due())
+    commit_batch();
   while (!can_allocate(3 * TRIE_MAX_ALLOCATION
 		       + B_RECORD_SIZE + 1
 		       + T_RECORD_SIZE + 1
@@ -428,7 +546,8 @@ static void insert_records()
   if (be_verbose)
     fprintf(stdout, "Creating table \"%s\"...\n", TABLE_NAME_ACCOUNT);
   for (key = 0; key < ACCOUNTS_PER_TPCB * tps; key++) {
-    while (!can_allocate(TRIE_MAX_ALLOCATION + A_RECORD_SIZE + 1))
+    while (!can_allocate_mature(A_RECORD_SIZE + 1)
+	   || !can_allocate(TRIE_MAX_ALLOCATION))
       flush_batch();
 #if 0
     if (key % 10000 == 0)
@@ -439,7 +558,9 @@ static void insert_records()
     else 
       skey = key;
 
-    a_record = allocate(1 + A_RECORD_SIZE, CELL_word_vector);
+    /* The account records are loaded in bulk and live long, so they
+       are pretenured. */
+    a_record = allocate_mature(1 + A_RECORD_SIZE, CELL_word_vector);
     a_record[0] |= A_RECORD_SIZE;
     a_record[A_RECORD_AID_IDX] = skey;
     a_record[A_RECORD_BID_IDX] = 0;
@@ -453,6 +574,44 @@ static void insert_records()
   }
 }
 
+/* Check that the branch, teller and account balances each sum up to
+   the same, as every transaction adds the same delta to each, and
+   return a digest of the balances. */
+static word_t check_balances()
+{
+  ptr_t data;
+  word_t key, digest = 0, b_sum = 0, t_sum = 0, a_sum = 0;
+
+  for (key = 0; key < BRANCHES_PER_TPCB * tps; key++) {
+    data = trie_find(GET_ROOT_PTR(test_branch),
+		     scatter_key ? scatter(key) : key);
+    assert(data != NULL_PTR);
+    b_sum += data[B_RECORD_BAL_IDX];
+    digest = 31 * digest + data[B_RECORD_BAL_IDX];
+  }
+  for (key = 0; key < TELLERS_PER_TPCB * tps; key++) {
+    data = trie_find(GET_ROOT_PTR(test_teller),
+		     scatter_key ? scatter(key) : key);
+    assert(data != NULL_PTR);
+    t_sum += data[T_RECORD_BAL_IDX];
+    digest = 31 * digest + data[T_RECORD_BAL_IDX];
+  }
+  for (key = 0; key < ACCOUNTS_PER_TPCB * tps; key++) {
+    data = trie_find(GET_ROOT_PTR(test_account),
+		     scatter_key ? scatter(key) : key);
+    assert(data != NULL_PTR);
+    a_sum += data[A_RECORD_BAL_IDX];
+    digest = 31 * digest + data[A_RECORD_BAL_IDX];
+  }
+  if (b_sum != t_sum || b_sum != a_sum) {
+    fprintf(stderr, "check_balances: The balances do not agree: "
+	    "branches %ld, tellers %ld, accounts %ld.\n",
+	    (long) b_sum, (long) t_sum, (long) a_sum);
+    exit(1);
+  }
+  return digest;
+}
+
 /* Print table `table_name'. */
 static void print_table(char *table_name)
 {
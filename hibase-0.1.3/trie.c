@@ -645,7 +645,7 @@ ptr_t trie_delete(ptr_t trie_root,
 	new_prefix |= son[0] & NODE_PREFIX_MASK;
 	/* Clear the `p[0]' from possible previous prefixes and
 	   lengths.  Save the type tag. */
-	p[0] &= 0xFF << 24;
+	p[0] &= CELL_TYPE_MASK;
 	/* Store the length of the new prefix to `p[0]'. */
 	p[0] |= (prefix_length + 2 + son_prefix_length) << 19;
 	/* Store the new prefix to `p[0]'. */
@@ -1060,7 +1060,7 @@ ptr_t trie_delete_set(ptr_t trie_root, word_t key[], int number_of_keys)
 	      new_prefix |= ix - 1;
 	      new_prefix <<= son_prefix_length;
 	      new_prefix |= son[0] & NODE_PREFIX_MASK;
-	      p[0] &= 0xFF << 24;
+	      p[0] &= CELL_TYPE_MASK;
 	      p[0] |= (prefix_length + 2 + son_prefix_length) << 19;
 	      p[0] |= new_prefix;
 	      p[1] = son[1];
@@ -1192,7 +1192,7 @@ ptr_t trie_delete_set(ptr_t trie_root, word_t key[], int number_of_keys)
 	      new_prefix |= ix - 1;
 	      new_prefix <<= son_prefix_length;
 	      new_prefix |= son[0] & NODE_PREFIX_MASK;
-	      p[0] &= 0xFF << 24;
+	      p[0] &= CELL_TYPE_MASK;
 	      p[0] |= (prefix_length + 2 + son_prefix_length) << 19;
 	      p[0] |= new_prefix;
 	      p[1] = son[1];